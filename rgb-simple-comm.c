@@ -70,7 +70,12 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 // Helper macros for setting bitflags
 #define GETBIT( VARIABLE, BITPOS )                 ( VARIABLE   &  (1u<<BITPOS) )
@@ -129,284 +134,9016 @@ uint8_t validParity_u8bit (uint8_t data, uint8_t parity_bit, paritySel_t parityS
 
 
 
+/*
+  CRC
+*/
+// CRC-8, polynomial 0x07 (x^8 + x^2 + x + 1), initial value 0
+uint8_t crc8_update (uint8_t crc, const uint8_t *data, size_t length) {
+  for (size_t i = 0 ; i < length ; i++) {
+    crc ^= data[i];
+    for (int bit = 0 ; bit < 8 ; bit++) {
+      crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+
+
+/*
+  COLOUR MAPPING
+
+  Each 2bit value is sent as a step along a cycle of the 5 data colours,
+  starting after the previous colour (or at the start of the cycle after
+  DARK, YELLOW or WHITE). The order of that cycle decides which colours
+  stand for neighbouring values. Some colour pairs (BLUE/CYAN, RED/MAGENTA)
+  are much easier to confuse than others on a real LED, so the order, and
+  which step along the cycle stands for which 2bit value, are a runtime
+  selectable table.
+*/
+
+typedef struct colourMap {
+  rgb_colour_t order[5];       // Data colours in cycle order
+  uint8_t step[4];             // Cycle step used for each half nibble value
+  rgb_colour_t encode[8][4];   // [previous colour][half nibble] -> next colour
+  int8_t decode[8][8];         // [previous colour][incoming colour] -> half nibble (-1 if not a data transition)
+} colourMap_t;
+
+// Cycle order BLUE, GREEN, CYAN, RED, MAGENTA (Same tables as colourMap_build() creates for that order)
+const colourMap_t colourMap_default = {
+  .order = { BLUE, GREEN, CYAN, RED, MAGENTA },
+  .step = { 0, 1, 2, 3 },
+  .encode = {
+    { BLUE, GREEN, CYAN, RED },      // DARK
+    { GREEN, CYAN, RED, MAGENTA },   // BLUE
+    { CYAN, RED, MAGENTA, BLUE },    // GREEN
+    { RED, MAGENTA, BLUE, GREEN },   // CYAN
+    { MAGENTA, BLUE, GREEN, CYAN },  // RED
+    { BLUE, GREEN, CYAN, RED },      // MAGENTA
+    { BLUE, GREEN, CYAN, RED },      // YELLOW
+    { BLUE, GREEN, CYAN, RED }       // WHITE
+  },
+  .decode = {
+    { -1,  0,  1,  2,  3, -1, -1, -1 }, // DARK
+    { -1, -1,  0,  1,  2,  3, -1, -1 }, // BLUE
+    { -1,  3, -1,  0,  1,  2, -1, -1 }, // GREEN
+    { -1,  2,  3, -1,  0,  1, -1, -1 }, // CYAN
+    { -1,  1,  2,  3, -1,  0, -1, -1 }, // RED
+    { -1,  0,  1,  2,  3, -1, -1, -1 }, // MAGENTA
+    { -1,  0,  1,  2,  3, -1, -1, -1 }, // YELLOW
+    { -1,  0,  1,  2,  3, -1, -1, -1 }  // WHITE
+  }
+};
+
+// Map used by nextColourSeq_from_2bit() and nextColourSeq_to_2bit()
+const colourMap_t *colourMap_active = &colourMap_default;
+
+/**
+  Generate encoder and decoder tables for a cycle order and half nibble
+  steps (NULL steps for the plain 0, 1, 2, 3).
+
+  Return Values:
+    0 - map built
+   -1 - order is not a permutation of the 5 data colours,
+        or steps are not a permutation of 0 to 3
+*/
+int colourMap_build (colourMap_t *map, const rgb_colour_t order[5], const uint8_t step[4]) {
+  static const uint8_t plain_step[4] = { 0, 1, 2, 3 };
+  uint8_t seen = 0;
+
+  step = step ? step : plain_step;
+  for (int i = 0 ; i < 4 ; i++) {
+    if ( (step[i] > 3) || GETBIT(seen, step[i]) ) {
+      return -1;
+    }
+    SETBIT(seen, step[i]);
+    map->step[i] = step[i];
+  }
+
+  seen = 0;
+  for (int i = 0 ; i < 5 ; i++) {
+    if ( (order[i] < BLUE) || (order[i] > MAGENTA) || GETBIT(seen, order[i]) ) {
+      return -1;
+    }
+    SETBIT(seen, order[i]);
+    map->order[i] = order[i];
+  }
+
+  memset(map->decode, -1, sizeof(map->decode));
+  for (int previous_colour = DARK ; previous_colour <= WHITE ; previous_colour++) {
+    // Cannot repeat colour when sending every 2 bits of data, so a data colour
+    // starts the cycle just after itself. Channel offline and marks start at 0.
+    unsigned int offset = 0;
+    for (int i = 0 ; i < 5 ; i++) {
+      if (order[i] == previous_colour) {
+        offset = i + 1;
+      }
+    }
+
+    for (int halfnibble = 0 ; halfnibble < 4 ; halfnibble++) {
+      rgb_colour_t next_colour = order[ (step[halfnibble] + offset) % 5 ];
+      map->encode[previous_colour][halfnibble] = next_colour;
+      map->decode[previous_colour][next_colour] = halfnibble;
+    }
+  }
+  return 0;
+}
+
+void colourMap_select (const colourMap_t *map) {
+  colourMap_active = map ? map : &colourMap_default;
+}
+
+/**
+  Expected number of bit errors per data symbol for a map given a measured
+  confusion matrix, where confusion[sent][seen] is the probability that the
+  receiver classifies colour `sent` as `seen`.
+
+  A misread into another valid data colour costs the bits that differ. A
+  misread into the previous colour, a mark, DARK or an invalid transition
+  loses the symbol, which is counted as both bits.
+
+  One data symbol in 4 follows a mark, the rest follow a data colour.
+*/
+double colourMap_expectedBitErrors (const colourMap_t *map, const double confusion[8][8]) {
+  static const uint8_t bits_set[4] = { 0, 1, 1, 2 };
+  double expected = 0;
+
+  for (int p = 0 ; p < 6 ; p++) {
+    rgb_colour_t previous_colour = (p == 0) ? WHITE : map->order[p - 1];
+    double weight = (p == 0) ? 0.25 : (0.75 / 5);
+
+    for (int halfnibble = 0 ; halfnibble < 4 ; halfnibble++) {
+      rgb_colour_t sent = map->encode[previous_colour][halfnibble];
+      double errors = 0;
+      for (int seen = DARK ; seen <= WHITE ; seen++) {
+        if (seen == sent) {
+          continue;
+        }
+        int8_t decoded = map->decode[previous_colour][seen];
+        errors += confusion[sent][seen] * ((decoded < 0) ? 2 : bits_set[decoded ^ halfnibble]);
+      }
+      expected += weight * errors / 4;
+    }
+  }
+  return expected;
+}
+
+/**
+  Offline search over all 120 cycle orders, each with all 24 assignments of
+  half nibble values to cycle steps, for the map with the fewest expected
+  bit errors. The winning map is built into `best`.
+
+  Return Value:
+    Expected bit errors per data symbol of the chosen map
+*/
+static int nextPermutation (uint8_t *values, int count) {
+  int i = count - 2;
+  while ( (i >= 0) && (values[i] >= values[i + 1]) ) {
+    i--;
+  }
+  if (i < 0) {
+    return 0;
+  }
+  int j = count - 1;
+  while (values[j] <= values[i]) {
+    j--;
+  }
+  uint8_t swap = values[i];
+  values[i] = values[j];
+  values[j] = swap;
+  for (int a = i + 1, b = count - 1 ; a < b ; a++, b--) {
+    swap = values[a];
+    values[a] = values[b];
+    values[b] = swap;
+  }
+  return 1;
+}
+
+double colourMap_optimise (const double confusion[8][8], colourMap_t *best) {
+  uint8_t order[5] = { BLUE, GREEN, CYAN, RED, MAGENTA };
+  colourMap_t candidate;
+  double best_errors = -1;
+
+  do {
+    rgb_colour_t order_colours[5];
+    uint8_t step[4] = { 0, 1, 2, 3 };
+    for (int i = 0 ; i < 5 ; i++) {
+      order_colours[i] = order[i];
+    }
+    do {
+      colourMap_build(&candidate, order_colours, step);
+      double errors = colourMap_expectedBitErrors(&candidate, confusion);
+      if ( (best_errors < 0) || (errors < best_errors) ) {
+        best_errors = errors;
+        *best = candidate;
+      }
+    } while (nextPermutation(step, 4));
+  } while (nextPermutation(order, 5));
+
+  return best_errors;
+}
+
+
 /*
   ENCODE
 */
 
-rgb_colour_t nextColourSeq_from_2bit (uint8_t halfnibble, rgb_colour_t previous_colour) {
-  unsigned int offset = 0;
+rgb_colour_t nextColourSeq_from_2bit_map (const colourMap_t *map, uint8_t halfnibble, rgb_colour_t previous_colour) {
+  // Guard
+  halfnibble = halfnibble & 0x03;
+
+  // Returns the next colour in seqence
+  return map->encode[previous_colour & 0x07][halfnibble];
+}
+
+rgb_colour_t nextColourSeq_from_2bit (uint8_t halfnibble, rgb_colour_t previous_colour) {
+  return nextColourSeq_from_2bit_map(colourMap_active, halfnibble, previous_colour);
+}
+
+
+void toColourSeq_uint8 (const uint8_t data, rgb_colour_t colourSeq[100], int *seq_ptr) {
+  int j = *seq_ptr;
+  rgb_colour_t previous_colour;
+
+  previous_colour = (j == 0) ? DARK : colourSeq[j - 1];
+
+
+  // Data
+  for (int i = 0 ; i < 4; i++) { // 4 data seq + 1 mark seq
+    uint8_t half_nibble = (data >> 2 * (3 - i)) & 0x3; // next 2 bits
+
+    colourSeq[j] = nextColourSeq_from_2bit(half_nibble, previous_colour);
+
+    previous_colour = colourSeq[j];
+    j++;
+  }
+
+  // Mark End of Word (And also include parity bit)
+  if ( (calcParity_u8bit(data, PARITY_SETTING ) == 0 ) || PARITY_SETTING == NO_PARITY ) { //1
+    colourSeq[j] = WHITE; // parity = 0
+  } else {
+    colourSeq[j] = YELLOW; // parity = 1
+  }
+
+  j++;
+
+  // Return Values
+  *seq_ptr = j;
+  return;
+}
+
+/*
+  Streaming encoder with its own map and parity setting, so several
+  transmitters with different settings can run side by side.
+*/
+
+typedef struct colourEncoder {
+  const colourMap_t *map;
+  paritySel_t parity;
+  rgb_colour_t previous_colour;
+} colourEncoder_t;
+
+void colourEncoder_init (colourEncoder_t *encoder, const colourMap_t *map, paritySel_t paritySelect) {
+  encoder->map = map ? map : colourMap_active;
+  encoder->parity = paritySelect;
+  encoder->previous_colour = DARK;
+}
+
+/**
+  Encode one byte as 4 data colours and the given mark (WHITE or YELLOW),
+  ignoring the parity setting. For layers that give the marks their own
+  meaning.
+
+  Return Value:
+    Number of colours written to `colours` (always 5)
+*/
+int colourEncoder_put_marked (colourEncoder_t *encoder, const uint8_t data, rgb_colour_t mark, rgb_colour_t colours[5]) {
+  for (int i = 0 ; i < 4; i++) {
+    uint8_t half_nibble = (data >> 2 * (3 - i)) & 0x3; // next 2 bits
+    colours[i] = nextColourSeq_from_2bit_map(encoder->map, half_nibble, encoder->previous_colour);
+    encoder->previous_colour = colours[i];
+  }
+  colours[4] = mark;
+  encoder->previous_colour = colours[4];
+  return 5;
+}
+
+/**
+  Encode one byte as 4 data colours and a mark.
+
+  Return Value:
+    Number of colours written to `colours` (always 5)
+*/
+int colourEncoder_put_uint8 (colourEncoder_t *encoder, const uint8_t data, rgb_colour_t colours[5]) {
+  // Mark End of Word (And also include parity bit)
+  if ( (encoder->parity == NO_PARITY) || (calcParity_u8bit(data, encoder->parity) == 0) ) {
+    return colourEncoder_put_marked(encoder, data, WHITE, colours); // parity = 0
+  }
+  return colourEncoder_put_marked(encoder, data, YELLOW, colours); // parity = 1
+}
+
+/**
+  Close the channel (DARK), the next byte starts from channel offline.
+*/
+rgb_colour_t colourEncoder_close (colourEncoder_t *encoder) {
+  encoder->previous_colour = DARK;
+  return DARK;
+}
+
+
+/*
+  DECODE
+*/
+
+/**
+
+  Return Values:
+    0 - succesful return of value
+    1 - mark 1
+    2 - mark 2
+   -1 - channel idling (colour repeated)
+   -2 - channel going down
+   -3 - data colour that cannot follow the previous colour
+*/
+int nextColourSeq_to_2bit_map (const colourMap_t *map, const rgb_colour_t incoming_colour, const rgb_colour_t previous_colour, uint8_t *halfnibble_out) {
+  if (incoming_colour == previous_colour) {
+    return -1; // Indicate that the channel is iding
+  }
+
+  switch (incoming_colour) {
+  case (DARK): //0
+    return -2; // Channel Going Down
+  case (YELLOW): //6
+    return 2; // Mark 2
+  case (WHITE): //7
+    return 1; // Mark 1
+  default:
+    break;
+  }
+
+  int8_t halfnibble = map->decode[previous_colour & 0x07][incoming_colour & 0x07];
+  if (halfnibble < 0) {
+    return -3;
+  }
+
+  // Return Nibble
+  *halfnibble_out = halfnibble & 0x03;
+
+  return 0; // Sucessfully returned a nibble
+}
+
+int nextColourSeq_to_2bit (const rgb_colour_t incoming_colour, const rgb_colour_t previous_colour, uint8_t *halfnibble_out) {
+  return nextColourSeq_to_2bit_map(colourMap_active, incoming_colour, previous_colour, halfnibble_out);
+}
+
+
+int fromColourSeq_get_uint8 (const rgb_colour_t colourSeq[100], int *seq_ptr, uint8_t *output ) {
+  rgb_colour_t previous_colour;
+  rgb_colour_t incoming_colour;
+
+  previous_colour = ((*seq_ptr) == 0) ? DARK : colourSeq[ (*seq_ptr) - 1];
+
+  // Communication Line is Closed
+  rgb_colour_t seqPeek = colourSeq[(*seq_ptr)];
+  if ( seqPeek == DARK ){
+    return -1;
+  }
+
+  // Extract next 8bit from stream
+  *output = 0x00;
+  for (int i = 0 ; i < 5 ; i++) {
+    uint8_t halfnibble_out;
+
+    incoming_colour = colourSeq[(*seq_ptr)];
+    int return_code = nextColourSeq_to_2bit ( incoming_colour, previous_colour, &halfnibble_out);
+    previous_colour = incoming_colour;
+
+    (*seq_ptr)++;
+
+    switch (return_code) {
+    case (2): // Mark 2
+      return 2; // Yellow: Sucessfully Received a Byte (Parity bit = 1)
+      break;
+    case (1): // Mark 1
+      return 1; // White: Sucessfully Received a Byte (Parity bit = 0)
+      break;
+    case (0): // Shift in half a nibble
+      *output = *output << 2; // Shift by half nibble
+      *output |= halfnibble_out;
+      break;
+    case (-1): // idling line keep scanning
+      break;
+    case (-2): // Communication Closed Unexpectedly
+      return -1;
+      break;
+    case (-3): // Invalid transition, keep scanning for the mark
+      break;
+    }
+
+  }
+  return 0; // Only supports up to 8bit
+}
+
+
+/*
+  STREAMING DECODE
+
+  The decoder above works on a complete colour array. A receiver watching a
+  real LED instead gets one classified colour per camera frame, so the stages
+  below turn that into bytes one sample at a time:
+
+    sample -> colourSampler (run length) -> blendFilter -> colourDecoder
+
+  Every stage is a small plain struct with no allocation, so a receiver can
+  keep one per LED and feed thousands of them at camera frame rates.
+*/
+
+typedef struct colourRun {
+  rgb_colour_t colour;
+  uint32_t length; // Number of samples (frames) the colour was held for
+} colourRun_t;
+
+typedef struct colourSampler {
+  colourRun_t run; // Run currently being measured
+} colourSampler_t;
+
+void colourSampler_init (colourSampler_t *sampler) {
+  sampler->run.colour = DARK;
+  sampler->run.length = 0;
+}
+
+/**
+  Collapse per frame samples into runs of identical colour.
+
+  Return Values:
+    0 - sample extended the current run
+    1 - colour changed, `run_out` holds the completed run and
+        `sampler->run.colour` is the colour that just started
+*/
+int colourSampler_push (colourSampler_t *sampler, const rgb_colour_t sample, colourRun_t *run_out) {
+  if (sample == sampler->run.colour) {
+    sampler->run.length++;
+    return 0;
+  }
+
+  int completed = (sampler->run.length > 0);
+  *run_out = sampler->run;
+
+  sampler->run.colour = sample;
+  sampler->run.length = 1;
+  return completed;
+}
+
+
+/*
+  TRANSITION BLEND FILTER
+
+  When the LED switches between two colours, a camera frame that straddles the
+  switch integrates both and sees a blend. Each channel that is on in either
+  colour tends to read as on (bitwise OR, e.g. BLUE -> RED reads MAGENTA) or
+  only channels on in both read as on (bitwise AND, e.g. GREEN -> BLUE reads
+  DARK). The decoder would count that blend as an extra transition and
+  corrupt the byte.
+
+  A run is suppressed when it is short and its colour is the OR or the AND
+  of the colours either side of it. With `partial` set, any colour between
+  them counts (every channel on in both is on, every channel off in both is
+  off), which also covers the steps a sensor passes through when its
+  channels rise and fall at different speeds (CYAN -> WHITE -> MAGENTA ->
+  RED). The length of a suppressed run is carried over to the following
+  run. The length limit is either fixed or follows half the average length
+  of the runs that were accepted.
+*/
+
+typedef struct blendFilter {
+  rgb_colour_t last_colour;  // Last colour passed downstream
+  uint32_t carry_length;     // Length of suppressed runs not yet handed on
+  uint32_t max_blend_len;    // Longest run that may be a blend (0 = adaptive)
+  uint32_t avg_run_len_q4;   // Running average of accepted run lengths (4bit fixed point)
+  uint32_t suppressed;       // Number of blend runs removed
+  int partial;               // Also treat partial blends as blends (see isPartialTransitionBlend)
+} blendFilter_t;
+
+void blendFilter_init (blendFilter_t *filter, uint32_t max_blend_len) {
+  filter->last_colour = DARK;
+  filter->carry_length = 0;
+  filter->max_blend_len = max_blend_len;
+  filter->avg_run_len_q4 = 0;
+  filter->suppressed = 0;
+  filter->partial = 0;
+}
+
+static int isTransitionBlend (const rgb_colour_t colour, const rgb_colour_t before, const rgb_colour_t after) {
+  if ((before == after) || (colour == before) || (colour == after)) {
+    return 0;
+  }
+  return (colour == (before | after)) || (colour == (before & after));
+}
+
+/*
+  Looser test for receivers that threshold each channel separately, where
+  the channels flip one at a time and any mix of the two colours' channels
+  can show for a moment. Only for such receivers: between complementary
+  colours (CYAN and RED, say) every colour passes.
+*/
+static int isPartialTransitionBlend (const rgb_colour_t colour, const rgb_colour_t before, const rgb_colour_t after) {
+  if ((before == after) || (colour == before) || (colour == after)) {
+    return 0;
+  }
+  return ((colour & ~(before | after)) == 0) && (((before & after) & ~colour) == 0);
+}
+
+static uint32_t blendFilter_threshold (const blendFilter_t *filter) {
+  if (filter->max_blend_len) {
+    return filter->max_blend_len;
+  }
+  uint32_t threshold = filter->avg_run_len_q4 >> 5; // Half the average run
+  return (threshold < 1) ? 1 : threshold;
+}
+
+/**
+  Judge a completed run now that the colour following it is known.
+
+  Return Values:
+    0 - run was a transition blend and has been suppressed
+    1 - run is genuine and is returned in `run_out`
+*/
+int blendFilter_push (blendFilter_t *filter, const colourRun_t run, const rgb_colour_t next_colour, colourRun_t *run_out) {
+  int blend = filter->partial ? isPartialTransitionBlend(run.colour, filter->last_colour, next_colour)
+                              : isTransitionBlend(run.colour, filter->last_colour, next_colour);
+  if ( (run.length <= blendFilter_threshold(filter)) && blend ) {
+    filter->carry_length += run.length;
+    filter->suppressed++;
+    return 0;
+  }
+
+  run_out->colour = run.colour;
+  run_out->length = run.length + filter->carry_length;
+  filter->carry_length = 0;
+  filter->last_colour = run.colour;
+
+  // Track the typical symbol length (DARK runs are idle time, not symbols)
+  if (run.colour != DARK) {
+    int32_t delta = (int32_t)(run_out->length << 4) - (int32_t)filter->avg_run_len_q4;
+    filter->avg_run_len_q4 += delta / 8;
+  }
+  return 1;
+}
+
+
+/*
+  STREAMING BYTE DECODER
+*/
+
+typedef struct colourDecoder {
+  const colourMap_t *map;
+  rgb_colour_t previous_colour;
+  paritySel_t parity;
+  uint8_t byte;            // Byte being shifted in
+  uint8_t halfnibbles;     // Half nibbles shifted in since the last mark
+  uint32_t byte_count;     // Bytes received with valid framing and parity
+  uint32_t parity_errors;
+  uint32_t framing_errors;
+} colourDecoder_t;
+
+void colourDecoder_init (colourDecoder_t *decoder, const colourMap_t *map, paritySel_t paritySelect) {
+  decoder->map = map ? map : colourMap_active;
+  decoder->previous_colour = DARK;
+  decoder->parity = paritySelect;
+  decoder->byte = 0;
+  decoder->halfnibbles = 0;
+  decoder->byte_count = 0;
+  decoder->parity_errors = 0;
+  decoder->framing_errors = 0;
+}
+
+/**
+  Feed the next colour of the stream into the decoder.
+
+  Return Values:
+    0 - no byte completed (half nibble shifted in, or line idling)
+    1 - byte in `output` completed by mark 1 (parity bit = 0)
+    2 - byte in `output` completed by mark 2 (parity bit = 1)
+   -1 - channel closed
+   -2 - framing error: mark did not follow exactly 4 half nibbles
+   -3 - parity error: byte is still returned in `output`
+*/
+int colourDecoder_push (colourDecoder_t *decoder, const rgb_colour_t incoming_colour, uint8_t *output) {
+  uint8_t halfnibble_out;
+
+  int return_code = nextColourSeq_to_2bit_map(decoder->map, incoming_colour, decoder->previous_colour, &halfnibble_out);
+  decoder->previous_colour = incoming_colour;
+
+  switch (return_code) {
+  case (0): // Shift in half a nibble
+    decoder->byte = (decoder->byte << 2) | halfnibble_out;
+    if (decoder->halfnibbles <= 4) {
+      decoder->halfnibbles++;
+    }
+    return 0;
+  case (-1): // idling line
+    return 0;
+  case (-3): // Invalid transition, spoil the byte so the mark reports it
+    decoder->halfnibbles = 5;
+    return 0;
+  case (-2): // Channel closed, drop any partial byte
+    if (decoder->halfnibbles) {
+      decoder->framing_errors++;
+    }
+    decoder->halfnibbles = 0;
+    return -1;
+  }
+
+  // Mark: end of word
+  uint8_t halfnibbles = decoder->halfnibbles;
+  decoder->halfnibbles = 0;
+  *output = decoder->byte;
+
+  if (halfnibbles != 4) {
+    decoder->framing_errors++;
+    return -2;
+  }
+
+  uint8_t parity_bit = (return_code == 2) ? 0x01 : 0x00;
+  if ( (decoder->parity != NO_PARITY) && !validParity_u8bit(*output, parity_bit, decoder->parity) ) {
+    decoder->parity_errors++;
+    return -3;
+  }
+
+  decoder->byte_count++;
+  return return_code;
+}
+
+
+/*
+  STREAM RECEIVER: sampler, blend filter and decoder for one LED
+*/
+
+typedef struct colourStream {
+  colourSampler_t sampler;
+  blendFilter_t filter;
+  colourDecoder_t decoder;
+} colourStream_t;
+
+void colourStream_init (colourStream_t *stream, const colourMap_t *map, paritySel_t paritySelect, uint32_t max_blend_len) {
+  colourSampler_init(&stream->sampler);
+  blendFilter_init(&stream->filter, max_blend_len);
+  colourDecoder_init(&stream->decoder, map, paritySelect);
+}
+
+/**
+  Feed one classified frame sample. Return values as colourDecoder_push().
+  A byte completes when the colour after its mark starts.
+*/
+int colourStream_push (colourStream_t *stream, const rgb_colour_t sample, uint8_t *output) {
+  colourRun_t run;
+  colourRun_t filtered;
+
+  if ( !colourSampler_push(&stream->sampler, sample, &run) ) {
+    return 0;
+  }
+  if ( !blendFilter_push(&stream->filter, run, stream->sampler.run.colour, &filtered) ) {
+    return 0;
+  }
+  return colourDecoder_push(&stream->decoder, filtered.colour, output);
+}
+
+
+/*
+  INTERLEAVER
+
+  Sits between a per codeword code and the transition encoder so that a
+  burst of lost transitions, which takes out neighbouring bytes, is spread
+  over many codewords with at most a byte or two each.
+
+  Block: `depth` codewords are written as rows and sent column by column.
+  Convolutional: bytes go round `branches` FIFOs in turn, branch b
+  delaying by b * `delay` bytes (the de-interleaver by the reverse), which
+  gives the same spread with half the memory and latency and no block
+  boundaries.
+
+  The block transpose works in TRANSPOSE_TILE square tiles so large
+  depths stay in cache on both the read and the write side.
+*/
+
+#define TRANSPOSE_TILE 32
+
+typedef enum interleaveMode {
+  INTERLEAVE_NONE,
+  INTERLEAVE_BLOCK,
+  INTERLEAVE_CONVOLUTIONAL
+} interleaveMode_t;
+
+// out (columns x rows) = transpose of in (rows x columns), both row major
+void transposeBytes (const uint8_t *in, uint8_t *out, int rows, int columns) {
+  for (int row_tile = 0 ; row_tile < rows ; row_tile += TRANSPOSE_TILE) {
+    int row_end = (row_tile + TRANSPOSE_TILE < rows) ? row_tile + TRANSPOSE_TILE : rows;
+    for (int column_tile = 0 ; column_tile < columns ; column_tile += TRANSPOSE_TILE) {
+      int column_end = (column_tile + TRANSPOSE_TILE < columns) ? column_tile + TRANSPOSE_TILE : columns;
+      for (int row = row_tile ; row < row_end ; row++) {
+        for (int column = column_tile ; column < column_end ; column++) {
+          out[(size_t)column * rows + row] = in[(size_t)row * columns + column];
+        }
+      }
+    }
+  }
+}
+
+// `depth` codewords of `length` bytes one after another -> send order
+void blockInterleave (const uint8_t *in, uint8_t *out, int depth, int length) {
+  transposeBytes(in, out, depth, length);
+}
+
+void blockDeinterleave (const uint8_t *in, uint8_t *out, int depth, int length) {
+  transposeBytes(in, out, length, depth);
+}
+
+typedef struct convInterleaver {
+  int branches;
+  int branch;                // Branch the next byte goes through
+  uint8_t *buffer;
+  int *start;                // Offset of each branch's FIFO in buffer
+  int *length;
+  int *position;
+} convInterleaver_t;
+
+/**
+  Branch b delays by b * delay bytes, or by (branches - 1 - b) * delay when
+  `deinterleave` is set. Together the two delay every byte by
+  (branches - 1) * branches * delay.
+
+  Return Values:
+    0 on success, -1 when out of memory
+*/
+int convInterleaver_init (convInterleaver_t *interleaver, int branches, int delay, int deinterleave) {
+  memset(interleaver, 0x00, sizeof(convInterleaver_t));
+  interleaver->branches = (branches < 1) ? 1 : branches;
+  interleaver->start = calloc(interleaver->branches, sizeof(int));
+  interleaver->length = calloc(interleaver->branches, sizeof(int));
+  interleaver->position = calloc(interleaver->branches, sizeof(int));
+  size_t total = (size_t)delay * interleaver->branches * (interleaver->branches - 1) / 2;
+  interleaver->buffer = calloc(total ? total : 1, 1);
+  if ( !interleaver->start || !interleaver->length || !interleaver->position || !interleaver->buffer ) {
+    free(interleaver->start);
+    free(interleaver->length);
+    free(interleaver->position);
+    free(interleaver->buffer);
+    return -1;
+  }
+
+  int offset = 0;
+  for (int b = 0 ; b < interleaver->branches ; b++) {
+    interleaver->start[b] = offset;
+    interleaver->length[b] = (deinterleave ? interleaver->branches - 1 - b : b) * delay;
+    offset += interleaver->length[b];
+  }
+  return 0;
+}
+
+void convInterleaver_destroy (convInterleaver_t *interleaver) {
+  free(interleaver->start);
+  free(interleaver->length);
+  free(interleaver->position);
+  free(interleaver->buffer);
+}
+
+uint8_t convInterleaver_push (convInterleaver_t *interleaver, uint8_t in) {
+  int b = interleaver->branch;
+  uint8_t out = in;
+
+  interleaver->branch = (b + 1 == interleaver->branches) ? 0 : b + 1;
+  if (interleaver->length[b]) {
+    uint8_t *slot = &interleaver->buffer[interleaver->start[b] + interleaver->position[b]];
+    out = *slot;
+    *slot = in;
+    interleaver->position[b] = (interleaver->position[b] + 1 == interleaver->length[b]) ? 0 : interleaver->position[b] + 1;
+  }
+  return out;
+}
+
+
+/*
+  CHANNEL SIMULATOR
+
+  Plays encoded colour sequences as timed LED states and samples them with a
+  model camera, so coding schemes can be compared over millions of bytes
+  instead of one bench test at a time.
+
+  The camera opens its shutter for `exposure` of each frame period. Each
+  channel reads as on when it was lit for at least half of the exposure, so
+  frames that straddle a switch see the OR or AND blend of the two colours.
+  Frame start times jitter, frames get dropped, alone or in bursts, and
+  sometimes a frame is classified as a random wrong colour.
+
+  Optionally the payload is sent as XOR parity codewords (one erased byte
+  per codeword can be rebuilt), through an interleaver, to measure how
+  well bursts get spread.
+
+  Trials are independent and seeded from their index, so results do not
+  depend on how many threads run them.
+*/
+
+typedef struct simRandom {
+  uint64_t state;
+} simRandom_t;
+
+void simRandom_seed (simRandom_t *rng, uint64_t seed) {
+  // splitmix64 of the seed so neighbouring seeds start far apart
+  uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  rng->state = (z ^ (z >> 31)) | 1;
+}
+
+uint32_t simRandom_u32 (simRandom_t *rng) {
+  // xorshift64*
+  rng->state ^= rng->state >> 12;
+  rng->state ^= rng->state << 25;
+  rng->state ^= rng->state >> 27;
+  return (uint32_t)((rng->state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+// Uniform in [0, 1)
+double simRandom_uniform (simRandom_t *rng) {
+  return simRandom_u32(rng) * (1.0 / 4294967296.0);
+}
+
+typedef struct simCamera {
+  double fps;
+  double exposure;        // Fraction of the frame period the shutter is open (0 to 1]
+  double frame_jitter;    // Frame start jitter, +/- fraction of the frame period
+  double drop_prob;       // Probability a frame is dropped
+  double misclass_prob;   // Probability a frame is classified as a random wrong colour
+  double burst_prob;      // Probability a burst of dropped frames starts at a frame
+  int burst_frames;       // Frames lost per burst
+} simCamera_t;
+
+typedef struct simConfig {
+  simCamera_t camera;
+  double symbol_period;   // Seconds each colour is held by the transmitter
+  double symbol_jitter;   // Symbol length jitter, +/- fraction of the symbol period
+  const colourMap_t *map;
+  paritySel_t parity;
+  uint32_t max_blend_len; // Blend filter setting (0 = adaptive)
+  int payload_len;        // Bytes per trial
+  int codeword_len;       // XOR parity codeword length, parity byte included (0 = send the payload as is)
+  int interleave_depth;   // Codewords spread together: block rows or convolutional branches
+  interleaveMode_t interleave;
+  int trials;
+  int threads;
+  uint64_t seed;
+} simConfig_t;
+
+typedef struct simResult {
+  uint64_t bytes_sent;
+  uint64_t bytes_correct;     // Accepted by the decoder and equal to the byte sent
+  uint64_t bytes_rejected;    // Caught by parity or framing checks; when coded, payload bytes left erased
+  uint64_t bytes_undetected;  // Accepted by the decoder but wrong
+  uint64_t bytes_duplicated;  // Extra decodes of a byte already counted correct
+  double seconds;             // Simulated transmission time
+  double latency_sum;         // Sum over correct bytes of end of mark to delivery (coded: see simCode_decode)
+  double byte_error_rate;
+  double goodput;             // Correct bytes per second of transmission
+  double mean_latency;        // Seconds
+} simResult_t;
+
+typedef struct simBuffers {
+  uint8_t *payload;
+  uint8_t *wire;          // Bytes as sent, after coding and interleaving
+  uint8_t *received;      // Bytes as received, by wire position
+  uint8_t *received_ok;   // 0 where nothing valid arrived (erasure)
+  double *received_at;    // Time each valid wire byte was decoded
+  uint8_t *scratch;
+  uint8_t *scratch_ok;
+  rgb_colour_t *colours;
+  double *symbol_end;
+  double *byte_end;
+} simBuffers_t;
+
+typedef struct simWorker {
+  const simConfig_t *config;
+  int index;
+  int started;
+  int failed;             // Out of memory, trials not run
+  simResult_t result;
+} simWorker_t;
+
+// Channels lit for at least half the exposure read as on
+static rgb_colour_t simCamera_expose (const rgb_colour_t *colours, const double *symbol_end, int count, int *symbol_ptr, double open, double close) {
+  double lit[3] = { 0, 0, 0 };
+  int i = *symbol_ptr;
+
+  // Skip symbols that ended before the shutter opened
+  while ( (i < count) && (symbol_end[i] <= open) ) {
+    i++;
+  }
+  *symbol_ptr = i;
+
+  for ( ; i < count ; i++) {
+    double start = (i == 0) ? 0 : symbol_end[i - 1];
+    if (start >= close) {
+      break;
+    }
+    double overlap = ((symbol_end[i] < close) ? symbol_end[i] : close) - ((start > open) ? start : open);
+    for (int channel = 0 ; channel < 3 ; channel++) {
+      if (GETBIT(colours[i], channel)) {
+        lit[channel] += overlap;
+      }
+    }
+  }
+
+  rgb_colour_t colour = DARK;
+  for (int channel = 0 ; channel < 3 ; channel++) {
+    if (lit[channel] * 2 >= (close - open)) {
+      colour |= (1u << channel);
+    }
+  }
+  return colour;
+}
+
+// Bytes put on the wire for one trial's payload
+static int simWire_length (const simConfig_t *config) {
+  if (config->codeword_len < 2) {
+    return config->payload_len;
+  }
+  int data = config->codeword_len - 1;
+  int depth = (config->interleave_depth < 1) ? 1 : config->interleave_depth;
+  int groups = (config->payload_len + data * depth - 1) / (data * depth);
+  int length = groups * depth * config->codeword_len;
+  if (config->interleave == INTERLEAVE_CONVOLUTIONAL) {
+    length += (depth - 1) * depth; // Flush the interleaver, one byte delay step per branch
+  }
+  return length;
+}
+
+// Payload -> XOR parity codewords -> interleaved wire bytes
+static int simCode_encode (const simConfig_t *config, simBuffers_t *buffers) {
+  int n = config->codeword_len;
+  int depth = (config->interleave_depth < 1) ? 1 : config->interleave_depth;
+  int wire_length = simWire_length(config);
+  int codewords = (config->payload_len + (n - 1) * depth - 1) / ((n - 1) * depth) * depth;
+  int coded_length = codewords * n;
+  uint8_t *coded = buffers->scratch;
+
+  for (int c = 0 ; c < codewords ; c++) {
+    uint8_t parity = 0;
+    for (int j = 0 ; j < n - 1 ; j++) {
+      int index = c * (n - 1) + j;
+      uint8_t byte = (index < config->payload_len) ? buffers->payload[index] : 0; // Zero padded
+      coded[c * n + j] = byte;
+      parity ^= byte;
+    }
+    coded[c * n + n - 1] = parity;
+  }
+
+  switch (config->interleave) {
+  case (INTERLEAVE_NONE):
+    memcpy(buffers->wire, coded, coded_length);
+    break;
+  case (INTERLEAVE_BLOCK):
+    for (int g = 0 ; g < coded_length ; g += depth * n) {
+      blockInterleave(coded + g, buffers->wire + g, depth, n);
+    }
+    break;
+  case (INTERLEAVE_CONVOLUTIONAL): {
+    convInterleaver_t interleaver;
+    if (convInterleaver_init(&interleaver, depth, 1, 0) < 0) {
+      return -1;
+    }
+    for (int i = 0 ; i < wire_length ; i++) {
+      buffers->wire[i] = convInterleaver_push(&interleaver, (i < coded_length) ? coded[i] : 0);
+    }
+    convInterleaver_destroy(&interleaver);
+    break;
+  }
+  }
+  return 0;
+}
+
+// Wire position of byte `index` of the coded stream (codewords one after another)
+static int simCode_wirePosition (const simConfig_t *config, int index) {
+  int n = config->codeword_len;
+  int depth = (config->interleave_depth < 1) ? 1 : config->interleave_depth;
+
+  switch (config->interleave) {
+  case (INTERLEAVE_BLOCK): {
+    int group = index / (depth * n);
+    int row = index % (depth * n) / n;
+    return group * depth * n + (index % n) * depth + row;
+  }
+  case (INTERLEAVE_CONVOLUTIONAL):
+    return index + (index % depth) * depth; // Branch b delays by b * depth bytes
+  default:
+    return index;
+  }
+}
+
+/**
+  Received wire bytes -> de-interleave -> rebuild single erasures -> count
+  payload bytes. Bytes are delivered in order: a byte is out once it and
+  every earlier delivered byte have arrived, and a rebuilt byte once the
+  rest of its codeword has. Latency runs from the end of the byte's mark
+  had the codewords been sent without interleaving, so it includes the
+  interleaving delay and the wait for parity. A block interleaver has to
+  hold a whole block before sending its first column, so there the byte
+  reached the transmitter one block (at the nominal byte time) earlier.
+*/
+static int simCode_decode (const simConfig_t *config, simBuffers_t *buffers, simResult_t *result) {
+  int n = config->codeword_len;
+  int depth = (config->interleave_depth < 1) ? 1 : config->interleave_depth;
+  int codewords = (config->payload_len + (n - 1) * depth - 1) / ((n - 1) * depth) * depth;
+  int coded_length = codewords * n;
+  uint8_t *coded = buffers->scratch;
+  uint8_t *coded_ok = buffers->scratch_ok;
+
+  switch (config->interleave) {
+  case (INTERLEAVE_NONE):
+    memcpy(coded, buffers->received, coded_length);
+    memcpy(coded_ok, buffers->received_ok, coded_length);
+    break;
+  case (INTERLEAVE_BLOCK):
+    for (int g = 0 ; g < coded_length ; g += depth * n) {
+      blockDeinterleave(buffers->received + g, coded + g, depth, n);
+      blockDeinterleave(buffers->received_ok + g, coded_ok + g, depth, n);
+    }
+    break;
+  case (INTERLEAVE_CONVOLUTIONAL): {
+    convInterleaver_t bytes, flags;
+    int delay = (depth - 1) * depth;
+    if (convInterleaver_init(&bytes, depth, 1, 1) < 0) {
+      return -1;
+    }
+    if (convInterleaver_init(&flags, depth, 1, 1) < 0) {
+      convInterleaver_destroy(&bytes);
+      return -1;
+    }
+    for (int i = 0 ; i < coded_length + delay ; i++) {
+      uint8_t byte = convInterleaver_push(&bytes, buffers->received[i]);
+      uint8_t ok = convInterleaver_push(&flags, buffers->received_ok[i]);
+      if (i >= delay) {
+        coded[i - delay] = byte;
+        coded_ok[i - delay] = ok;
+      }
+    }
+    convInterleaver_destroy(&bytes);
+    convInterleaver_destroy(&flags);
+    break;
+  }
+  }
+
+  double hold = (config->interleave == INTERLEAVE_BLOCK) ? depth * n * 5 * config->symbol_period : 0;
+  double delivered = 0;
+  for (int c = 0 ; c < codewords ; c++) {
+    uint8_t *word = coded + c * n;
+    uint8_t *ok = coded_ok + c * n;
+    int erased = 0, missing = 0;
+    uint8_t parity = 0;
+    double complete = 0;    // Last arrival in the codeword
+    for (int j = 0 ; j < n ; j++) {
+      if (!ok[j]) {
+        erased++;
+        missing = j;
+      } else {
+        double arrival = buffers->received_at[simCode_wirePosition(config, c * n + j)];
+        complete = (arrival > complete) ? arrival : complete;
+        parity ^= word[j];
+      }
+    }
+    if (erased == 1) {
+      word[missing] = parity;
+      ok[missing] = 1;
+    }
+    for (int j = 0 ; j < n - 1 ; j++) {
+      int index = c * (n - 1) + j;
+      if (index >= config->payload_len) {
+        break;
+      }
+      if (!ok[j]) {
+        result->bytes_rejected++;
+      } else if (word[j] == buffers->payload[index]) {
+        double arrival = ( (erased == 1) && (j == missing) ) ? complete : buffers->received_at[simCode_wirePosition(config, c * n + j)];
+        delivered = (arrival > delivered) ? arrival : delivered;
+        result->bytes_correct++;
+        result->latency_sum += delivered - buffers->byte_end[c * n + j] + hold;
+      } else {
+        result->bytes_undetected++;
+      }
+    }
+  }
+  return 0;
+}
+
+// Return Value: 0, or -1 when out of memory
+static int simTrial (const simConfig_t *config, int trial, simBuffers_t *buffers, simResult_t *result) {
+  const simCamera_t *camera = &config->camera;
+  uint8_t *payload = buffers->payload;
+  uint8_t *wire = buffers->payload;
+  rgb_colour_t *colours = buffers->colours;
+  double *symbol_end = buffers->symbol_end;
+  double *byte_end = buffers->byte_end;
+  int coded = (config->codeword_len > 1);
+  int wire_length = simWire_length(config);
+  simRandom_t rng;
+  colourEncoder_t encoder;
+  colourStream_t stream;
+  int count = 0;
+
+  simRandom_seed(&rng, config->seed * 1000003u + trial);
+
+  for (int i = 0 ; i < config->payload_len ; i++) {
+    payload[i] = simRandom_u32(&rng);
+  }
+  if (coded) {
+    if (simCode_encode(config, buffers) < 0) {
+      return -1;
+    }
+    wire = buffers->wire;
+    memset(buffers->received_ok, 0x00, wire_length);
+  }
+
+  // Transmitter: idle, payload, idle
+  colourEncoder_init(&encoder, config->map, config->parity);
+  colours[count++] = DARK;
+  for (int i = 0 ; i < wire_length ; i++) {
+    count += colourEncoder_put_uint8(&encoder, wire[i], &colours[count]);
+  }
+  colours[count++] = colourEncoder_close(&encoder);
+
+  double t = 0;
+  for (int i = 0 ; i < count ; i++) {
+    double jitter = config->symbol_jitter * (2 * simRandom_uniform(&rng) - 1);
+    double hold = config->symbol_period * ( ((i == 0) || (i == count - 1)) ? 2 : 1 );
+    t += hold * (1 + jitter);
+    symbol_end[i] = t;
+  }
+  for (int i = 0 ; i < wire_length ; i++) {
+    byte_end[i] = symbol_end[1 + 5 * i + 4];
+  }
+
+  // Receiver
+  colourStream_init(&stream, config->map, config->parity, config->max_blend_len);
+  double frame_period = 1.0 / camera->fps;
+  int symbol_ptr = 0;
+  int tx_index = -1;       // Last byte whose mark has been shown
+  int credited_index = -1; // Last byte counted as received correctly
+  int burst_left = 0;
+  for (long frame = 0 ; ; frame++) {
+    double open = (frame + camera->frame_jitter * (2 * simRandom_uniform(&rng) - 1)) * frame_period;
+    double close = open + camera->exposure * frame_period;
+    if (close >= t) {
+      break;
+    }
+    if (burst_left > 0) {
+      burst_left--;
+      continue;
+    }
+    if ( (camera->burst_prob > 0) && (simRandom_uniform(&rng) < camera->burst_prob) ) {
+      burst_left = camera->burst_frames - 1;
+      continue;
+    }
+    if (simRandom_uniform(&rng) < camera->drop_prob) {
+      continue;
+    }
+
+    rgb_colour_t sample = simCamera_expose(colours, symbol_end, count, &symbol_ptr, (open < 0) ? 0 : open, close);
+    if (simRandom_uniform(&rng) < camera->misclass_prob) {
+      sample = (sample + 1 + simRandom_u32(&rng) % 7) & 0x07;
+    }
+
+    uint8_t output_byte;
+    int returncode = colourStream_push(&stream, sample, &output_byte);
+    if ( (returncode == 0) || (returncode == -1) ) {
+      continue;
+    }
+
+    // Match by time rather than by count, so one lost or extra mark does
+    // not shift every later byte: a byte completes once its mark has ended.
+    while ( (tx_index + 1 < wire_length) && (byte_end[tx_index + 1] <= close) ) {
+      tx_index++;
+    }
+    if (coded) {
+      if ( (returncode > 0) && (tx_index >= 0) && !buffers->received_ok[tx_index] ) {
+        buffers->received[tx_index] = output_byte;
+        buffers->received_ok[tx_index] = 1;
+        buffers->received_at[tx_index] = close;
+      }
+      continue;
+    }
+    if (returncode < 0) {
+      result->bytes_rejected++;
+    } else if ( (tx_index >= 0) && (tx_index == credited_index) && (output_byte == payload[tx_index]) ) {
+      result->bytes_duplicated++; // Same byte decoded twice, e.g. a mark split by a blend
+    } else if ( (tx_index < 0) || (tx_index == credited_index) || (output_byte != payload[tx_index]) ) {
+      result->bytes_undetected++;
+    } else {
+      result->bytes_correct++;
+      result->latency_sum += close - byte_end[tx_index];
+      credited_index = tx_index;
+    }
+  }
+
+  if ( coded && (simCode_decode(config, buffers, result) < 0) ) {
+    return -1;
+  }
+  result->bytes_sent += config->payload_len;
+  result->seconds += symbol_end[count - 2] - symbol_end[0];
+  return 0;
+}
+
+static void *simWorker_run (void *arg) {
+  simWorker_t *worker = arg;
+  const simConfig_t *config = worker->config;
+  int wire_length = simWire_length(config);
+  int max_symbols = 5 * wire_length + 2;
+  simBuffers_t buffers;
+
+  buffers.payload = malloc(config->payload_len);
+  buffers.wire = malloc(wire_length);
+  buffers.received = malloc(wire_length);
+  buffers.received_ok = malloc(wire_length);
+  buffers.received_at = malloc(wire_length * sizeof(double));
+  buffers.scratch = malloc(wire_length);
+  buffers.scratch_ok = malloc(wire_length);
+  buffers.colours = malloc(max_symbols * sizeof(rgb_colour_t));
+  buffers.symbol_end = malloc(max_symbols * sizeof(double));
+  buffers.byte_end = malloc(wire_length * sizeof(double));
+
+  if ( buffers.payload && buffers.wire && buffers.received && buffers.received_ok && buffers.received_at &&
+       buffers.scratch && buffers.scratch_ok && buffers.colours && buffers.symbol_end && buffers.byte_end ) {
+    for (int trial = worker->index ; (trial < config->trials) && !worker->failed ; trial += config->threads) {
+      worker->failed = (simTrial(config, trial, &buffers, &worker->result) < 0);
+    }
+  } else {
+    worker->failed = 1;
+  }
+
+  free(buffers.payload);
+  free(buffers.wire);
+  free(buffers.received);
+  free(buffers.received_ok);
+  free(buffers.received_at);
+  free(buffers.scratch);
+  free(buffers.scratch_ok);
+  free(buffers.colours);
+  free(buffers.symbol_end);
+  free(buffers.byte_end);
+  return NULL;
+}
+
+/**
+  Run `config->trials` independent trials over `config->threads` threads.
+
+  Return Values:
+    0 - success, `result` filled in
+   -1 - bad configuration or out of memory (any trials that ran are still in `result`)
+*/
+int simRun (const simConfig_t *config, simResult_t *result) {
+  if ( (config->payload_len <= 0) || (config->trials <= 0) || (config->threads <= 0) || (config->camera.fps <= 0) ) {
+    return -1;
+  }
+
+  simWorker_t *workers = calloc(config->threads, sizeof(simWorker_t));
+  pthread_t *threads = calloc(config->threads, sizeof(pthread_t));
+  if (!workers || !threads) {
+    free(workers);
+    free(threads);
+    return -1;
+  }
+
+  for (int i = 0 ; i < config->threads ; i++) {
+    workers[i].config = config;
+    workers[i].index = i;
+    workers[i].started = (pthread_create(&threads[i], NULL, simWorker_run, &workers[i]) == 0);
+    if (!workers[i].started) {
+      simWorker_run(&workers[i]); // Could not start a thread, run it here instead
+    }
+  }
+
+  // Merge in thread order so the sums are repeatable
+  memset(result, 0x00, sizeof(simResult_t));
+  int failed = 0;
+  for (int i = 0 ; i < config->threads ; i++) {
+    if (workers[i].started) {
+      pthread_join(threads[i], NULL);
+    }
+    failed |= workers[i].failed;
+    result->bytes_sent += workers[i].result.bytes_sent;
+    result->bytes_correct += workers[i].result.bytes_correct;
+    result->bytes_rejected += workers[i].result.bytes_rejected;
+    result->bytes_undetected += workers[i].result.bytes_undetected;
+    result->bytes_duplicated += workers[i].result.bytes_duplicated;
+    result->seconds += workers[i].result.seconds;
+    result->latency_sum += workers[i].result.latency_sum;
+  }
+
+  result->byte_error_rate = result->bytes_sent ? 1.0 - (double)result->bytes_correct / result->bytes_sent : 0;
+  result->goodput = (result->seconds > 0) ? result->bytes_correct / result->seconds : 0;
+  result->mean_latency = result->bytes_correct ? result->latency_sum / result->bytes_correct : 0;
+
+  free(workers);
+  free(threads);
+  return failed ? -1 : 0;
+}
+
+
+/*
+  SYNTHETIC VIDEO
+
+  Renders encoded colour sequences as raw video of LEDs in a scene, as a
+  local stand in for a phone camera. Each transmitter is a round glow that
+  can move across the frame. The scene has soft edges, pixel noise and an
+  optional rolling shutter, where each row is exposed `row_time` after the
+  one above it and so may catch a different colour.
+
+  Frames are rendered on several threads and written in order to any FILE,
+  so they can go to a file or straight down a pipe.
+*/
+
+typedef enum videoFormat {
+  VIDEO_RAW_RGB24, // Packed R, G, B bytes per pixel with no header
+  VIDEO_Y4M,       // YUV4MPEG2, full range 4:4:4
+  VIDEO_PPM        // Concatenated binary PPM (P6) images, read back as RGB24
+} videoFormat_t;
+
+typedef struct videoTransmitter {
+  const rgb_colour_t *colours; // Sequence to play, DARK before and after it
+  int count;
+  double symbol_period;        // Seconds per colour
+  double start_time;           // Seconds into the video the sequence starts
+  double x, y;                 // Centre in pixels at time 0
+  double vx, vy;               // Motion in pixels per second
+  double radius;               // Glow radius in pixels
+} videoTransmitter_t;
+
+typedef struct videoScene {
+  int width;
+  int height;
+  double fps;
+  double row_time;             // Rolling shutter row delay in seconds (0 = global shutter)
+  double blur;                 // Width of the soft edge in pixels
+  double noise;                // Pixel noise amplitude (+/- levels)
+  uint8_t background[3];       // R, G, B
+  const videoTransmitter_t *transmitters;
+  int transmitter_count;
+  uint32_t seed;
+} videoScene_t;
+
+rgb_colour_t videoTransmitter_colourAt (const videoTransmitter_t *tx, double t) {
+  double symbol = (t - tx->start_time) / tx->symbol_period;
+  if ( (symbol < 0) || (symbol >= tx->count) ) {
+    return DARK;
+  }
+  return tx->colours[(int)symbol];
+}
+
+// Cheap repeatable per pixel noise, one hash gives 3 channels of 10 bits
+static uint32_t videoNoise_hash (uint32_t seed, uint32_t frame, uint32_t x, uint32_t y) {
+  uint32_t h = seed ^ (frame * 0x9E3779B1u) ^ (y * 0x85EBCA77u) ^ (x * 0xC2B2AE3Du);
+  h ^= h >> 15;
+  h *= 0x2C1B3C6Du;
+  h ^= h >> 12;
+  h *= 0x297A2D39u;
+  h ^= h >> 15;
+  return h;
+}
+
+static uint8_t clampByte (int value) {
+  return (value < 0) ? 0 : ((value > 255) ? 255 : value);
+}
+
+/**
+  Render frame `frame` of the scene as packed RGB24 into `rgb`
+  (width * height * 3 bytes).
+*/
+void videoRender_frame (const videoScene_t *scene, long frame, uint8_t *rgb) {
+  double frame_time = frame / scene->fps;
+
+  for (int y = 0 ; y < scene->height ; y++) {
+    double t = frame_time + y * scene->row_time;
+    uint8_t *row = &rgb[(size_t)y * scene->width * 3];
+
+    for (int x = 0 ; x < scene->width ; x++) {
+      row[3 * x + 0] = scene->background[0];
+      row[3 * x + 1] = scene->background[1];
+      row[3 * x + 2] = scene->background[2];
+    }
+
+    for (int i = 0 ; i < scene->transmitter_count ; i++) {
+      const videoTransmitter_t *tx = &scene->transmitters[i];
+      double cx = tx->x + tx->vx * t;
+      double cy = tx->y + tx->vy * t;
+      double outer = tx->radius + scene->blur / 2;
+      double inner = tx->radius - scene->blur / 2;
+      double dy = y - cy;
+      if ( (dy > outer) || (dy < -outer) ) {
+        continue;
+      }
+
+      rgb_colour_t colour = videoTransmitter_colourAt(tx, t);
+      double half_width = sqrt(outer * outer - dy * dy);
+      int x0 = (int)(cx - half_width);
+      int x1 = (int)(cx + half_width) + 1;
+      x0 = (x0 < 0) ? 0 : x0;
+      x1 = (x1 > scene->width) ? scene->width : x1;
+
+      for (int x = x0 ; x < x1 ; x++) {
+        double dx = x - cx;
+        double d = sqrt(dx * dx + dy * dy);
+        double weight = (d <= inner) ? 1.0 : ((d >= outer) ? 0.0 : (outer - d) / scene->blur);
+        uint8_t *pixel = &row[3 * x];
+        pixel[0] = (uint8_t)(pixel[0] * (1 - weight) + (GETBIT(colour, 2) ? 255 * weight : 0)); // R
+        pixel[1] = (uint8_t)(pixel[1] * (1 - weight) + (GETBIT(colour, 1) ? 255 * weight : 0)); // G
+        pixel[2] = (uint8_t)(pixel[2] * (1 - weight) + (GETBIT(colour, 0) ? 255 * weight : 0)); // B
+      }
+    }
+
+    if (scene->noise > 0) {
+      int scale = (int)(scene->noise * 2 * 64); // 10 bit uniform noise scaled to +/- noise in 1/64ths
+      for (int x = 0 ; x < scene->width ; x++) {
+        uint32_t h = videoNoise_hash(scene->seed, frame, x, y);
+        for (int channel = 0 ; channel < 3 ; channel++) {
+          int n = ((int)((h >> (10 * channel)) & 0x3FF) - 512) * scale >> 16;
+          row[3 * x + channel] = clampByte(row[3 * x + channel] + n);
+        }
+      }
+    }
+  }
+}
+
+/**
+  Size of one frame in the output format, including any frame header.
+*/
+size_t videoFrame_size (const videoScene_t *scene, videoFormat_t format) {
+  size_t pixels = (size_t)scene->width * scene->height;
+  if (format == VIDEO_PPM) {
+    return snprintf(NULL, 0, "P6\n%d %d\n255\n", scene->width, scene->height) + pixels * 3;
+  }
+  return (format == VIDEO_Y4M) ? (6 + pixels * 3) : (pixels * 3);
+}
+
+/**
+  Convert a rendered RGB24 frame into the bytes written for `format`.
+*/
+void videoFrame_pack (const videoScene_t *scene, videoFormat_t format, const uint8_t *rgb, uint8_t *out) {
+  size_t pixels = (size_t)scene->width * scene->height;
+
+  if (format == VIDEO_RAW_RGB24) {
+    memcpy(out, rgb, pixels * 3);
+    return;
+  }
+  if (format == VIDEO_PPM) {
+    int header = sprintf((char *)out, "P6\n%d %d\n255\n", scene->width, scene->height);
+    memcpy(out + header, rgb, pixels * 3);
+    return;
+  }
+
+  // Y4M: frame header then Y, Cb and Cr planes (BT.601 full range)
+  memcpy(out, "FRAME\n", 6);
+  uint8_t *plane_y = out + 6;
+  uint8_t *plane_u = plane_y + pixels;
+  uint8_t *plane_v = plane_u + pixels;
+  for (size_t i = 0 ; i < pixels ; i++) {
+    int r = rgb[3 * i + 0];
+    int g = rgb[3 * i + 1];
+    int b = rgb[3 * i + 2];
+    plane_y[i] = clampByte((  77 * r + 150 * g +  29 * b + 128) >> 8);
+    plane_u[i] = clampByte(((-43 * r -  85 * g + 128 * b + 128) >> 8) + 128);
+    plane_v[i] = clampByte(((128 * r - 107 * g -  21 * b + 128) >> 8) + 128);
+  }
+}
+
+int videoWriter_header (const videoScene_t *scene, videoFormat_t format, FILE *out) {
+  if (format != VIDEO_Y4M) {
+    return 0;
+  }
+  return (fprintf(out, "YUV4MPEG2 W%d H%d F%ld:1000 Ip A1:1 C444 XCOLORRANGE=FULL\n",
+                  scene->width, scene->height, (long)(scene->fps * 1000 + 0.5)) < 0) ? -1 : 0;
+}
+
+typedef struct videoRenderJob {
+  const videoScene_t *scene;
+  videoFormat_t format;
+  long first_frame;
+  int frame_count;
+  int stride;       // Render every stride'th frame starting at first_frame
+  uint8_t *rgb;     // Scratch frame
+  uint8_t *frames;  // Packed output, one slot per frame of the batch
+  size_t frame_size;
+} videoRenderJob_t;
+
+static void *videoRenderJob_run (void *arg) {
+  videoRenderJob_t *job = arg;
+  for (int i = 0 ; i < job->frame_count ; i += job->stride) {
+    videoRender_frame(job->scene, job->first_frame + i, job->rgb);
+    videoFrame_pack(job->scene, job->format, job->rgb, job->frames + i * job->frame_size);
+  }
+  return NULL;
+}
+
+/**
+  Render `frame_count` frames from `first_frame` on `threads` threads and
+  stream them in order to `out`. When `first_frame` is 0 the Y4M stream
+  header is written first.
+
+  Return Values:
+    Number of frames written, or -1 on a write or memory error
+*/
+long videoRender_stream (const videoScene_t *scene, videoFormat_t format, long first_frame, long frame_count, int threads, FILE *out) {
+  size_t frame_size = videoFrame_size(scene, format);
+  size_t rgb_size = (size_t)scene->width * scene->height * 3;
+  int batch = threads * 4; // Frames in flight
+  long written = 0;
+  int failed = 0;
+
+  threads = (threads < 1) ? 1 : threads;
+  batch = (batch < 1) ? 1 : batch;
+
+  uint8_t *frames = malloc(frame_size * batch);
+  uint8_t *scratch = malloc(rgb_size * threads);
+  videoRenderJob_t *jobs = calloc(threads, sizeof(videoRenderJob_t));
+  pthread_t *thread_ids = calloc(threads, sizeof(pthread_t));
+  int *started = calloc(threads, sizeof(int));
+
+  if ( !frames || !scratch || !jobs || !thread_ids || !started ) {
+    failed = 1;
+  } else if ( (first_frame == 0) && (videoWriter_header(scene, format, out) < 0) ) {
+    failed = 1;
+  }
+
+  while ( !failed && (written < frame_count) ) {
+    int count = (frame_count - written < batch) ? (int)(frame_count - written) : batch;
+
+    for (int i = 0 ; i < threads ; i++) {
+      jobs[i].scene = scene;
+      jobs[i].format = format;
+      jobs[i].first_frame = first_frame + written + i;
+      jobs[i].frame_count = count - i;
+      jobs[i].stride = threads;
+      jobs[i].rgb = scratch + i * rgb_size;
+      jobs[i].frames = frames + i * frame_size;
+      jobs[i].frame_size = frame_size;
+      started[i] = (i < count) && (pthread_create(&thread_ids[i], NULL, videoRenderJob_run, &jobs[i]) == 0);
+      if (!started[i] && (i < count)) {
+        videoRenderJob_run(&jobs[i]);
+      }
+    }
+    for (int i = 0 ; i < threads ; i++) {
+      if (started[i]) {
+        pthread_join(thread_ids[i], NULL);
+      }
+    }
+
+    if (fwrite(frames, frame_size, count, out) != (size_t)count) {
+      failed = 1;
+      break;
+    }
+    written += count;
+  }
+
+  free(frames);
+  free(scratch);
+  free(jobs);
+  free(thread_ids);
+  free(started);
+  return failed ? -1 : written;
+}
+
+
+/*
+  VIDEO DECODING PIPELINE
+
+  Reads raw RGB24 or Y4M frames, classifies the LED region of each frame to a
+  colour and feeds the colours to the streaming receiver.
+
+    reader ----> classifier ----> decoder ----> byte sink
+       ^                             |
+       +------- free frames ---------+
+
+  Each stage runs on its own thread and hands frames on through bounded
+  queues, so reading the next frame, classifying this one and decoding the
+  last one overlap. Frame buffers are allocated once and recycled.
+*/
+
+typedef struct boundedQueue {
+  void **items;
+  int capacity;
+  int head;
+  int count;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} boundedQueue_t;
+
+int boundedQueue_init (boundedQueue_t *queue, int capacity) {
+  queue->items = calloc(capacity, sizeof(void *));
+  if (!queue->items) {
+    return -1;
+  }
+  queue->capacity = capacity;
+  queue->head = 0;
+  queue->count = 0;
+  queue->closed = 0;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+  return 0;
+}
+
+void boundedQueue_destroy (boundedQueue_t *queue) {
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+  free(queue->items);
+}
+
+/**
+  Blocks while the queue is full.
+
+  Return Values:
+    0 - item queued
+   -1 - queue was closed
+*/
+int boundedQueue_push (boundedQueue_t *queue, void *item) {
+  pthread_mutex_lock(&queue->lock);
+  while ( (queue->count == queue->capacity) && !queue->closed ) {
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+  }
+  if (queue->closed) {
+    pthread_mutex_unlock(&queue->lock);
+    return -1;
+  }
+  queue->items[(queue->head + queue->count) % queue->capacity] = item;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+  return 0;
+}
+
+/**
+  Blocks while the queue is empty. Returns NULL once the queue is closed
+  and drained.
+*/
+void *boundedQueue_pop (boundedQueue_t *queue) {
+  void *item = NULL;
+  pthread_mutex_lock(&queue->lock);
+  while ( (queue->count == 0) && !queue->closed ) {
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+  }
+  if (queue->count) {
+    item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return item;
+}
+
+// No more pushes; poppers drain what is left then get NULL
+void boundedQueue_close (boundedQueue_t *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_cond_broadcast(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+
+/*
+  VIDEO FRAMES
+*/
+
+typedef struct videoFrame {
+  int width;
+  int height;
+  videoFormat_t format;
+  int chroma_shift_x;   // Y4M chroma subsampling (1 for 4:2:0, 0 for 4:4:4)
+  int chroma_shift_y;
+  int full_range;       // Y4M levels are 0-255 rather than 16-235
+  uint8_t *data;        // RGB24 pixels, or Y then Cb then Cr planes
+  size_t size;
+  long index;
+  rgb_colour_t colour;  // Classified LED colour
+} videoFrame_t;
+
+/**
+  Fetch one pixel as R, G, B whatever the frame format.
+*/
+void videoFrame_rgb (const videoFrame_t *frame, int x, int y, uint8_t rgb[3]) {
+  if (frame->format == VIDEO_RAW_RGB24) {
+    const uint8_t *pixel = &frame->data[((size_t)y * frame->width + x) * 3];
+    rgb[0] = pixel[0];
+    rgb[1] = pixel[1];
+    rgb[2] = pixel[2];
+    return;
+  }
+
+  size_t luma_size = (size_t)frame->width * frame->height;
+  int chroma_width = (frame->width + (1 << frame->chroma_shift_x) - 1) >> frame->chroma_shift_x;
+  int chroma_height = (frame->height + (1 << frame->chroma_shift_y) - 1) >> frame->chroma_shift_y;
+  size_t chroma_index = (size_t)(y >> frame->chroma_shift_y) * chroma_width + (x >> frame->chroma_shift_x);
+
+  int luma = frame->data[(size_t)y * frame->width + x];
+  int cb = frame->data[luma_size + chroma_index] - 128;
+  int cr = frame->data[luma_size + (size_t)chroma_width * chroma_height + chroma_index] - 128;
+
+  if (!frame->full_range) {
+    luma = ((luma - 16) * 298) >> 8;
+    cb = (cb * 291) >> 8;
+    cr = (cr * 291) >> 8;
+  }
+
+  // BT.601 in 8bit fixed point
+  rgb[0] = clampByte(luma + ((359 * cr) >> 8));
+  rgb[1] = clampByte(luma - ((88 * cb + 183 * cr) >> 8));
+  rgb[2] = clampByte(luma + ((454 * cb) >> 8));
+}
+
+typedef struct videoReader {
+  FILE *in;
+  videoFormat_t format;
+  int width;
+  int height;
+  int chroma_shift_x;
+  int chroma_shift_y;
+  int full_range;
+  double fps;
+  size_t frame_size;
+  int header_read;      // PPM: the next frame's header was already read by videoReader_open()
+} videoReader_t;
+
+// P6 header with a maxval of 255 (no comments); 0 on success, -1 at end of stream or on anything else
+static int ppmHeader_read (FILE *in, int *width, int *height) {
+  int maxval = 0;
+  if ( (fscanf(in, "P6 %d %d %d", width, height, &maxval) != 3) || (maxval != 255) ) {
+    return -1;
+  }
+  fgetc(in); // Single whitespace before the pixels
+  return 0;
+}
+
+/**
+  Open a stream. Y4M and PPM streams describe themselves; for raw RGB24
+  `width` and `height` must be given.
+
+  Return Values:
+    0 - ready to read frames
+   -1 - unsupported or malformed stream
+*/
+int videoReader_open (videoReader_t *reader, FILE *in, videoFormat_t format, int width, int height) {
+  reader->in = in;
+  reader->format = format;
+  reader->width = width;
+  reader->height = height;
+  reader->chroma_shift_x = 0;
+  reader->chroma_shift_y = 0;
+  reader->full_range = 1;
+  reader->fps = 0;
+  reader->header_read = 0;
+
+  if (format == VIDEO_PPM) {
+    if (ppmHeader_read(in, &reader->width, &reader->height) < 0) {
+      return -1;
+    }
+    reader->header_read = 1;
+  }
+
+  if (format == VIDEO_Y4M) {
+    char header[256];
+    if ( !fgets(header, sizeof(header), in) || strncmp(header, "YUV4MPEG2 ", 10) ) {
+      return -1;
+    }
+    reader->chroma_shift_x = 1; // 4:2:0 unless the header says otherwise
+    reader->chroma_shift_y = 1;
+    reader->full_range = 0;
+    for (char *token = strtok(header + 10, " \n") ; token ; token = strtok(NULL, " \n")) {
+      switch (token[0]) {
+      case ('W'):
+        reader->width = atoi(token + 1);
+        break;
+      case ('H'):
+        reader->height = atoi(token + 1);
+        break;
+      case ('F'): {
+        long numerator = 0, denominator = 1;
+        if ( (sscanf(token + 1, "%ld:%ld", &numerator, &denominator) == 2) && denominator ) {
+          reader->fps = (double)numerator / denominator;
+        }
+        break;
+      }
+      case ('C'):
+        if (!strncmp(token, "C444", 4)) {
+          reader->chroma_shift_x = 0;
+          reader->chroma_shift_y = 0;
+        } else if (strncmp(token, "C420", 4)) {
+          return -1; // Only 4:4:4 and 4:2:0 are supported
+        }
+        break;
+      case ('X'):
+        if (!strcmp(token, "XCOLORRANGE=FULL")) {
+          reader->full_range = 1;
+        }
+        break;
+      }
+    }
+  }
+
+  if ( (reader->width <= 0) || (reader->height <= 0) ) {
+    return -1;
+  }
+
+  size_t luma_size = (size_t)reader->width * reader->height;
+  size_t chroma_size = (size_t)((reader->width + (1 << reader->chroma_shift_x) - 1) >> reader->chroma_shift_x)
+                     * ((reader->height + (1 << reader->chroma_shift_y) - 1) >> reader->chroma_shift_y);
+  reader->frame_size = (format == VIDEO_Y4M) ? (luma_size + 2 * chroma_size) : (luma_size * 3);
+  return 0;
+}
+
+/**
+  Read the next frame into `frame`, whose buffer holds `reader->frame_size`.
+
+  Return Values:
+    1 - frame read
+    0 - end of stream
+   -1 - malformed or truncated frame
+*/
+int videoReader_read (videoReader_t *reader, videoFrame_t *frame) {
+  if (reader->format == VIDEO_Y4M) {
+    char header[128];
+    if (!fgets(header, sizeof(header), reader->in)) {
+      return 0;
+    }
+    if (strncmp(header, "FRAME", 5)) {
+      return -1;
+    }
+  } else if (reader->format == VIDEO_PPM) {
+    int width, height;
+    if (!reader->header_read) {
+      int c = fgetc(reader->in);
+      if (c == EOF) {
+        return 0;
+      }
+      ungetc(c, reader->in);
+      if ( (ppmHeader_read(reader->in, &width, &height) < 0) || (width != reader->width) || (height != reader->height) ) {
+        return -1;
+      }
+    }
+    reader->header_read = 0;
+  }
+
+  size_t got = fread(frame->data, 1, reader->frame_size, reader->in);
+  if (got != reader->frame_size) {
+    return (got == 0 && reader->format == VIDEO_RAW_RGB24) ? 0 : -1;
+  }
+
+  frame->width = reader->width;
+  frame->height = reader->height;
+  frame->format = (reader->format == VIDEO_PPM) ? VIDEO_RAW_RGB24 : reader->format;
+  frame->chroma_shift_x = reader->chroma_shift_x;
+  frame->chroma_shift_y = reader->chroma_shift_y;
+  frame->full_range = reader->full_range;
+  frame->size = reader->frame_size;
+  return 1;
+}
+
+
+/*
+  COLOUR CLASSIFIER
+*/
+
+typedef struct colourClassifier {
+  uint8_t on_level;     // Channel level that counts as lit
+  int min_pixels;       // Fewer lit pixels than this in the region reads as DARK
+  int step;             // Sample every step'th pixel in x and y (1 = all)
+} colourClassifier_t;
+
+typedef struct videoRegion {
+  int x;
+  int y;
+  int width;            // 0 = whole frame
+  int height;
+} videoRegion_t;
+
+/**
+  A channel is on when it is lit and at least half as bright as the
+  brightest channel, so a bright WHITE glow does not tint its neighbours.
+*/
+rgb_colour_t colourClassify_rgb (const colourClassifier_t *classifier, const uint8_t rgb[3]) {
+  uint8_t peak = rgb[0];
+  peak = (rgb[1] > peak) ? rgb[1] : peak;
+  peak = (rgb[2] > peak) ? rgb[2] : peak;
+  if (peak < classifier->on_level) {
+    return DARK;
+  }
+
+  rgb_colour_t colour = DARK;
+  if (rgb[0] * 2 >= peak) {
+    colour |= RED;
+  }
+  if (rgb[1] * 2 >= peak) {
+    colour |= GREEN;
+  }
+  if (rgb[2] * 2 >= peak) {
+    colour |= BLUE;
+  }
+  return colour;
+}
+
+typedef struct regionMeasure {
+  int lit;              // Lit pixels sampled
+  int visited;          // Pixels sampled
+  uint32_t sum_x;       // Sums over lit pixels
+  uint32_t sum_y;
+  uint32_t sum[3];
+} regionMeasure_t;
+
+/**
+  Sample every step'th pixel of a region (clipped to the frame) and sum the
+  position and colour of the lit ones.
+*/
+void videoRegion_measure (const colourClassifier_t *classifier, const videoFrame_t *frame, videoRegion_t region, regionMeasure_t *measure) {
+  int step = (classifier->step > 0) ? classifier->step : 1;
+
+  memset(measure, 0x00, sizeof(regionMeasure_t));
+  if (region.width <= 0 || region.height <= 0) {
+    region.x = 0;
+    region.y = 0;
+    region.width = frame->width;
+    region.height = frame->height;
+  }
+  int x0 = (region.x < 0) ? 0 : region.x;
+  int y0 = (region.y < 0) ? 0 : region.y;
+  int x1 = (region.x + region.width > frame->width) ? frame->width : region.x + region.width;
+  int y1 = (region.y + region.height > frame->height) ? frame->height : region.y + region.height;
+
+  for (int y = y0 ; y < y1 ; y += step) {
+    for (int x = x0 ; x < x1 ; x += step) {
+      uint8_t rgb[3];
+      videoFrame_rgb(frame, x, y, rgb);
+      measure->visited++;
+      if ( (rgb[0] >= classifier->on_level) || (rgb[1] >= classifier->on_level) || (rgb[2] >= classifier->on_level) ) {
+        measure->sum_x += x;
+        measure->sum_y += y;
+        measure->sum[0] += rgb[0];
+        measure->sum[1] += rgb[1];
+        measure->sum[2] += rgb[2];
+        measure->lit++;
+      }
+    }
+  }
+}
+
+rgb_colour_t colourClassify_measure (const colourClassifier_t *classifier, const regionMeasure_t *measure) {
+  if ( (measure->lit == 0) || (measure->lit < classifier->min_pixels) ) {
+    return DARK;
+  }
+  uint8_t mean[3] = { measure->sum[0] / measure->lit, measure->sum[1] / measure->lit, measure->sum[2] / measure->lit };
+  return colourClassify_rgb(classifier, mean);
+}
+
+/**
+  Classify a region by averaging its lit pixels; background pixels below
+  the on level are ignored so the LED does not need to fill the region.
+*/
+rgb_colour_t colourClassify_region (const colourClassifier_t *classifier, const videoFrame_t *frame, videoRegion_t region) {
+  regionMeasure_t measure;
+  videoRegion_measure(classifier, frame, region, &measure);
+  return colourClassify_measure(classifier, &measure);
+}
+
+
+/*
+  LED DETECTION AND TRACKING
+
+  Scanning every pixel of every frame wastes nearly all the CPU on
+  background. Once an LED has been found it is followed with a constant
+  velocity (alpha beta) tracker, and only a small window around its
+  predicted position is sampled each frame. While the LED is off the
+  prediction coasts; after too many frames with nothing lit the track is
+  dropped and the whole frame is scanned on a coarse grid to find it again,
+  one pyramid level finer each frame it is not found.
+*/
+
+typedef struct ledBlob {
+  double x;             // Centroid
+  double y;
+  double radius;
+  int lit;              // Lit samples at the scan step it was found at
+} ledBlob_t;
+
+typedef struct ledCluster {
+  int x0, y0, x1, y1;   // Bounding box of the lit samples
+  uint32_t sum_x, sum_y;
+  int lit;
+} ledCluster_t;
+
+/**
+  Find lit blobs on a grid of every step'th pixel. Neighbouring lit samples
+  (within two steps) are grouped into one blob. At most `max_blobs` are
+  found, in the order their top rows are scanned. `clusters` is scratch
+  space for `max_blobs` entries, owned by the caller so scans allocate
+  nothing.
+
+  Return Value:
+    Number of blobs written to `blobs`
+*/
+int ledDetect_scan (const colourClassifier_t *classifier, const videoFrame_t *frame, int step, ledBlob_t *blobs, ledCluster_t *clusters,
+                    int max_blobs, long *visited) {
+  int cluster_count = 0;
+
+  step = (step > 0) ? step : 1;
+  int reach = 2 * step;
+  for (int y = step / 2 ; y < frame->height ; y += step) {
+    for (int x = step / 2 ; x < frame->width ; x += step) {
+      uint8_t rgb[3];
+      videoFrame_rgb(frame, x, y, rgb);
+      (*visited)++;
+      if ( (rgb[0] < classifier->on_level) && (rgb[1] < classifier->on_level) && (rgb[2] < classifier->on_level) ) {
+        continue;
+      }
+
+      // Newest clusters are the most likely neighbours
+      int c = cluster_count - 1;
+      while ( (c >= 0) && !( (x >= clusters[c].x0 - reach) && (x <= clusters[c].x1 + reach)
+                           && (y >= clusters[c].y0 - reach) && (y <= clusters[c].y1 + reach) ) ) {
+        c--;
+      }
+      if (c < 0) {
+        if (cluster_count == max_blobs) {
+          continue;
+        }
+        c = cluster_count++;
+        clusters[c].x0 = clusters[c].x1 = x;
+        clusters[c].y0 = clusters[c].y1 = y;
+        clusters[c].sum_x = clusters[c].sum_y = 0;
+        clusters[c].lit = 0;
+      }
+      clusters[c].x0 = (x < clusters[c].x0) ? x : clusters[c].x0;
+      clusters[c].x1 = (x > clusters[c].x1) ? x : clusters[c].x1;
+      clusters[c].y1 = y; // Rows are scanned in order
+      clusters[c].sum_x += x;
+      clusters[c].sum_y += y;
+      clusters[c].lit++;
+    }
+  }
+
+  for (int c = 0 ; c < cluster_count ; c++) {
+    blobs[c].x = (double)clusters[c].sum_x / clusters[c].lit;
+    blobs[c].y = (double)clusters[c].sum_y / clusters[c].lit;
+    blobs[c].radius = ((clusters[c].x1 - clusters[c].x0) + (clusters[c].y1 - clusters[c].y0)) / 4.0 + step;
+    blobs[c].lit = clusters[c].lit;
+  }
+  return cluster_count;
+}
+
+typedef struct ledTracker {
+  colourClassifier_t classifier;
+  double alpha;         // Position gain
+  double beta;          // Velocity gain
+  int margin;           // Extra pixels around the LED in the search window
+  int max_lost;         // Frames with nothing lit before the track is dropped
+  int search;           // Scan the frame for the LED when the track is lost
+  int coarse_step;      // Coarsest scan step when searching
+  int fine_step;        // Finest scan step when searching
+  // Track state
+  int locked;
+  int lost_frames;
+  int scan_step;        // Step of the next search scan
+  double x, y;
+  double vx, vy;        // Pixels per frame
+  double radius;
+  long visited;         // Pixels sampled so far
+} ledTracker_t;
+
+void ledTracker_init (ledTracker_t *tracker, const colourClassifier_t *classifier) {
+  memset(tracker, 0x00, sizeof(ledTracker_t));
+  tracker->classifier = *classifier;
+  tracker->classifier.step = 1;
+  tracker->alpha = 0.6;
+  tracker->beta = 0.2;
+  tracker->margin = 4;
+  tracker->max_lost = 30;
+  tracker->search = 1;
+  tracker->coarse_step = 16;
+  tracker->fine_step = 2;
+  tracker->scan_step = tracker->coarse_step;
+}
+
+// Start tracking a blob
+void ledTracker_lock (ledTracker_t *tracker, const ledBlob_t *blob) {
+  tracker->locked = 1;
+  tracker->lost_frames = 0;
+  tracker->x = blob->x;
+  tracker->y = blob->y;
+  tracker->vx = 0;
+  tracker->vy = 0;
+  tracker->radius = blob->radius;
+}
+
+videoRegion_t ledTracker_window (const ledTracker_t *tracker) {
+  // The window grows while the LED is not seen, as the prediction gets less sure
+  int half = (int)(tracker->radius + 0.5) + tracker->margin + tracker->lost_frames;
+  videoRegion_t window = {
+    .x = (int)(tracker->x + tracker->vx + 0.5) - half,
+    .y = (int)(tracker->y + tracker->vy + 0.5) - half,
+    .width = 2 * half + 1,
+    .height = 2 * half + 1
+  };
+  return window;
+}
+
+/**
+  Follow the LED into the next frame and classify its colour.
+  Returns DARK while no LED is locked.
+*/
+rgb_colour_t ledTracker_update (ledTracker_t *tracker, const videoFrame_t *frame) {
+  if (!tracker->locked && !tracker->search) {
+    return DARK;
+  }
+  if (!tracker->locked) {
+    // One pyramid level per frame, so a frame with no LED never costs a full scan
+    ledBlob_t blobs[8];
+    ledCluster_t clusters[8];
+    int count = ledDetect_scan(&tracker->classifier, frame, tracker->scan_step, blobs, clusters, 8, &tracker->visited);
+    if (!count) {
+      tracker->scan_step /= 2;
+      if (tracker->scan_step < tracker->fine_step) {
+        tracker->scan_step = tracker->coarse_step;
+      }
+      return DARK;
+    }
+    int best = 0;
+    for (int i = 1 ; i < count ; i++) {
+      best = (blobs[i].lit > blobs[best].lit) ? i : best;
+    }
+    ledTracker_lock(tracker, &blobs[best]);
+    tracker->scan_step = tracker->coarse_step;
+  }
+
+  regionMeasure_t measure;
+  videoRegion_measure(&tracker->classifier, frame, ledTracker_window(tracker), &measure);
+  tracker->visited += measure.visited;
+
+  double predicted_x = tracker->x + tracker->vx;
+  double predicted_y = tracker->y + tracker->vy;
+  rgb_colour_t colour = colourClassify_measure(&tracker->classifier, &measure);
+
+  if (colour == DARK) {
+    // LED off or lost: coast on the prediction
+    tracker->x = predicted_x;
+    tracker->y = predicted_y;
+    if (++tracker->lost_frames > tracker->max_lost) {
+      tracker->locked = 0;
+    }
+    return DARK;
+  }
+
+  double error_x = (double)measure.sum_x / measure.lit - predicted_x;
+  double error_y = (double)measure.sum_y / measure.lit - predicted_y;
+  tracker->x = predicted_x + tracker->alpha * error_x;
+  tracker->y = predicted_y + tracker->alpha * error_y;
+  tracker->vx += tracker->beta * error_x;
+  tracker->vy += tracker->beta * error_y;
+  tracker->radius += 0.25 * (sqrt(measure.lit / M_PI) - tracker->radius);
+  tracker->lost_frames = 0;
+  return colour;
+}
+
+
+/*
+  PIPELINE
+*/
+
+typedef void (*videoByteSink_t) (void *user, uint8_t byte, int returncode, long frame);
+
+typedef struct videoPipelineConfig {
+  videoFormat_t format;
+  int width;                     // Raw RGB24 only
+  int height;
+  videoRegion_t region;          // Where the LED is (when not tracking)
+  int track_led;                 // Find and follow the LED instead of using `region`
+  colourClassifier_t classifier;
+  const colourMap_t *map;
+  paritySel_t parity;
+  uint32_t max_blend_len;
+  int queue_depth;               // Frames queued between stages
+  videoByteSink_t sink;          // Called for every completed byte (returncode as colourDecoder_push)
+  void *user;
+} videoPipelineConfig_t;
+
+typedef struct videoPipelineStats {
+  long frames;
+  long bytes;                    // Bytes with good framing and parity
+  long errors;                   // Parity and framing errors
+  long pixels;                   // Pixels sampled by the classifier
+} videoPipelineStats_t;
+
+typedef struct videoPipeline {
+  const videoPipelineConfig_t *config;
+  boundedQueue_t free_frames;
+  boundedQueue_t read_frames;
+  boundedQueue_t classified_frames;
+  colourStream_t stream;
+  ledTracker_t tracker;
+  videoPipelineStats_t stats;
+} videoPipeline_t;
+
+static void *videoPipeline_classify (void *arg) {
+  videoPipeline_t *pipeline = arg;
+  videoFrame_t *frame;
+
+  while ( (frame = boundedQueue_pop(&pipeline->read_frames)) ) {
+    if (pipeline->config->track_led) {
+      long visited = pipeline->tracker.visited;
+      frame->colour = ledTracker_update(&pipeline->tracker, frame);
+      pipeline->stats.pixels += pipeline->tracker.visited - visited;
+    } else {
+      regionMeasure_t measure;
+      videoRegion_measure(&pipeline->config->classifier, frame, pipeline->config->region, &measure);
+      pipeline->stats.pixels += measure.visited;
+      frame->colour = colourClassify_measure(&pipeline->config->classifier, &measure);
+    }
+    boundedQueue_push(&pipeline->classified_frames, frame);
+  }
+  boundedQueue_close(&pipeline->classified_frames);
+  return NULL;
+}
+
+static void *videoPipeline_decode (void *arg) {
+  videoPipeline_t *pipeline = arg;
+  const videoPipelineConfig_t *config = pipeline->config;
+  videoFrame_t *frame;
+
+  while ( (frame = boundedQueue_pop(&pipeline->classified_frames)) ) {
+    uint8_t output_byte;
+    int returncode = colourStream_push(&pipeline->stream, frame->colour, &output_byte);
+    long index = frame->index;
+    pipeline->stats.frames++;
+    boundedQueue_push(&pipeline->free_frames, frame);
+
+    if ( (returncode == 0) || (returncode == -1) ) {
+      continue;
+    }
+    if (returncode > 0) {
+      pipeline->stats.bytes++;
+    } else {
+      pipeline->stats.errors++;
+    }
+    if (config->sink) {
+      config->sink(config->user, output_byte, returncode, index);
+    }
+  }
+  return NULL;
+}
+
+/**
+  Decode a whole video stream. The calling thread reads frames while two
+  worker threads classify and decode.
+
+  Return Values:
+    0 - stream decoded to the end
+   -1 - unreadable stream, out of memory or a worker thread could not be started
+*/
+int videoPipeline_run (const videoPipelineConfig_t *config, FILE *in, videoPipelineStats_t *stats) {
+  videoReader_t reader;
+  videoPipeline_t pipeline;
+  pthread_t classify_thread;
+  pthread_t decode_thread;
+  int depth = (config->queue_depth > 0) ? config->queue_depth : 4;
+  int pool_size = 2 * depth + 2;
+  int failed = 0;
+
+  if (videoReader_open(&reader, in, config->format, config->width, config->height) < 0) {
+    return -1;
+  }
+
+  memset(&pipeline, 0x00, sizeof(pipeline));
+  pipeline.config = config;
+  colourStream_init(&pipeline.stream, config->map, config->parity, config->max_blend_len);
+  ledTracker_init(&pipeline.tracker, &config->classifier);
+
+  videoFrame_t *frames = calloc(pool_size, sizeof(videoFrame_t));
+  uint8_t *buffers = malloc(reader.frame_size * pool_size);
+  int ready = 0;
+  if (frames && buffers) {
+    ready += (boundedQueue_init(&pipeline.free_frames, pool_size) == 0);
+    ready += (ready == 1) && (boundedQueue_init(&pipeline.read_frames, depth) == 0);
+    ready += (ready == 2) && (boundedQueue_init(&pipeline.classified_frames, depth) == 0);
+  }
+  if (ready < 3) {
+    if (ready > 0) {
+      boundedQueue_destroy(&pipeline.free_frames);
+    }
+    if (ready > 1) {
+      boundedQueue_destroy(&pipeline.read_frames);
+    }
+    free(frames);
+    free(buffers);
+    return -1;
+  }
+  for (int i = 0 ; i < pool_size ; i++) {
+    frames[i].data = buffers + reader.frame_size * i;
+    boundedQueue_push(&pipeline.free_frames, &frames[i]);
+  }
+
+  int started = 0;
+  started += (pthread_create(&classify_thread, NULL, videoPipeline_classify, &pipeline) == 0);
+  started += (started == 1) && (pthread_create(&decode_thread, NULL, videoPipeline_decode, &pipeline) == 0);
+  if (started < 2) {
+    // Closed queues let a running classify stage drain and exit
+    boundedQueue_close(&pipeline.read_frames);
+    boundedQueue_close(&pipeline.classified_frames);
+    boundedQueue_close(&pipeline.free_frames);
+    if (started > 0) {
+      pthread_join(classify_thread, NULL);
+    }
+    boundedQueue_destroy(&pipeline.free_frames);
+    boundedQueue_destroy(&pipeline.read_frames);
+    boundedQueue_destroy(&pipeline.classified_frames);
+    free(frames);
+    free(buffers);
+    return -1;
+  }
+
+  // Reader stage
+  for (long index = 0 ; ; index++) {
+    videoFrame_t *frame = boundedQueue_pop(&pipeline.free_frames);
+    int status = videoReader_read(&reader, frame);
+    if (status <= 0) {
+      failed = (status < 0);
+      break;
+    }
+    frame->index = index;
+    boundedQueue_push(&pipeline.read_frames, frame);
+  }
+  boundedQueue_close(&pipeline.read_frames);
+
+  pthread_join(classify_thread, NULL);
+  pthread_join(decode_thread, NULL);
+
+  if (stats) {
+    *stats = pipeline.stats;
+  }
+  boundedQueue_destroy(&pipeline.free_frames);
+  boundedQueue_destroy(&pipeline.read_frames);
+  boundedQueue_destroy(&pipeline.classified_frames);
+  free(frames);
+  free(buffers);
+  return failed ? -1 : 0;
+}
+
+
+/*
+  WORKER POOL
+
+  Threads started once and reused for every frame. workerPool_run() wakes
+  them, runs job(context, index) for index 0 to threads - 1 (index 0, and
+  the index of any thread that could not be started, on the calling
+  thread) and returns when all are done.
+*/
+
+typedef void (*workerPoolJob_t) (void *context, int index);
+
+typedef struct workerPoolThread {
+  struct workerPool *pool;
+  int index;
+} workerPoolThread_t;
+
+typedef struct workerPool {
+  int threads;               // Job indices per run, the calling thread included
+  int started;               // Pool threads running, for indices 1 to started
+  pthread_t *thread_ids;
+  workerPoolThread_t *slots;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t finished;
+  workerPoolJob_t job;
+  void *context;
+  long generation;           // Bumped for every run
+  int pending;               // Pool threads still busy with this run
+  int stopping;
+} workerPool_t;
+
+static void *workerPool_thread (void *arg) {
+  workerPoolThread_t *slot = arg;
+  workerPool_t *pool = slot->pool;
+  long seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stopping && (pool->generation == seen)) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->stopping) {
+      break;
+    }
+    seen = pool->generation;
+    workerPoolJob_t job = pool->job;
+    void *context = pool->context;
+    pthread_mutex_unlock(&pool->lock);
+
+    job(context, slot->index);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) {
+      pthread_cond_signal(&pool->finished);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/**
+  Start threads - 1 pool threads. If some cannot be started their share
+  runs on the calling thread.
+
+  Return Values:
+    0 on success, -1 when out of memory
+*/
+int workerPool_init (workerPool_t *pool, int threads) {
+  memset(pool, 0x00, sizeof(workerPool_t));
+  pool->threads = (threads < 1) ? 1 : threads;
+  pool->thread_ids = calloc(pool->threads, sizeof(pthread_t));
+  pool->slots = calloc(pool->threads, sizeof(workerPoolThread_t));
+  if (!pool->thread_ids || !pool->slots) {
+    free(pool->thread_ids);
+    free(pool->slots);
+    return -1;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  for (int i = 1 ; i < pool->threads ; i++) {
+    pool->slots[i].pool = pool;
+    pool->slots[i].index = i;
+    if (pthread_create(&pool->thread_ids[i], NULL, workerPool_thread, &pool->slots[i]) != 0) {
+      break;
+    }
+    pool->started = i;
+  }
+  return 0;
+}
+
+void workerPool_run (workerPool_t *pool, workerPoolJob_t job, void *context) {
+  pthread_mutex_lock(&pool->lock);
+  pool->job = job;
+  pool->context = context;
+  pool->pending = pool->started;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  job(context, 0);
+  for (int i = pool->started + 1 ; i < pool->threads ; i++) {
+    job(context, i); // No thread for this index, run it here instead
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending) {
+    pthread_cond_wait(&pool->finished, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void workerPool_destroy (workerPool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 1 ; i <= pool->started ; i++) {
+    pthread_join(pool->thread_ids[i], NULL);
+  }
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->finished);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->thread_ids);
+  free(pool->slots);
+}
+
+
+/*
+  MULTI STREAM RECEIVER
+
+  Decodes many LEDs seen by one camera. Every LED found gets its own
+  channel: a tracker and a streaming receiver, i.e. its own
+  nextColourSeq_to_2bit() state. Each frame the channels are shared out
+  between the threads of a worker pool started with the receiver, so the
+  cost per LED is one small window of pixels and one step of the decoder.
+  A coarse scan of the whole frame runs every `rescan_interval` frames to
+  pick up new LEDs and find lost ones again. A channel whose LED has not
+  been seen for `retire_scans` scans is retired and its slot reused.
+
+  Bytes are handed to the sink on the calling thread after every frame, in
+  channel order, so the sink needs no locking.
+*/
+
+typedef void (*ledByteSink_t) (void *user, int channel, uint8_t byte, int returncode, long frame);
+
+typedef struct ledChannel {
+  ledTracker_t tracker;
+  colourStream_t stream;
+  int active;            // 0 once retired, free for a new LED
+  int unlocked_scans;    // Scans in a row that found the tracker unlocked
+  int returncode;        // Result of this frame's sample
+  uint8_t byte;
+} ledChannel_t;
+
+typedef struct multiReceiver {
+  colourClassifier_t classifier;
+  const colourMap_t *map;
+  paritySel_t parity;
+  uint32_t max_blend_len;
+  int rescan_interval;   // Frames between scans for new LEDs
+  int scan_step;         // Grid step of those scans
+  int retire_scans;      // Scans a lost LED is waited for before its channel is reused
+  ledByteSink_t sink;
+  void *user;
+
+  ledChannel_t *channels;
+  int channel_count;     // Slots in use or retired
+  int max_channels;
+  ledBlob_t *blobs;      // Scan scratch
+  ledCluster_t *clusters;
+
+  workerPool_t pool;     // The calling thread is worker 0
+  const videoFrame_t *frame;
+  long frame_index;
+  long visited;
+} multiReceiver_t;
+
+static void multiReceiver_work (void *context, int index) {
+  multiReceiver_t *receiver = context;
+  for (int i = index ; i < receiver->channel_count ; i += receiver->pool.threads) {
+    ledChannel_t *channel = &receiver->channels[i];
+    channel->returncode = 0;
+    if (channel->active) {
+      rgb_colour_t colour = ledTracker_update(&channel->tracker, receiver->frame);
+      channel->returncode = colourStream_push(&channel->stream, colour, &channel->byte);
+    }
+  }
+}
+
+/**
+  Return Values:
+    0 - ready, fill in the settings before the first frame
+   -1 - out of memory
+*/
+int multiReceiver_init (multiReceiver_t *receiver, int max_channels, int threads) {
+  memset(receiver, 0x00, sizeof(multiReceiver_t));
+  receiver->parity = PARITY_SETTING;
+  receiver->rescan_interval = 2; // A new LED must be found within its first symbol
+  receiver->scan_step = 4;
+  receiver->retire_scans = 16;
+  receiver->max_channels = max_channels;
+
+  receiver->channels = calloc(max_channels, sizeof(ledChannel_t));
+  receiver->blobs = calloc(max_channels, sizeof(ledBlob_t));
+  receiver->clusters = calloc(max_channels, sizeof(ledCluster_t));
+  if ( !receiver->channels || !receiver->blobs || !receiver->clusters || (workerPool_init(&receiver->pool, threads) < 0) ) {
+    free(receiver->channels);
+    free(receiver->blobs);
+    free(receiver->clusters);
+    return -1;
+  }
+  return 0;
+}
+
+void multiReceiver_destroy (multiReceiver_t *receiver) {
+  workerPool_destroy(&receiver->pool);
+  free(receiver->channels);
+  free(receiver->blobs);
+  free(receiver->clusters);
+}
+
+// Retire channels lost for too long, then add channels for blobs that no channel is following
+static void multiReceiver_scan (multiReceiver_t *receiver, const videoFrame_t *frame) {
+  int count = ledDetect_scan(&receiver->classifier, frame, receiver->scan_step, receiver->blobs, receiver->clusters,
+                             receiver->max_channels, &receiver->visited);
+
+  for (int i = 0 ; i < receiver->channel_count ; i++) {
+    ledChannel_t *channel = &receiver->channels[i];
+    if (!channel->active) {
+      continue;
+    }
+    channel->unlocked_scans = channel->tracker.locked ? 0 : channel->unlocked_scans + 1;
+    if ( (receiver->retire_scans > 0) && (channel->unlocked_scans >= receiver->retire_scans) ) {
+      channel->active = 0;
+    }
+  }
+
+  for (int b = 0 ; b < count ; b++) {
+    const ledBlob_t *blob = &receiver->blobs[b];
+    int nearest = -1;
+    double nearest_distance = 0;
+
+    for (int i = 0 ; i < receiver->channel_count ; i++) {
+      const ledTracker_t *tracker = &receiver->channels[i].tracker;
+      if (!receiver->channels[i].active) {
+        continue;
+      }
+      double dx = tracker->x - blob->x;
+      double dy = tracker->y - blob->y;
+      double distance = sqrt(dx * dx + dy * dy);
+      if ( (distance < tracker->radius + blob->radius + tracker->margin) && ((nearest < 0) || (distance < nearest_distance)) ) {
+        nearest = i;
+        nearest_distance = distance;
+      }
+    }
+
+    if (nearest >= 0) {
+      if (!receiver->channels[nearest].tracker.locked) {
+        ledTracker_lock(&receiver->channels[nearest].tracker, blob); // Lost LED seen again
+      }
+      continue;
+    }
+
+    int slot = 0;
+    while ( (slot < receiver->channel_count) && receiver->channels[slot].active ) {
+      slot++;
+    }
+    if (slot == receiver->max_channels) {
+      continue;
+    }
+    if (slot == receiver->channel_count) {
+      receiver->channel_count++;
+    }
+
+    ledChannel_t *channel = &receiver->channels[slot];
+    receiver->visited += channel->tracker.visited; // Keep the retired channel's count
+    memset(channel, 0x00, sizeof(ledChannel_t));
+    channel->active = 1;
+    ledTracker_init(&channel->tracker, &receiver->classifier);
+    channel->tracker.search = 0;
+    ledTracker_lock(&channel->tracker, blob);
+    colourStream_init(&channel->stream, receiver->map, receiver->parity, receiver->max_blend_len);
+  }
+}
+
+/**
+  Process one frame: find new LEDs when due, then classify and decode every
+  channel across the worker threads.
+
+  Return Value:
+    Number of channel slots, retired ones included
+*/
+int multiReceiver_frame (multiReceiver_t *receiver, const videoFrame_t *frame) {
+  if ( (receiver->rescan_interval > 0) && (receiver->frame_index % receiver->rescan_interval == 0) ) {
+    multiReceiver_scan(receiver, frame);
+  }
+
+  receiver->frame = frame;
+  workerPool_run(&receiver->pool, multiReceiver_work, receiver);
+
+  for (int i = 0 ; i < receiver->channel_count ; i++) {
+    ledChannel_t *channel = &receiver->channels[i];
+    if ( receiver->sink && (channel->returncode != 0) && (channel->returncode != -1) ) {
+      receiver->sink(receiver->user, i, channel->byte, channel->returncode, receiver->frame_index);
+    }
+  }
+  receiver->frame_index++;
+  return receiver->channel_count;
+}
+
+// Pixels sampled by scans and all channel trackers so far
+long multiReceiver_visited (const multiReceiver_t *receiver) {
+  long visited = receiver->visited;
+  for (int i = 0 ; i < receiver->channel_count ; i++) {
+    visited += receiver->channels[i].tracker.visited;
+  }
+  return visited;
+}
+
+
+/*
+  ROLLING SHUTTER STRIPES
+
+  A CMOS camera exposes its rows one after another. An LED switching faster
+  than the frame rate therefore shows up as horizontal colour stripes
+  across a single frame, with each row a sample in time. Reading those
+  stripes raises the symbol rate from a few per frame to hundreds per
+  frame.
+
+  Each row of the LED region is averaged and classified. Runs of equal rows
+  are the stripes. Stripes are handed to the blend filter and decoder as
+  runs measured in rows. The last stripe of a frame stays open, so a colour
+  that carries on at the top of the next frame joins up with it. Symbols
+  that start and end during the vertical blanking gap between frames are
+  not seen at all; they show up as framing or parity errors.
+*/
+
+typedef struct stripeDecoder {
+  colourClassifier_t classifier;
+  videoRegion_t region;         // Columns and rows the LED lights (0 width = whole frame)
+  colourRun_t open_stripe;      // Last stripe seen, may continue in the next frame
+  blendFilter_t filter;
+  colourDecoder_t decoder;
+  rgb_colour_t *row_colours;    // Scratch, one per frame row
+  colourRun_t *stripes;         // Scratch, one per frame row
+  int rows;                     // Scratch capacity
+  long stripe_count;            // Stripes completed
+} stripeDecoder_t;
+
+int stripeDecoder_init (stripeDecoder_t *stripe, const colourClassifier_t *classifier, const colourMap_t *map, paritySel_t paritySelect, int max_rows) {
+  memset(stripe, 0x00, sizeof(stripeDecoder_t));
+  stripe->classifier = *classifier;
+  stripe->open_stripe.colour = DARK;
+  blendFilter_init(&stripe->filter, 0);
+  colourDecoder_init(&stripe->decoder, map, paritySelect);
+  stripe->rows = max_rows;
+  stripe->row_colours = malloc(max_rows * sizeof(rgb_colour_t));
+  stripe->stripes = malloc(max_rows * sizeof(colourRun_t));
+  if (!stripe->row_colours || !stripe->stripes) {
+    free(stripe->row_colours);
+    free(stripe->stripes);
+    return -1;
+  }
+  return 0;
+}
+
+void stripeDecoder_destroy (stripeDecoder_t *stripe) {
+  free(stripe->row_colours);
+  free(stripe->stripes);
+}
+
+// Sum of `count` contiguous bytes; written so the compiler vectorises it
+static uint32_t sumBytes (const uint8_t *restrict bytes, int count) {
+  uint32_t sum = 0;
+  for (int i = 0 ; i < count ; i++) {
+    sum += bytes[i];
+  }
+  return sum;
+}
+
+// Sum R, G and B over `count` packed RGB24 pixels, 4 pixels (12 bytes) per step
+static void sumPixels_rgb24 (const uint8_t *restrict pixels, int count, uint32_t sum[3]) {
+  uint32_t lanes[12] = { 0 };
+  int i = 0;
+  for ( ; i + 4 <= count ; i += 4) {
+    for (int k = 0 ; k < 12 ; k++) {
+      lanes[k] += pixels[3 * i + k];
+    }
+  }
+  for ( ; i < count ; i++) {
+    lanes[0] += pixels[3 * i + 0];
+    lanes[1] += pixels[3 * i + 1];
+    lanes[2] += pixels[3 * i + 2];
+  }
+  sum[0] = lanes[0] + lanes[3] + lanes[6] + lanes[9];
+  sum[1] = lanes[1] + lanes[4] + lanes[7] + lanes[10];
+  sum[2] = lanes[2] + lanes[5] + lanes[8] + lanes[11];
+}
+
+/**
+  Classify the average colour of each row of a region. For Y4M the rows
+  are averaged in Y, Cb and Cr, which as a linear transform gives the same
+  mean as converting every pixel first.
+
+  Return Value:
+    Number of rows classified into `row_colours`
+*/
+int rollingShutter_rowColours (const colourClassifier_t *classifier, const videoFrame_t *frame, videoRegion_t region, rgb_colour_t *row_colours) {
+  if (region.width <= 0 || region.height <= 0) {
+    region.x = 0;
+    region.y = 0;
+    region.width = frame->width;
+    region.height = frame->height;
+  }
+  int x0 = (region.x < 0) ? 0 : region.x;
+  int y0 = (region.y < 0) ? 0 : region.y;
+  int x1 = (region.x + region.width > frame->width) ? frame->width : region.x + region.width;
+  int y1 = (region.y + region.height > frame->height) ? frame->height : region.y + region.height;
+  int count = x1 - x0;
+  if ( (count <= 0) || (y1 <= y0) ) {
+    return 0;
+  }
+
+  for (int y = y0 ; y < y1 ; y++) {
+    uint8_t mean[3];
+
+    if (frame->format == VIDEO_RAW_RGB24) {
+      uint32_t sum[3];
+      sumPixels_rgb24(&frame->data[((size_t)y * frame->width + x0) * 3], count, sum);
+      mean[0] = sum[0] / count;
+      mean[1] = sum[1] / count;
+      mean[2] = sum[2] / count;
+    } else {
+      // Average the planes, then convert the mean through a one pixel frame
+      size_t luma_size = (size_t)frame->width * frame->height;
+      int chroma_width = (frame->width + (1 << frame->chroma_shift_x) - 1) >> frame->chroma_shift_x;
+      int chroma_height = (frame->height + (1 << frame->chroma_shift_y) - 1) >> frame->chroma_shift_y;
+      int cx0 = x0 >> frame->chroma_shift_x;
+      int chroma_count = ((x1 - 1) >> frame->chroma_shift_x) - cx0 + 1;
+      size_t chroma_row = (size_t)(y >> frame->chroma_shift_y) * chroma_width + cx0;
+
+      uint8_t yuv[3] = {
+        sumBytes(&frame->data[(size_t)y * frame->width + x0], count) / count,
+        sumBytes(&frame->data[luma_size + chroma_row], chroma_count) / chroma_count,
+        sumBytes(&frame->data[luma_size + (size_t)chroma_width * chroma_height + chroma_row], chroma_count) / chroma_count
+      };
+      videoFrame_t pixel = { .width = 1, .height = 1, .format = VIDEO_Y4M, .full_range = frame->full_range, .data = yuv };
+      videoFrame_rgb(&pixel, 0, 0, mean);
+    }
+    row_colours[y - y0] = colourClassify_rgb(classifier, mean);
+  }
+  return y1 - y0;
+}
+
+/**
+  Split classified rows into stripes at every colour change.
+
+  Return Value:
+    Number of stripes written to `stripes`
+*/
+int rollingShutter_findStripes (const rgb_colour_t *row_colours, int rows, colourRun_t *stripes) {
+  int count = 0;
+  int start = 0;
+
+  for (int y = 1 ; y <= rows ; y++) {
+    if ( (y == rows) || (row_colours[y] != row_colours[start]) ) {
+      stripes[count].colour = row_colours[start];
+      stripes[count].length = y - start;
+      count++;
+      start = y;
+    }
+  }
+  return count;
+}
+
+/**
+  Decode the stripes of one frame. `sink` is called for every completed
+  byte with return codes as colourDecoder_push().
+
+  Return Value:
+    Number of stripes in the frame
+*/
+int stripeDecoder_frame (stripeDecoder_t *stripe, const videoFrame_t *frame, void (*sink) (void *user, uint8_t byte, int returncode), void *user) {
+  if (frame->height > stripe->rows) {
+    return 0;
+  }
+
+  int rows = rollingShutter_rowColours(&stripe->classifier, frame, stripe->region, stripe->row_colours);
+  int count = rollingShutter_findStripes(stripe->row_colours, rows, stripe->stripes);
+
+  for (int i = 0 ; i < count ; i++) {
+    const colourRun_t *next = &stripe->stripes[i];
+    colourRun_t filtered;
+
+    // Stitch: the open stripe carries on across the frame boundary
+    if (next->colour == stripe->open_stripe.colour) {
+      stripe->open_stripe.length += next->length;
+      continue;
+    }
+
+    if ( (stripe->open_stripe.length > 0) && blendFilter_push(&stripe->filter, stripe->open_stripe, next->colour, &filtered) ) {
+      uint8_t output_byte;
+      int returncode = colourDecoder_push(&stripe->decoder, filtered.colour, &output_byte);
+      if ( sink && (returncode != 0) && (returncode != -1) ) {
+        sink(user, output_byte, returncode);
+      }
+    }
+    stripe->stripe_count++;
+    stripe->open_stripe = *next;
+  }
+  return count;
+}
+
+
+/*
+  COLOUR SENSOR RECEIVER
+
+  A photodiode or colour sensor front end gives a continuous stream of R, G
+  and B ADC samples rather than classified frames. Samples are processed a
+  block at a time:
+
+    * A 4 tap moving average per channel removes sample noise.
+    * Hysteresis thresholds per channel turn levels into on/off, so noise
+      near a threshold cannot chatter.
+    * Colour changes are segmented into runs of samples and go through the
+      blend filter, which removes the short in-between colours caused by the
+      channels rising and falling at different speeds.
+
+  There is no symbol clock: a symbol is simply a run of a colour, however
+  long. With `auto_level` the thresholds follow a slowly decaying min/max
+  envelope of each channel, so sensor gain and ambient light need no
+  calibration.
+*/
+
+#define ADC_BLOCK 256
+
+typedef struct adcReceiver {
+  uint16_t on_level[3];      // R, G, B filtered level above which a channel turns on
+  uint16_t off_level[3];     // ... and below which it turns off
+  int auto_level;            // Derive levels from the signal envelope
+  uint16_t min_swing;        // Envelope range below which a channel is just noise
+  uint32_t glitch_len;       // Longest blend run in samples to remove
+  // State
+  uint16_t history[3][3];    // Last 3 raw samples per channel for the moving average
+  uint16_t envelope_min[3];
+  uint16_t envelope_max[3];
+  uint8_t flat[3];           // Envelope narrower than min_swing: channel held off
+  rgb_colour_t colour;       // Current thresholded colour
+  colourRun_t run;
+  blendFilter_t filter;
+  colourDecoder_t decoder;
+  uint64_t samples;
+  uint64_t transitions;
+} adcReceiver_t;
+
+void adcReceiver_init (adcReceiver_t *receiver, const colourMap_t *map, paritySel_t paritySelect, uint32_t glitch_len) {
+  memset(receiver, 0x00, sizeof(adcReceiver_t));
+  for (int channel = 0 ; channel < 3 ; channel++) {
+    receiver->on_level[channel] = 0x8000;
+    receiver->off_level[channel] = 0x6000;
+    receiver->envelope_min[channel] = 0xFFFF;
+  }
+  receiver->min_swing = 0x400;
+  receiver->glitch_len = glitch_len;
+  receiver->colour = DARK;
+  receiver->run.colour = DARK;
+  blendFilter_init(&receiver->filter, glitch_len);
+  receiver->filter.partial = 1; // Channels cross their thresholds one at a time
+  colourDecoder_init(&receiver->decoder, map, paritySelect);
+}
+
+// Move levels to 60% and 40% of the envelope; decay the envelope by 1/64 of its range per block
+static void adcReceiver_track (adcReceiver_t *receiver, int channel, const uint16_t *filtered, int count) {
+  uint16_t low = 0xFFFF;
+  uint16_t high = 0;
+  for (int i = 0 ; i < count ; i++) {
+    low = (filtered[i] < low) ? filtered[i] : low;
+    high = (filtered[i] > high) ? filtered[i] : high;
+  }
+
+  uint16_t *envelope_min = &receiver->envelope_min[channel];
+  uint16_t *envelope_max = &receiver->envelope_max[channel];
+  if (*envelope_min > *envelope_max) {
+    *envelope_min = low;
+    *envelope_max = high;
+  }
+  uint16_t decay = (*envelope_max - *envelope_min) >> 6;
+  *envelope_min = (low < *envelope_min + decay) ? low : *envelope_min + decay;
+  *envelope_max = (high > *envelope_max - decay) ? high : *envelope_max - decay;
+
+  uint32_t range = *envelope_max - *envelope_min;
+  receiver->flat[channel] = (range < receiver->min_swing);
+  if (receiver->flat[channel]) {
+    // Flat signal: keep it off, and above the signal so noise cannot turn it on
+    uint32_t on_level = (uint32_t)*envelope_max + receiver->min_swing;
+    uint32_t off_level = (uint32_t)*envelope_max + receiver->min_swing / 2;
+    receiver->on_level[channel] = (on_level > 0xFFFF) ? 0xFFFF : on_level;
+    receiver->off_level[channel] = (off_level > 0xFFFF) ? 0xFFFF : off_level;
+    return;
+  }
+  receiver->on_level[channel] = *envelope_min + (range * 3) / 5;
+  receiver->off_level[channel] = *envelope_min + (range * 2) / 5;
+}
+
+/**
+  Process `count` samples per channel (any count, any split between calls).
+  `sink` is called for every completed byte, with return codes as
+  colourDecoder_push().
+*/
+void adcReceiver_process (adcReceiver_t *receiver, const uint16_t *red, const uint16_t *green, const uint16_t *blue, int count,
+                          void (*sink) (void *user, uint8_t byte, int returncode), void *user) {
+  const uint16_t *input[3] = { red, green, blue };
+  static const rgb_colour_t channel_colour[3] = { RED, GREEN, BLUE };
+  uint16_t padded[3][ADC_BLOCK + 3];
+  uint16_t filtered[3][ADC_BLOCK];
+  uint8_t on[3][ADC_BLOCK];
+  uint8_t off[3][ADC_BLOCK];
+
+  for (int base = 0 ; base < count ; base += ADC_BLOCK) {
+    int block = (count - base < ADC_BLOCK) ? (count - base) : ADC_BLOCK;
+
+    // Data parallel part: filter and compare every sample of the block
+    for (int channel = 0 ; channel < 3 ; channel++) {
+      memcpy(padded[channel], receiver->history[channel], 3 * sizeof(uint16_t));
+      memcpy(padded[channel] + 3, input[channel] + base, block * sizeof(uint16_t));
+      memcpy(receiver->history[channel], padded[channel] + block, 3 * sizeof(uint16_t));
+
+      const uint16_t *x = padded[channel];
+      for (int i = 0 ; i < block ; i++) {
+        filtered[channel][i] = ((uint32_t)x[i] + x[i + 1] + x[i + 2] + x[i + 3]) >> 2;
+      }
+      if (receiver->auto_level) {
+        adcReceiver_track(receiver, channel, filtered[channel], block);
+      }
+      // A flat channel pinned at full scale would still reach a clamped on level
+      uint32_t on_level = receiver->flat[channel] ? 0x10000 : receiver->on_level[channel];
+      uint16_t off_level = receiver->off_level[channel];
+      for (int i = 0 ; i < block ; i++) {
+        on[channel][i] = filtered[channel][i] >= on_level;
+        off[channel][i] = filtered[channel][i] <= off_level;
+      }
+    }
+
+    // Sequential part: hysteresis state and run segmentation
+    for (int i = 0 ; i < block ; i++) {
+      rgb_colour_t colour = receiver->colour;
+      for (int channel = 0 ; channel < 3 ; channel++) {
+        if (on[channel][i]) {
+          colour |= channel_colour[channel];
+        } else if (off[channel][i]) {
+          colour &= ~channel_colour[channel];
+        }
+      }
+      receiver->colour = colour;
+
+      if (colour == receiver->run.colour) {
+        receiver->run.length++;
+        continue;
+      }
+
+      colourRun_t filtered_run;
+      receiver->transitions++;
+      if ( (receiver->run.length > 0) && blendFilter_push(&receiver->filter, receiver->run, colour, &filtered_run) ) {
+        uint8_t output_byte;
+        int returncode = colourDecoder_push(&receiver->decoder, filtered_run.colour, &output_byte);
+        if ( sink && (returncode != 0) && (returncode != -1) ) {
+          sink(user, output_byte, returncode);
+        }
+      }
+      receiver->run.colour = colour;
+      receiver->run.length = 1;
+    }
+    receiver->samples += block;
+  }
+}
+
+
+/*
+  EDGE EVENT RECEIVER
+
+  When the sensor itself reports changes, e.g. a colour sensor interrupt or
+  GPIO edge capture with a hardware timer, there is no need to sample at
+  all. Each (timestamp, new colour) event is one step of the decoder, so
+  the CPU cost follows the number of transitions rather than a sample rate.
+
+  The hold time of each colour (the gap to the next event) stands in for
+  the run length: the blend filter takes its limit in timer ticks, and the
+  hold times are kept for timing statistics and the timed mode below.
+  Timestamps may wrap around.
+*/
+
+typedef struct colourEvent {
+  uint32_t timestamp;        // Timer ticks
+  rgb_colour_t colour;       // Colour from this moment on
+} colourEvent_t;
+
+typedef struct edgeReceiver {
+  colourEvent_t current;     // Event that started the colour being held
+  blendFilter_t filter;
+  colourDecoder_t decoder;
+  uint32_t hold;             // Hold time of the last colour accepted by the filter
+  uint32_t hold_start;       // ... and when it started
+  // Timing statistics of accepted colours (excluding DARK)
+  uint32_t symbols;
+  uint32_t min_hold;
+  uint32_t max_hold;
+  uint64_t sum_hold;
+  // Last completed byte, from the start of its first colour to the start of its mark
+  uint32_t byte_start;
+  uint32_t byte_end;
+} edgeReceiver_t;
+
+void edgeReceiver_init (edgeReceiver_t *receiver, const colourMap_t *map, paritySel_t paritySelect, uint32_t max_blend_ticks) {
+  memset(receiver, 0x00, sizeof(edgeReceiver_t));
+  receiver->current.colour = DARK;
+  receiver->min_hold = UINT32_MAX;
+  blendFilter_init(&receiver->filter, max_blend_ticks);
+  colourDecoder_init(&receiver->decoder, map, paritySelect);
+}
+
+/**
+  Feed one edge event. Repeated colours are ignored.
+
+  Return Values:
+    As colourDecoder_push(), for the colour this event ended
+*/
+int edgeReceiver_push (edgeReceiver_t *receiver, const colourEvent_t *event, uint8_t *output) {
+  if (event->colour == receiver->current.colour) {
+    return 0;
+  }
+
+  colourRun_t run = { receiver->current.colour, event->timestamp - receiver->current.timestamp };
+  colourRun_t filtered;
+  receiver->current = *event;
+
+  if (!blendFilter_push(&receiver->filter, run, event->colour, &filtered)) {
+    return 0;
+  }
+
+  receiver->hold = filtered.length;
+  receiver->hold_start = event->timestamp - filtered.length;
+  if (filtered.colour != DARK) {
+    receiver->symbols++;
+    receiver->sum_hold += filtered.length;
+    receiver->min_hold = (filtered.length < receiver->min_hold) ? filtered.length : receiver->min_hold;
+    receiver->max_hold = (filtered.length > receiver->max_hold) ? filtered.length : receiver->max_hold;
+  }
+
+  int returncode = colourDecoder_push(&receiver->decoder, filtered.colour, output);
+  if (receiver->decoder.halfnibbles == 1) {
+    receiver->byte_start = receiver->hold_start;
+  }
+  if (returncode > 0) {
+    receiver->byte_end = receiver->hold_start;
+  }
+  return returncode;
+}
+
+/**
+  Feed a batch of events; `sink` gets every completed byte.
+*/
+void edgeReceiver_process (edgeReceiver_t *receiver, const colourEvent_t *events, int count,
+                           void (*sink) (void *user, uint8_t byte, int returncode), void *user) {
+  for (int i = 0 ; i < count ; i++) {
+    uint8_t output_byte;
+    int returncode = edgeReceiver_push(receiver, &events[i], &output_byte);
+    if ( sink && (returncode != 0) && (returncode != -1) ) {
+      sink(user, output_byte, returncode);
+    }
+  }
+}
+
+
+/*
+  TIMED SYMBOL MODE
+
+  The plain protocol ignores timing on purpose. When both ends have a
+  decent clock the hold time of each colour can carry one more bit: short
+  or long. A timed byte is sent as 3 data colours instead of 4:
+
+    colours  : bits 7-6, 5-4, 3-2 (as nextColourSeq_from_2bit)
+    holds    : bit 1, bit 0, bit 1 XOR bit 0 (short = 0, long = 1)
+    mark     : WHITE/YELLOW parity over the whole byte, held long
+
+  So a byte takes 4 transitions instead of 5: 2 bits per transition
+  against 1.6, a quarter more. Plain bytes keep their mark short. The
+  receiver needs both 3 data colours and a long mark for a timed byte, so
+  a plain byte that loses a colour is a framing error rather than a
+  wrong timed byte, and plain and timed bytes can be mixed freely.
+  Falling back to plain needs no handshake.
+
+  The receiver classifies holds against running estimates of the short
+  and long hold, so clock drift is followed. It also keeps a running
+  jitter figure. When the jitter passes `jitter_limit` it stops trusting
+  hold times: timed bytes are rejected, and `fallback` is raised so the
+  link can switch the transmitter to plain bytes.
+*/
+
+typedef struct timedSymbol {
+  rgb_colour_t colour;
+  uint32_t hold;             // Ticks to hold the colour for
+} timedSymbol_t;
+
+typedef struct timedEncoder {
+  colourEncoder_t encoder;
+  int timed;                 // 0 = send plain timing insensitive bytes
+  uint32_t short_hold;
+  uint32_t long_hold;
+} timedEncoder_t;
+
+void timedEncoder_init (timedEncoder_t *timed, const colourMap_t *map, paritySel_t paritySelect, uint32_t short_hold, uint32_t long_hold) {
+  colourEncoder_init(&timed->encoder, map, paritySelect);
+  timed->timed = 1;
+  timed->short_hold = short_hold;
+  timed->long_hold = long_hold;
+}
+
+/**
+  Return Value:
+    Number of symbols written (4 when timed, 5 when plain)
+*/
+int timedEncoder_put_uint8 (timedEncoder_t *timed, const uint8_t data, timedSymbol_t symbols[5]) {
+  colourEncoder_t *encoder = &timed->encoder;
+
+  if (!timed->timed) {
+    rgb_colour_t colours[5];
+    int count = colourEncoder_put_uint8(encoder, data, colours);
+    for (int i = 0 ; i < count ; i++) {
+      symbols[i].colour = colours[i];
+      symbols[i].hold = timed->short_hold;
+    }
+    return count;
+  }
+
+  uint8_t bit1 = (data >> 1) & 0x01;
+  uint8_t bit0 = data & 0x01;
+  uint8_t hold_bits[3] = { bit1, bit0, bit1 ^ bit0 };
+
+  for (int i = 0 ; i < 3 ; i++) {
+    uint8_t half_nibble = (data >> 2 * (3 - i)) & 0x3;
+    symbols[i].colour = nextColourSeq_from_2bit_map(encoder->map, half_nibble, encoder->previous_colour);
+    symbols[i].hold = hold_bits[i] ? timed->long_hold : timed->short_hold;
+    encoder->previous_colour = symbols[i].colour;
+  }
+
+  if ( (encoder->parity == NO_PARITY) || (calcParity_u8bit(data, encoder->parity) == 0) ) {
+    symbols[3].colour = WHITE;
+  } else {
+    symbols[3].colour = YELLOW;
+  }
+  symbols[3].hold = timed->long_hold; // Marks this as a timed byte
+  encoder->previous_colour = symbols[3].colour;
+  return 4;
+}
+
+typedef struct timedReceiver {
+  const colourMap_t *map;
+  paritySel_t parity;
+  colourEvent_t current;     // Event that started the colour being held
+  blendFilter_t filter;
+  rgb_colour_t previous_colour;
+  uint8_t halfnibbles;
+  uint8_t colour_bits;
+  uint8_t hold_bits;
+  // Hold classifier, estimates in 1/16 ticks
+  uint32_t short_q4;
+  uint32_t long_q4;
+  uint32_t jitter_q8;        // Running mean of |hold - estimate| / (long - short), 8bit fixed point
+  uint32_t jitter_limit_q8;
+  int fallback;              // Jitter too high, timed bytes are not trusted
+  // Statistics
+  uint32_t plain_bytes;
+  uint32_t timed_bytes;
+  uint32_t timing_errors;    // Timed bytes failing the hold check or rejected in fallback
+  uint32_t parity_errors;
+  uint32_t framing_errors;
+} timedReceiver_t;
+
+/**
+  `short_hold` and `long_hold` are the nominal hold times in ticks; the
+  estimates follow the real ones from there. `jitter_limit` is a fraction
+  of the gap between them (0.2 is a good start).
+*/
+void timedReceiver_init (timedReceiver_t *receiver, const colourMap_t *map, paritySel_t paritySelect,
+                         uint32_t short_hold, uint32_t long_hold, double jitter_limit, uint32_t max_blend_ticks) {
+  memset(receiver, 0x00, sizeof(timedReceiver_t));
+  receiver->map = map ? map : colourMap_active;
+  receiver->parity = paritySelect;
+  receiver->current.colour = DARK;
+  receiver->previous_colour = DARK;
+  blendFilter_init(&receiver->filter, max_blend_ticks);
+  receiver->short_q4 = short_hold << 4;
+  receiver->long_q4 = long_hold << 4;
+  receiver->jitter_limit_q8 = (uint32_t)(jitter_limit * 256);
+}
+
+// Classify a hold as short (0) or long (1) and follow drift and jitter
+static uint8_t timedReceiver_hold (timedReceiver_t *receiver, uint32_t hold) {
+  uint32_t hold_q4 = hold << 4;
+  uint8_t is_long = (hold_q4 > (receiver->short_q4 + receiver->long_q4) / 2);
+  uint32_t *estimate = is_long ? &receiver->long_q4 : &receiver->short_q4;
+
+  uint32_t deviation = (hold_q4 > *estimate) ? (hold_q4 - *estimate) : (*estimate - hold_q4);
+  uint32_t gap = (receiver->long_q4 > receiver->short_q4) ? (receiver->long_q4 - receiver->short_q4) : 1;
+  uint32_t jitter = (uint32_t)(((uint64_t)deviation << 8) / gap);
+  receiver->jitter_q8 += ((int32_t)jitter - (int32_t)receiver->jitter_q8) / 8;
+  receiver->fallback = (receiver->jitter_q8 > receiver->jitter_limit_q8);
+
+  *estimate += ((int32_t)hold_q4 - (int32_t)*estimate) / 8;
+  return is_long;
+}
+
+// One colour accepted by the blend filter, held for `hold` ticks
+static int timedReceiver_symbol (timedReceiver_t *receiver, rgb_colour_t colour, uint32_t hold, uint8_t *output) {
+  uint8_t halfnibble_out;
+  int return_code = nextColourSeq_to_2bit_map(receiver->map, colour, receiver->previous_colour, &halfnibble_out);
+  receiver->previous_colour = colour;
+
+  switch (return_code) {
+  case (0):
+    if (receiver->halfnibbles < 4) {
+      receiver->colour_bits = (receiver->colour_bits << 2) | halfnibble_out;
+      receiver->hold_bits = (receiver->hold_bits << 1) | timedReceiver_hold(receiver, hold);
+    }
+    receiver->halfnibbles += (receiver->halfnibbles <= 4);
+    return 0;
+  case (-1):
+    return 0;
+  case (-3):
+    receiver->halfnibbles = 5;
+    return 0;
+  case (-2):
+    receiver->halfnibbles = 0;
+    return -1;
+  }
+
+  // Mark: long after a timed byte, short after a plain one. Its hold is not trusted in fallback.
+  uint8_t long_mark = timedReceiver_hold(receiver, hold) && !receiver->fallback;
+  uint8_t halfnibbles = receiver->halfnibbles;
+  receiver->halfnibbles = 0;
+
+  if ( ((halfnibbles == 4) && long_mark) || ((halfnibbles == 3) && !long_mark && !receiver->fallback) ) {
+    receiver->framing_errors++; // Colour count and mark hold disagree: a colour was lost or gained
+    return -2;
+  }
+  if (halfnibbles == 4) {
+    *output = receiver->colour_bits;
+  } else if (halfnibbles == 3) {
+    uint8_t h0 = (receiver->hold_bits >> 2) & 0x01;
+    uint8_t h1 = (receiver->hold_bits >> 1) & 0x01;
+    uint8_t check = receiver->hold_bits & 0x01;
+    *output = (receiver->colour_bits << 2) | (h0 << 1) | h1;
+    if ( receiver->fallback || (check != (h0 ^ h1)) ) {
+      receiver->timing_errors++;
+      return -3;
+    }
+  } else {
+    receiver->framing_errors++;
+    return -2;
+  }
+
+  uint8_t parity_bit = (return_code == 2) ? 0x01 : 0x00;
+  if ( (receiver->parity != NO_PARITY) && !validParity_u8bit(*output, parity_bit, receiver->parity) ) {
+    receiver->parity_errors++;
+    return -3;
+  }
+  if (halfnibbles == 4) {
+    receiver->plain_bytes++;
+  } else {
+    receiver->timed_bytes++;
+  }
+  return return_code;
+}
+
+/**
+  Feed one edge event.
+
+  Return Values:
+    As colourDecoder_push(); -2 also covers bytes whose colour count and
+    mark hold disagree, -3 timed bytes that failed the hold check or
+    arrived while in fallback
+*/
+int timedReceiver_push (timedReceiver_t *receiver, const colourEvent_t *event, uint8_t *output) {
+  if (event->colour == receiver->current.colour) {
+    return 0;
+  }
+
+  colourRun_t run = { receiver->current.colour, event->timestamp - receiver->current.timestamp };
+  colourRun_t filtered;
+  receiver->current = *event;
+
+  if (!blendFilter_push(&receiver->filter, run, event->colour, &filtered)) {
+    return 0;
+  }
+  return timedReceiver_symbol(receiver, filtered.colour, filtered.length, output);
+}
+
+
+/*
+  MULTI LEVEL PALETTE
+
+  Opt in mode for good sensors: each channel is driven at one of `levels`
+  PWM brightness levels instead of just on or off, so the alphabet grows
+  from 8 to levels^3 colours (27 for 3 levels, 64 for 4).
+
+  Reserved colours keep the plain protocol's meaning: all off is DARK
+  (channel closed), full white is the parity 0 mark and full yellow the
+  parity 1 mark. The rest are data colours. Like the plain code, the next
+  colour is never the previous one, which leaves (data colours - 1) choices
+  per transition, and the code uses the largest power of two of those:
+
+    levels 2:  5 data colours, 2 bits per transition, 4 + 1 symbols per byte
+    levels 3: 24 data colours, 4 bits per transition, 2 + 1 symbols per byte
+    levels 4: 61 data colours, 5 bits per transition, 2 + 1 symbols per byte
+
+  A byte is sent MSB first in `transitions` groups of `bits`, zero padded
+  at the bottom. The receiver needs a paletteClassifier_t trained on the
+  real sensor, since the nominal duty cycles rarely come out linear.
+*/
+
+#define PALETTE_MAX_LEVELS 4
+#define PALETTE_MAX_COLOURS (PALETTE_MAX_LEVELS * PALETTE_MAX_LEVELS * PALETTE_MAX_LEVELS)
+
+typedef uint8_t paletteColour_t; // r * levels^2 + g * levels + b
+
+typedef struct palette {
+  uint8_t levels;
+  uint8_t colours;           // levels^3
+  uint8_t data_colours;
+  uint8_t bits;              // Data bits per transition
+  uint8_t transitions;       // Data transitions per byte, not counting the mark
+  paletteColour_t dark;
+  paletteColour_t white;
+  paletteColour_t yellow;
+  paletteColour_t order[PALETTE_MAX_COLOURS];  // Data colours in code order
+  int8_t position[PALETTE_MAX_COLOURS];        // Index into order, -1 if reserved
+  uint8_t duty[PALETTE_MAX_LEVELS];            // PWM duty cycle for each level
+} palette_t;
+
+/**
+  Return Values:
+    0 on success, -1 if `levels` is out of range
+*/
+int palette_init (palette_t *palette, int levels) {
+  if ( (levels < 2) || (levels > PALETTE_MAX_LEVELS) ) {
+    return -1;
+  }
+  memset(palette, 0x00, sizeof(palette_t));
+  palette->levels = levels;
+  palette->colours = levels * levels * levels;
+  palette->dark = 0;
+  palette->white = palette->colours - 1;
+  palette->yellow = palette->colours - levels;
+
+  for (int i = 0 ; i < levels ; i++) {
+    palette->duty[i] = (uint8_t)(i * 255 / (levels - 1));
+  }
+
+  for (int c = 0 ; c < palette->colours ; c++) {
+    if ( (c == palette->dark) || (c == palette->white) || (c == palette->yellow) ) {
+      palette->position[c] = -1;
+      continue;
+    }
+    palette->position[c] = palette->data_colours;
+    palette->order[palette->data_colours++] = c;
+  }
+
+  while ((2u << palette->bits) <= (unsigned)(palette->data_colours - 1)) {
+    palette->bits++;
+  }
+  palette->transitions = (8 + palette->bits - 1) / palette->bits;
+  return 0;
+}
+
+void palette_levels (const palette_t *palette, paletteColour_t colour, uint8_t level[3]) {
+  level[0] = colour / (palette->levels * palette->levels);
+  level[1] = (colour / palette->levels) % palette->levels;
+  level[2] = colour % palette->levels;
+}
+
+// PWM duty cycles (0-255) to drive the red, green and blue LEDs at
+void palette_duty (const palette_t *palette, paletteColour_t colour, uint8_t duty[3]) {
+  uint8_t level[3];
+  palette_levels(palette, colour, level);
+  for (int channel = 0 ; channel < 3 ; channel++) {
+    duty[channel] = palette->duty[level[channel]];
+  }
+}
+
+paletteColour_t palette_next (const palette_t *palette, uint32_t value, paletteColour_t previous) {
+  int from = palette->position[previous]; // -1 after a mark or dark
+  return palette->order[(from + 1 + value) % palette->data_colours];
+}
+
+/**
+  Return Values:
+    As nextColourSeq_to_2bit_map(): 0 data in `value`, 1/2 mark with parity
+    bit 0/1, -1 idle, -2 dark, -3 transition not produced by the code
+*/
+int palette_decode (const palette_t *palette, paletteColour_t colour, paletteColour_t previous, uint32_t *value) {
+  if (colour == previous) {
+    return -1;
+  }
+  if (colour == palette->dark) {
+    return -2;
+  }
+  if (colour == palette->white) {
+    return 1;
+  }
+  if (colour == palette->yellow) {
+    return 2;
+  }
+
+  int from = palette->position[previous];
+  int step = (palette->position[colour] - from - 1 + 2 * palette->data_colours) % palette->data_colours;
+  if (step >= (1 << palette->bits)) {
+    return -3;
+  }
+  *value = step;
+  return 0;
+}
+
+typedef struct paletteEncoder {
+  const palette_t *palette;
+  paritySel_t parity;
+  paletteColour_t previous_colour;
+} paletteEncoder_t;
+
+void paletteEncoder_init (paletteEncoder_t *encoder, const palette_t *palette, paritySel_t paritySelect) {
+  encoder->palette = palette;
+  encoder->parity = paritySelect;
+  encoder->previous_colour = palette->dark;
+}
+
+/**
+  Return Value:
+    Number of colours written (palette->transitions + 1, at most 5)
+*/
+int paletteEncoder_put_uint8 (paletteEncoder_t *encoder, const uint8_t data, paletteColour_t colours[5]) {
+  const palette_t *palette = encoder->palette;
+  int total_bits = palette->transitions * palette->bits;
+  uint32_t value = (uint32_t)data << (total_bits - 8);
+  uint32_t mask = (1u << palette->bits) - 1;
+  int count = 0;
+
+  for (int i = palette->transitions - 1 ; i >= 0 ; i--) {
+    colours[count] = palette_next(palette, (value >> (i * palette->bits)) & mask, encoder->previous_colour);
+    encoder->previous_colour = colours[count++];
+  }
+
+  if ( (encoder->parity == NO_PARITY) || (calcParity_u8bit(data, encoder->parity) == 0) ) {
+    colours[count] = palette->white;
+  } else {
+    colours[count] = palette->yellow;
+  }
+  encoder->previous_colour = colours[count++];
+  return count;
+}
+
+typedef struct paletteDecoder {
+  const palette_t *palette;
+  paritySel_t parity;
+  paletteColour_t previous_colour;
+  uint32_t value;
+  uint8_t groups;
+  uint32_t byte_count;
+  uint32_t parity_errors;
+  uint32_t framing_errors;
+} paletteDecoder_t;
+
+void paletteDecoder_init (paletteDecoder_t *decoder, const palette_t *palette, paritySel_t paritySelect) {
+  memset(decoder, 0x00, sizeof(paletteDecoder_t));
+  decoder->palette = palette;
+  decoder->parity = paritySelect;
+  decoder->previous_colour = palette->dark;
+}
+
+/**
+  Feed one classified sample; repeats of the held colour are ignored.
+
+  Return Values:
+    As colourDecoder_push()
+*/
+int paletteDecoder_push (paletteDecoder_t *decoder, paletteColour_t colour, uint8_t *output) {
+  const palette_t *palette = decoder->palette;
+  uint32_t value = 0;
+  int return_code = palette_decode(palette, colour, decoder->previous_colour, &value);
+  decoder->previous_colour = colour;
+
+  switch (return_code) {
+  case (0):
+    if (decoder->groups < palette->transitions) {
+      decoder->value = (decoder->value << palette->bits) | value;
+    }
+    decoder->groups += (decoder->groups <= palette->transitions);
+    return 0;
+  case (-1):
+    return 0;
+  case (-3):
+    decoder->groups = palette->transitions + 1;
+    return 0;
+  case (-2):
+    decoder->groups = 0;
+    decoder->value = 0;
+    return -1;
+  }
+
+  uint8_t groups = decoder->groups;
+  int pad_bits = palette->transitions * palette->bits - 8;
+  uint32_t value_bits = decoder->value;
+  decoder->groups = 0;
+  decoder->value = 0;
+
+  if ( (groups != palette->transitions) || (value_bits & ((1u << pad_bits) - 1)) ) {
+    decoder->framing_errors++;
+    return -2;
+  }
+
+  *output = (uint8_t)(value_bits >> pad_bits);
+  uint8_t parity_bit = (return_code == 2) ? 0x01 : 0x00;
+  if ( (decoder->parity != NO_PARITY) && !validParity_u8bit(*output, parity_bit, decoder->parity) ) {
+    decoder->parity_errors++;
+    return -3;
+  }
+  decoder->byte_count++;
+  return return_code;
+}
+
+/*
+  Nearest centroid classifier for palette colours. Starts from the nominal
+  duty cycles; every trained sample moves that colour's centroid to the
+  running mean of what the sensor actually reported for it.
+*/
+typedef struct paletteClassifier {
+  const palette_t *palette;
+  double centroid[PALETTE_MAX_COLOURS][3];
+  uint32_t samples[PALETTE_MAX_COLOURS];
+} paletteClassifier_t;
+
+void paletteClassifier_init (paletteClassifier_t *classifier, const palette_t *palette) {
+  memset(classifier, 0x00, sizeof(paletteClassifier_t));
+  classifier->palette = palette;
+  for (int c = 0 ; c < palette->colours ; c++) {
+    uint8_t duty[3];
+    palette_duty(palette, c, duty);
+    for (int channel = 0 ; channel < 3 ; channel++) {
+      classifier->centroid[c][channel] = duty[channel];
+    }
+  }
+}
+
+void paletteClassifier_train (paletteClassifier_t *classifier, paletteColour_t colour, const double rgb[3]) {
+  uint32_t n = ++classifier->samples[colour];
+  for (int channel = 0 ; channel < 3 ; channel++) {
+    double *centroid = &classifier->centroid[colour][channel];
+    *centroid = (n == 1) ? rgb[channel] : *centroid + (rgb[channel] - *centroid) / n;
+  }
+}
+
+// Train from a calibration burst that cycles through every colour in index order
+void paletteClassifier_calibrate (paletteClassifier_t *classifier, const double (*rgb)[3], int count) {
+  for (int i = 0 ; i < count ; i++) {
+    paletteClassifier_train(classifier, i % classifier->palette->colours, rgb[i]);
+  }
+}
+
+paletteColour_t paletteClassifier_classify (const paletteClassifier_t *classifier, const double rgb[3], double *distance) {
+  paletteColour_t best = 0;
+  double best_distance = -1;
+
+  for (int c = 0 ; c < classifier->palette->colours ; c++) {
+    double d = 0;
+    for (int channel = 0 ; channel < 3 ; channel++) {
+      double delta = rgb[channel] - classifier->centroid[c][channel];
+      d += delta * delta;
+    }
+    if ( (best_distance < 0) || (d < best_distance) ) {
+      best_distance = d;
+      best = c;
+    }
+  }
+  if (distance) {
+    *distance = sqrt(best_distance);
+  }
+  return best;
+}
+
+
+/*
+  MULTI LANE
+
+  Boards with several RGB LEDs (or an LED bar) run one lane per LED in
+  lockstep. Everything is bit-sliced: bit n of each port word belongs to
+  lane n, so one time step for every lane is three words that can be
+  written straight to the red, green and blue GPIO ports.
+
+  The encoder evaluates the colour map as boolean logic over the sliced
+  words: for each (previous colour, half nibble) pair it builds the mask
+  of lanes in that state and ORs in the next colour. Cost per step is fixed
+  by the map (at most 32 pairs), not by the lane count, so throughput
+  grows linearly with lanes up to the port width.
+
+  Lanes with nothing to send just hold their colour. That is an idle
+  repeat to the receiver, so lanes may carry independent streams of any
+  length, or one stream striped byte by byte across them.
+*/
+
+#define LANES_MAX 32
+
+typedef struct laneWord {
+  uint32_t red;              // Bit n is lane n
+  uint32_t green;
+  uint32_t blue;
+} laneWord_t;
+
+static inline uint32_t laneWord_match (const laneWord_t *word, rgb_colour_t colour) {
+  return ((colour & RED) ? word->red : ~word->red) &
+         ((colour & GREEN) ? word->green : ~word->green) &
+         ((colour & BLUE) ? word->blue : ~word->blue);
+}
+
+static inline void laneWord_set (laneWord_t *word, uint32_t mask, rgb_colour_t colour) {
+  word->red |= (colour & RED) ? mask : 0;
+  word->green |= (colour & GREEN) ? mask : 0;
+  word->blue |= (colour & BLUE) ? mask : 0;
+}
+
+rgb_colour_t laneWord_colour (const laneWord_t *word, int lane) {
+  return (((word->red >> lane) & 1) << 2) | (((word->green >> lane) & 1) << 1) | ((word->blue >> lane) & 1);
+}
+
+static inline uint32_t laneMask (int lanes) {
+  return (lanes >= 32) ? 0xFFFFFFFFu : ((1u << lanes) - 1);
+}
+
+typedef struct multiLaneEncoder {
+  const colourMap_t *map;
+  paritySel_t parity;
+  int lanes;
+  laneWord_t previous;       // Colour each lane is currently showing
+} multiLaneEncoder_t;
+
+void multiLaneEncoder_init (multiLaneEncoder_t *encoder, int lanes, const colourMap_t *map, paritySel_t paritySelect) {
+  memset(encoder, 0x00, sizeof(multiLaneEncoder_t)); // All lanes DARK
+  encoder->map = map ? map : colourMap_active;
+  encoder->parity = paritySelect;
+  encoder->lanes = (lanes > LANES_MAX) ? LANES_MAX : lanes;
+}
+
+/**
+  Encode one byte per lane, data[n] for lane n. Only lanes set in `active`
+  send; the others hold their colour.
+
+  Return Value:
+    Number of port words written (always 5)
+*/
+int multiLaneEncoder_put (multiLaneEncoder_t *encoder, const uint8_t *data, uint32_t active, laneWord_t words[5]) {
+  const colourMap_t *map = encoder->map;
+  uint32_t planes[8] = {0};
+
+  active &= laneMask(encoder->lanes);
+  for (int lane = 0 ; lane < encoder->lanes ; lane++) {
+    if (!((active >> lane) & 1)) {
+      continue;
+    }
+    for (int bit = 0 ; bit < 8 ; bit++) {
+      planes[bit] |= (uint32_t)((data[lane] >> bit) & 1) << lane;
+    }
+  }
+
+  for (int i = 0 ; i < 4 ; i++) {
+    uint32_t high = planes[7 - 2 * i];
+    uint32_t low = planes[6 - 2 * i];
+    laneWord_t next = {0, 0, 0};
+
+    for (int previous = 0 ; previous < 8 ; previous++) {
+      uint32_t in_state = laneWord_match(&encoder->previous, previous) & active;
+      if (!in_state) {
+        continue;
+      }
+      for (int halfnibble = 0 ; halfnibble < 4 ; halfnibble++) {
+        uint32_t mask = in_state & ((halfnibble & 2) ? high : ~high) & ((halfnibble & 1) ? low : ~low);
+        laneWord_set(&next, mask, map->encode[previous][halfnibble]);
+      }
+    }
+    next.red |= encoder->previous.red & ~active;
+    next.green |= encoder->previous.green & ~active;
+    next.blue |= encoder->previous.blue & ~active;
+    words[i] = encoder->previous = next;
+  }
+
+  // Mark: WHITE for parity 0, YELLOW (blue off) for parity 1
+  uint32_t odd = 0;
+  for (int bit = 0 ; bit < 8 ; bit++) {
+    odd ^= planes[bit];
+  }
+  uint32_t yellow = 0;
+  if (encoder->parity == EVEN_PARITY) {
+    yellow = odd;
+  } else if (encoder->parity == ODD_PARITY) {
+    yellow = ~odd;
+  }
+  laneWord_t *mark = &words[4];
+  mark->red = encoder->previous.red | active;
+  mark->green = encoder->previous.green | active;
+  mark->blue = (encoder->previous.blue & ~active) | (~yellow & active);
+  encoder->previous = *mark;
+  return 5;
+}
+
+/**
+  Stripe `length` bytes across the lanes, byte i on lane i % lanes.
+
+  Return Value:
+    Number of port words written, or -1 if `max_words` is too small
+*/
+long multiLaneEncoder_stripe (multiLaneEncoder_t *encoder, const uint8_t *data, long length, laneWord_t *words, long max_words) {
+  long blocks = (length + encoder->lanes - 1) / encoder->lanes;
+  if (blocks * 5 > max_words) {
+    return -1;
+  }
+  for (long block = 0 ; block < blocks ; block++) {
+    long offset = block * encoder->lanes;
+    long remaining = length - offset;
+    uint32_t active = (remaining >= encoder->lanes) ? laneMask(encoder->lanes) : laneMask(remaining);
+    multiLaneEncoder_put(encoder, data + offset, active, words + block * 5);
+  }
+  return blocks * 5;
+}
+
+// Close every lane
+laneWord_t multiLaneEncoder_close (multiLaneEncoder_t *encoder) {
+  memset(&encoder->previous, 0x00, sizeof(laneWord_t));
+  return encoder->previous;
+}
+
+typedef struct multiLaneDecoder {
+  int lanes;
+  laneWord_t previous;
+  colourDecoder_t decoders[LANES_MAX];
+  long step;
+  uint32_t bytes;
+  uint32_t errors;
+} multiLaneDecoder_t;
+
+void multiLaneDecoder_init (multiLaneDecoder_t *decoder, int lanes, const colourMap_t *map, paritySel_t paritySelect) {
+  memset(decoder, 0x00, sizeof(multiLaneDecoder_t));
+  decoder->lanes = (lanes > LANES_MAX) ? LANES_MAX : lanes;
+  for (int lane = 0 ; lane < decoder->lanes ; lane++) {
+    colourDecoder_init(&decoder->decoders[lane], map, paritySelect);
+  }
+}
+
+/**
+  Decode one time step of port words. Only lanes whose colour changed are
+  visited. Bytes are reported in lane order, so a striped stream comes out
+  of `sink` in its original order.
+
+  Return Value:
+    Number of bytes and errors reported
+*/
+int multiLaneDecoder_push (multiLaneDecoder_t *decoder, const laneWord_t *word, ledByteSink_t sink, void *user) {
+  uint32_t changed = ( (word->red ^ decoder->previous.red) |
+                       (word->green ^ decoder->previous.green) |
+                       (word->blue ^ decoder->previous.blue) ) & laneMask(decoder->lanes);
+  int reported = 0;
+
+  decoder->previous = *word;
+  while (changed) {
+    int lane = __builtin_ctz(changed);
+    changed &= changed - 1;
+
+    uint8_t output_byte;
+    int returncode = colourDecoder_push(&decoder->decoders[lane], laneWord_colour(word, lane), &output_byte);
+    if ( (returncode == 0) || (returncode == -1) ) {
+      continue;
+    }
+    if (returncode > 0) {
+      decoder->bytes++;
+    } else {
+      decoder->errors++;
+    }
+    if (sink) {
+      sink(user, lane, output_byte, returncode, decoder->step);
+    }
+    reported++;
+  }
+  decoder->step++;
+  return reported;
+}
+
+
+/*
+  LANE STRIPING
+
+  One stream spread over several LEDs whose lanes are not in lockstep:
+  each lane has its own clock skew and may lose frames on its own. The
+  stream is cut into chunks, and each chunk goes out on one lane as
+  ordinary bytes and is followed by DARK:
+
+    [seq] [data ... up to STRIPE_CHUNK_MAX] [crc8 over seq and data] DARK
+
+  The transmitter hands the next chunk to whichever lane is free (pull
+  model), so fast lanes carry more chunks and a slow lane never holds the
+  others back. Each lane sends its chunks in sequence order. So once every
+  live lane has delivered a chunk past a gap, the missing chunk can no
+  longer arrive; the receiver declares it lost right then rather than
+  waiting for a timeout. A lane that has been silent for `idle_timeout`
+  steps stops blocking.
+
+  The receiver keeps a running error rate per lane. Lanes above
+  `error_limit` are dropped from `active`; the transmitter should follow
+  that mask.
+*/
+
+#define STRIPE_CHUNK_MAX 16
+#define STRIPE_REORDER 64          // Reorder window in chunks (must fit in the 8bit sequence)
+
+typedef struct laneStripeTx {
+  int lanes;
+  uint32_t active;               // Lanes that may be given chunks
+  int chunk_len;
+  const uint8_t *data;
+  long length;
+  long offset;
+  uint8_t seq;
+  colourEncoder_t encoders[LANES_MAX];
+} laneStripeTx_t;
+
+void laneStripeTx_init (laneStripeTx_t *tx, int lanes, int chunk_len, const colourMap_t *map, paritySel_t paritySelect,
+                        const uint8_t *data, long length) {
+  memset(tx, 0x00, sizeof(laneStripeTx_t));
+  tx->lanes = (lanes > LANES_MAX) ? LANES_MAX : lanes;
+  tx->active = laneMask(tx->lanes);
+  tx->chunk_len = (chunk_len < 1) ? 1 : (chunk_len > STRIPE_CHUNK_MAX) ? STRIPE_CHUNK_MAX : chunk_len;
+  tx->data = data;
+  tx->length = length;
+  for (int lane = 0 ; lane < tx->lanes ; lane++) {
+    colourEncoder_init(&tx->encoders[lane], map, paritySelect);
+  }
+}
+
+/**
+  Encode the next chunk of the stream for `lane`, which has finished its
+  previous one.
+
+  Return Value:
+    Number of colours written to `colours` (at most (STRIPE_CHUNK_MAX + 2) * 5 + 1),
+    0 if the stream is done or the lane is not active
+*/
+int laneStripeTx_next (laneStripeTx_t *tx, int lane, rgb_colour_t *colours) {
+  if ( (tx->offset >= tx->length) || !((tx->active >> lane) & 1) ) {
+    return 0;
+  }
+
+  uint8_t chunk[STRIPE_CHUNK_MAX + 2];
+  int length = (tx->length - tx->offset < tx->chunk_len) ? (int)(tx->length - tx->offset) : tx->chunk_len;
+  chunk[0] = tx->seq++;
+  memcpy(chunk + 1, tx->data + tx->offset, length);
+  chunk[length + 1] = crc8_update(0, chunk, length + 1);
+  tx->offset += length;
+
+  int count = 0;
+  for (int i = 0 ; i < length + 2 ; i++) {
+    count += colourEncoder_put_uint8(&tx->encoders[lane], chunk[i], colours + count);
+  }
+  colours[count++] = colourEncoder_close(&tx->encoders[lane]);
+  return count;
+}
+
+typedef struct laneStats {
+  uint32_t chunks;
+  uint32_t errors;
+  uint32_t error_q8;             // Running error rate, 8bit fixed point
+} laneStats_t;
+
+// Chunks in order; `data` is NULL (length 0) for a chunk declared lost
+typedef void (*stripeChunkSink_t) (void *user, const uint8_t *data, int length);
+
+typedef struct laneStripeRx {
+  int lanes;
+  uint32_t active;
+  colourDecoder_t decoders[LANES_MAX];
+  uint8_t buffer[LANES_MAX][STRIPE_CHUNK_MAX + 2];
+  uint8_t fill[LANES_MAX];
+  uint8_t bad[LANES_MAX];
+  uint8_t has_seq[LANES_MAX];
+  uint8_t last_seq[LANES_MAX];   // Highest sequence seen on each lane
+  long last_step[LANES_MAX];
+  laneStats_t stats[LANES_MAX];
+  // Reorder buffer, indexed by sequence
+  uint8_t next_seq;
+  uint8_t valid[STRIPE_REORDER];
+  uint8_t length[STRIPE_REORDER];
+  uint8_t chunks[STRIPE_REORDER][STRIPE_CHUNK_MAX];
+  // Settings
+  uint32_t error_limit_q8;
+  uint32_t min_chunks;
+  long idle_timeout;
+  stripeChunkSink_t sink;
+  void *user;
+  // Totals
+  uint32_t delivered;
+  uint32_t lost;
+} laneStripeRx_t;
+
+void laneStripeRx_init (laneStripeRx_t *rx, int lanes, const colourMap_t *map, paritySel_t paritySelect,
+                        stripeChunkSink_t sink, void *user) {
+  memset(rx, 0x00, sizeof(laneStripeRx_t));
+  rx->lanes = (lanes > LANES_MAX) ? LANES_MAX : lanes;
+  rx->active = laneMask(rx->lanes);
+  for (int lane = 0 ; lane < rx->lanes ; lane++) {
+    colourDecoder_init(&rx->decoders[lane], map, paritySelect);
+  }
+  rx->error_limit_q8 = 64;       // 25% of chunks bad
+  rx->min_chunks = 4;
+  rx->idle_timeout = 2000;
+  rx->sink = sink;
+  rx->user = user;
+}
+
+// Deliver whatever is in order; with `flush` skip over every gap
+static void laneStripeRx_deliver (laneStripeRx_t *rx, long step, int flush) {
+  for (;;) {
+    int slot = rx->next_seq % STRIPE_REORDER;
+    if (rx->valid[slot]) {
+      rx->valid[slot] = 0;
+      rx->delivered++;
+      if (rx->sink) {
+        rx->sink(rx->user, rx->chunks[slot], rx->length[slot]);
+      }
+      rx->next_seq++;
+      continue;
+    }
+
+    // Gap: lost once no live lane could still send it
+    int pending = 0;
+    int ahead = 0;
+    for (int slot_ahead = 1 ; slot_ahead < STRIPE_REORDER ; slot_ahead++) {
+      ahead |= rx->valid[(rx->next_seq + slot_ahead) % STRIPE_REORDER];
+    }
+    for (int lane = 0 ; lane < rx->lanes ; lane++) {
+      if ( !((rx->active >> lane) & 1) || (step - rx->last_step[lane] > rx->idle_timeout) ) {
+        continue;
+      }
+      if ( !rx->has_seq[lane] || ((int8_t)(rx->last_seq[lane] - rx->next_seq) < 0) ) {
+        pending = 1;
+      }
+    }
+    if ( !ahead || (pending && !flush) ) {
+      return;
+    }
+    rx->lost++;
+    if (rx->sink) {
+      rx->sink(rx->user, NULL, 0);
+    }
+    rx->next_seq++;
+  }
+}
+
+static void laneStripeRx_chunk (laneStripeRx_t *rx, int lane, long step) {
+  laneStats_t *stats = &rx->stats[lane];
+  uint8_t *chunk = rx->buffer[lane];
+  int fill = rx->fill[lane];
+  int bad = rx->bad[lane] || (fill < 3) || (crc8_update(0, chunk, fill - 1) != chunk[fill - 1]);
+
+  rx->fill[lane] = 0;
+  rx->bad[lane] = 0;
+  rx->last_step[lane] = step;
+
+  stats->chunks++;
+  stats->errors += bad;
+  stats->error_q8 += ((int32_t)(bad ? 256 : 0) - (int32_t)stats->error_q8) / 8;
+  if ( (stats->chunks >= rx->min_chunks) && (stats->error_q8 > rx->error_limit_q8) ) {
+    rx->active &= ~(1u << lane);
+  }
+  if (bad) {
+    return;
+  }
+
+  uint8_t seq = chunk[0];
+  int distance = (uint8_t)(seq - rx->next_seq);
+  if (distance >= STRIPE_REORDER) {
+    return; // Old duplicate or beyond the window
+  }
+  if ( !rx->has_seq[lane] || ((int8_t)(seq - rx->last_seq[lane]) > 0) ) {
+    rx->last_seq[lane] = seq;
+    rx->has_seq[lane] = 1;
+  }
+  int slot = seq % STRIPE_REORDER;
+  rx->valid[slot] = 1;
+  rx->length[slot] = fill - 2;
+  memcpy(rx->chunks[slot], chunk + 1, fill - 2);
+}
+
+/**
+  Feed one colour sample seen on `lane` at time `step`; repeats are fine.
+*/
+void laneStripeRx_push (laneStripeRx_t *rx, int lane, rgb_colour_t colour, long step) {
+  uint8_t output_byte;
+  int returncode = colourDecoder_push(&rx->decoders[lane], colour, &output_byte);
+
+  if (returncode == -1) {
+    if (rx->fill[lane] || rx->bad[lane]) {
+      laneStripeRx_chunk(rx, lane, step);
+      laneStripeRx_deliver(rx, step, 0);
+    }
+  } else if (returncode > 0) {
+    if (rx->fill[lane] < STRIPE_CHUNK_MAX + 2) {
+      rx->buffer[lane][rx->fill[lane]++] = output_byte;
+    } else {
+      rx->bad[lane] = 1;
+    }
+  } else if (returncode < 0) {
+    rx->bad[lane] = 1;
+  }
+}
+
+// End of stream: deliver everything left, skipping gaps
+void laneStripeRx_flush (laneStripeRx_t *rx, long step) {
+  laneStripeRx_deliver(rx, step, 1);
+}
+
+
+/*
+  SCREEN GRID
+
+  Bitmap mode: a display shows a grid of cells, each cell an independent
+  colour channel stepping one colour per symbol period, in lockstep. The
+  stream is striped across the cells byte by byte (cell i carries bytes i,
+  i + cells, ...), and cells that run out of data go DARK.
+
+  A one cell border carries the sync marks from the colour table:
+
+    top row      vsync: all YELLOW on even symbols, all WHITE on odd ones
+    left, right  hsync: WHITE on even grid rows, DARK on odd ones
+    bottom row   column ruler: WHITE on even columns, DARK on odd ones
+
+  So the border is always bright at the corners, the top edge tells the
+  orientation and the symbol phase, and the rulers count rows and columns.
+  Cells are drawn with a dark gap around them to limit bleed between
+  neighbours.
+*/
+
+typedef struct gridTransmitter {
+  videoScene_t scene;        // Output size and frame rate, no transmitters
+  int columns;               // Data cells
+  int rows;
+  int cell;                  // Cell pitch in pixels
+  int gap;                   // Dark guard between cells in pixels
+  int origin_x;              // Top left of the border in pixels
+  int origin_y;
+  int frames_per_symbol;
+  colourEncoder_t *encoders; // One per cell
+  rgb_colour_t *pending;     // 5 colours per cell for the current byte
+  rgb_colour_t *cells;       // Colour of each cell this symbol
+  const uint8_t *data;
+  long length;
+  long symbol;
+  int closed;
+} gridTransmitter_t;
+
+/**
+  Fit `columns` x `rows` data cells plus the sync border into the frame.
+
+  Return Values:
+    0 on success, -1 if the cells would be under 4 pixels or out of memory
+*/
+int gridTransmitter_init (gridTransmitter_t *tx, int width, int height, double fps, int columns, int rows,
+                          const colourMap_t *map, paritySel_t paritySelect) {
+  memset(tx, 0x00, sizeof(gridTransmitter_t));
+  tx->scene.width = width;
+  tx->scene.height = height;
+  tx->scene.fps = fps;
+  tx->columns = columns;
+  tx->rows = rows;
+  tx->frames_per_symbol = 1;
+
+  int pitch_x = width / (columns + 2);
+  int pitch_y = height / (rows + 2);
+  tx->cell = (pitch_x < pitch_y) ? pitch_x : pitch_y;
+  if ( (columns < 1) || (rows < 1) || (tx->cell < 4) ) {
+    return -1;
+  }
+  tx->gap = (tx->cell + 7) / 8;
+  tx->origin_x = (width - tx->cell * (columns + 2)) / 2;
+  tx->origin_y = (height - tx->cell * (rows + 2)) / 2;
+
+  int count = columns * rows;
+  tx->encoders = calloc(count, sizeof(colourEncoder_t));
+  tx->pending = calloc(count * 5, sizeof(rgb_colour_t));
+  tx->cells = calloc(count, sizeof(rgb_colour_t));
+  if ( !tx->encoders || !tx->pending || !tx->cells ) {
+    free(tx->encoders);
+    free(tx->pending);
+    free(tx->cells);
+    return -1;
+  }
+  for (int i = 0 ; i < count ; i++) {
+    colourEncoder_init(&tx->encoders[i], map, paritySelect);
+  }
+  return 0;
+}
+
+void gridTransmitter_destroy (gridTransmitter_t *tx) {
+  free(tx->encoders);
+  free(tx->pending);
+  free(tx->cells);
+}
+
+void gridTransmitter_load (gridTransmitter_t *tx, const uint8_t *data, long length) {
+  tx->data = data;
+  tx->length = length;
+  tx->symbol = 0;
+  tx->closed = 0;
+}
+
+/**
+  Step every cell to its next colour.
+
+  Return Values:
+    1 - new symbol in tx->cells
+    0 - stream finished (the last symbol was all DARK)
+*/
+int gridTransmitter_next (gridTransmitter_t *tx) {
+  int count = tx->columns * tx->rows;
+  int position = tx->symbol % 5;
+  long block = tx->symbol / 5;
+
+  if (tx->closed) {
+    return 0;
+  }
+  if (position == 0) {
+    if (block * count >= tx->length) {
+      for (int i = 0 ; i < count ; i++) {
+        tx->cells[i] = colourEncoder_close(&tx->encoders[i]);
+      }
+      tx->closed = 1;
+      tx->symbol++;
+      return 1;
+    }
+    for (int i = 0 ; i < count ; i++) {
+      long index = block * count + i;
+      if (index < tx->length) {
+        colourEncoder_put_uint8(&tx->encoders[i], tx->data[index], &tx->pending[i * 5]);
+      } else {
+        rgb_colour_t dark = colourEncoder_close(&tx->encoders[i]);
+        for (int k = 0 ; k < 5 ; k++) {
+          tx->pending[i * 5 + k] = dark;
+        }
+      }
+    }
+  }
+
+  for (int i = 0 ; i < count ; i++) {
+    tx->cells[i] = tx->pending[i * 5 + position];
+  }
+  tx->symbol++;
+  return 1;
+}
+
+/**
+  Colour of layout cell (gx, gy), where the border is column/row 0 and
+  columns + 1 / rows + 1, for the symbol last produced.
+*/
+rgb_colour_t gridTransmitter_layout (const gridTransmitter_t *tx, int gx, int gy) {
+  long symbol = (tx->symbol > 0) ? tx->symbol - 1 : 0;
+  if (gy == 0) {
+    return (symbol & 1) ? WHITE : YELLOW;
+  }
+  if (gy == tx->rows + 1) {
+    return ((gx == 0) || (gx == tx->columns + 1) || !((gx - 1) & 1)) ? WHITE : DARK;
+  }
+  if ( (gx == 0) || (gx == tx->columns + 1) ) {
+    return ((gy - 1) & 1) ? DARK : WHITE;
+  }
+  return tx->cells[(gy - 1) * tx->columns + (gx - 1)];
+}
+
+// Draw the current symbol as an RGB24 frame
+void gridTransmitter_render (const gridTransmitter_t *tx, uint8_t *rgb) {
+  int width = tx->scene.width;
+  int inner = tx->cell - tx->gap;
+
+  memset(rgb, 0x00, (size_t)width * tx->scene.height * 3);
+  for (int gy = 0 ; gy < tx->rows + 2 ; gy++) {
+    int top = tx->origin_y + gy * tx->cell + tx->gap / 2;
+    for (int gx = 0 ; gx < tx->columns + 2 ; gx++) {
+      rgb_colour_t colour = gridTransmitter_layout(tx, gx, gy);
+      if (colour == DARK) {
+        continue;
+      }
+      uint8_t pixel[3] = { (colour & RED) ? 255 : 0, (colour & GREEN) ? 255 : 0, (colour & BLUE) ? 255 : 0 };
+      uint8_t *first = rgb + ((size_t)top * width + tx->origin_x + gx * tx->cell + tx->gap / 2) * 3;
+      for (int x = 0 ; x < inner ; x++) {
+        memcpy(first + x * 3, pixel, 3);
+      }
+      for (int y = 1 ; y < inner ; y++) {
+        memcpy(first + (size_t)y * width * 3, first, inner * 3);
+      }
+    }
+  }
+}
+
+/**
+  Write the whole loaded stream as video, each symbol held for
+  `frames_per_symbol` frames.
+
+  Return Values:
+    Number of frames written, or -1 on a write or memory error
+*/
+long gridTransmitter_stream (gridTransmitter_t *tx, videoFormat_t format, FILE *out) {
+  size_t frame_size = videoFrame_size(&tx->scene, format);
+  uint8_t *rgb = malloc((size_t)tx->scene.width * tx->scene.height * 3);
+  uint8_t *packed = malloc(frame_size);
+  long frames = 0;
+
+  if ( !rgb || !packed || (videoWriter_header(&tx->scene, format, out) < 0) ) {
+    frames = -1;
+  }
+  while ( (frames >= 0) && gridTransmitter_next(tx) ) {
+    gridTransmitter_render(tx, rgb);
+    videoFrame_pack(&tx->scene, format, rgb, packed);
+    for (int i = 0 ; i < tx->frames_per_symbol ; i++) {
+      if (fwrite(packed, frame_size, 1, out) != 1) {
+        frames = -1;
+        break;
+      }
+      frames++;
+    }
+  }
+
+  free(rgb);
+  free(packed);
+  return frames;
+}
+
+
+/*
+  GRID RECEIVER
+
+  Decodes captured frames of a screen showing a gridTransmitter_t. The grid
+  size must be known. The lit border gives the outer corners: the extreme
+  bright pixels along the two diagonals. A homography from grid units to
+  pixels then undoes the perspective. Each of the 4 rotations is scored
+  against the expected sync border (lit vsync row, WHITE/DARK rulers), and
+  the best one is kept if it matches well enough.
+
+  Once locked, each frame first reads the vsync row. A repeat of the last
+  symbol is only skipped if its phase has not changed and a handful of
+  probe cells spread over the grid still show the colours last decoded, so
+  a frame two symbols on (same phase) is not mistaken for a repeat.
+  Otherwise every cell is sampled at a few points around its centre, with
+  offsets worked out once at lock time. Consecutive symbols of a cell
+  always differ, so a cell showing its last colour (idle DARK, or a repeat
+  let through by a misread probe) is not passed to its decoder; this is a
+  guard, not a saving, as every cell is still sampled. Cells are split over
+  the worker pool the same way as the multi stream receiver. The grid is
+  found again after `max_lost` frames with an unreadable vsync row.
+*/
+
+#define GRID_SAMPLES 5             // Sample points per cell
+#define GRID_PROBES 16             // Cells checked before a frame is skipped as a repeat
+#define GRID_INSET (1.0 / 16)      // Lit edge of the border inside the cell pitch (gridTransmitter_t gap)
+
+typedef struct homography {
+  double h[9];
+} homography_t;
+
+/**
+  Solve the homography taking src[i] to dst[i] for 4 point pairs.
+
+  Return Values:
+    0 on success, -1 if the points are degenerate
+*/
+int homography_fromCorners (homography_t *homography, const double src[4][2], const double dst[4][2]) {
+  double a[8][9];
+
+  for (int i = 0 ; i < 4 ; i++) {
+    double u = src[i][0], v = src[i][1], x = dst[i][0], y = dst[i][1];
+    double row_x[9] = { u, v, 1, 0, 0, 0, -u * x, -v * x, x };
+    double row_y[9] = { 0, 0, 0, u, v, 1, -u * y, -v * y, y };
+    memcpy(a[2 * i], row_x, sizeof(row_x));
+    memcpy(a[2 * i + 1], row_y, sizeof(row_y));
+  }
+
+  // Gaussian elimination with partial pivoting
+  for (int col = 0 ; col < 8 ; col++) {
+    int pivot = col;
+    for (int row = col + 1 ; row < 8 ; row++) {
+      if (fabs(a[row][col]) > fabs(a[pivot][col])) {
+        pivot = row;
+      }
+    }
+    if (fabs(a[pivot][col]) < 1e-12) {
+      return -1;
+    }
+    for (int k = 0 ; k < 9 ; k++) {
+      double swap = a[col][k];
+      a[col][k] = a[pivot][k];
+      a[pivot][k] = swap;
+    }
+    for (int row = 0 ; row < 8 ; row++) {
+      if (row == col) {
+        continue;
+      }
+      double factor = a[row][col] / a[col][col];
+      for (int k = col ; k < 9 ; k++) {
+        a[row][k] -= factor * a[col][k];
+      }
+    }
+  }
+
+  for (int i = 0 ; i < 8 ; i++) {
+    homography->h[i] = a[i][8] / a[i][i];
+  }
+  homography->h[8] = 1;
+  return 0;
+}
+
+void homography_apply (const homography_t *homography, double u, double v, double *x, double *y) {
+  const double *h = homography->h;
+  double w = h[6] * u + h[7] * v + h[8];
+  *x = (h[0] * u + h[1] * v + h[2]) / w;
+  *y = (h[3] * u + h[4] * v + h[5]) / w;
+}
+
+typedef struct gridReceiver {
+  int columns;
+  int rows;
+  colourClassifier_t classifier;
+  int scan_step;             // Pixel step when looking for the corners
+  double min_score;          // Fraction of border cells that must match to lock
+  int max_lost;
+  ledByteSink_t sink;        // Channel is the cell index
+  void *user;
+
+  // Lock
+  int locked;
+  int lost_frames;
+  homography_t homography;
+  double corners[4][2];      // Image corners in grid order: top left, top right, bottom right, bottom left
+  int width;                 // Frame size the offsets were worked out for
+  int height;
+  int *offsets;              // GRID_SAMPLES pixel indices per layout cell, border included
+  rgb_colour_t vsync;        // Phase of the symbol last decoded
+
+  // Cells
+  colourDecoder_t *decoders;
+  rgb_colour_t *last;
+  uint8_t *bytes;
+  int8_t *returncodes;
+  const colourMap_t *map;
+  paritySel_t parity;
+
+  workerPool_t pool;         // The calling thread is worker 0
+  long *changed;             // Cells changed per worker this frame
+  const videoFrame_t *frame;
+  long frame_index;
+
+  // Statistics
+  long symbols;              // Frames decoded as a new symbol
+  long skipped;              // Frames dropped as repeats of the last symbol
+  long cells_changed;
+  long relocks;
+} gridReceiver_t;
+
+/**
+  Return Values:
+    0 - ready, adjust the settings before the first frame if needed
+   -1 - out of memory
+*/
+int gridReceiver_init (gridReceiver_t *receiver, int columns, int rows, const colourMap_t *map, paritySel_t paritySelect, int threads) {
+  memset(receiver, 0x00, sizeof(gridReceiver_t));
+  receiver->columns = columns;
+  receiver->rows = rows;
+  receiver->classifier.on_level = 128;
+  receiver->classifier.min_pixels = 1;
+  receiver->classifier.step = 1;
+  receiver->scan_step = 4;
+  receiver->min_score = 0.9;
+  receiver->max_lost = 3;
+  receiver->map = map;
+  receiver->parity = paritySelect;
+
+  int cells = columns * rows;
+  int layout = (columns + 2) * (rows + 2);
+  receiver->offsets = calloc((size_t)layout * GRID_SAMPLES, sizeof(int));
+  receiver->decoders = calloc(cells, sizeof(colourDecoder_t));
+  receiver->last = calloc(cells, sizeof(rgb_colour_t));
+  receiver->bytes = calloc(cells, sizeof(uint8_t));
+  receiver->returncodes = calloc(cells, sizeof(int8_t));
+  receiver->changed = calloc((threads < 1) ? 1 : threads, sizeof(long));
+  if ( !receiver->offsets || !receiver->decoders || !receiver->last || !receiver->bytes ||
+       !receiver->returncodes || !receiver->changed || (workerPool_init(&receiver->pool, threads) < 0) ) {
+    free(receiver->offsets);
+    free(receiver->decoders);
+    free(receiver->last);
+    free(receiver->bytes);
+    free(receiver->returncodes);
+    free(receiver->changed);
+    return -1;
+  }
+  for (int i = 0 ; i < cells ; i++) {
+    colourDecoder_init(&receiver->decoders[i], map, paritySelect);
+  }
+  return 0;
+}
+
+void gridReceiver_destroy (gridReceiver_t *receiver) {
+  workerPool_destroy(&receiver->pool);
+  free(receiver->offsets);
+  free(receiver->decoders);
+  free(receiver->last);
+  free(receiver->bytes);
+  free(receiver->returncodes);
+  free(receiver->changed);
+}
+
+// Mean colour of the sample points of layout cell (gx, gy)
+static rgb_colour_t gridReceiver_sample (const gridReceiver_t *receiver, const videoFrame_t *frame, int gx, int gy) {
+  const int *offsets = &receiver->offsets[((size_t)gy * (receiver->columns + 2) + gx) * GRID_SAMPLES];
+  int sum[3] = {0, 0, 0};
+
+  for (int i = 0 ; i < GRID_SAMPLES ; i++) {
+    uint8_t rgb[3];
+    if (frame->format == VIDEO_RAW_RGB24) {
+      const uint8_t *pixel = &frame->data[(size_t)offsets[i] * 3];
+      rgb[0] = pixel[0];
+      rgb[1] = pixel[1];
+      rgb[2] = pixel[2];
+    } else {
+      videoFrame_rgb(frame, offsets[i] % frame->width, offsets[i] / frame->width, rgb);
+    }
+    sum[0] += rgb[0];
+    sum[1] += rgb[1];
+    sum[2] += rgb[2];
+  }
+
+  uint8_t mean[3] = { sum[0] / GRID_SAMPLES, sum[1] / GRID_SAMPLES, sum[2] / GRID_SAMPLES };
+  return colourClassify_rgb(&receiver->classifier, mean);
+}
+
+// Pixel offsets of every sample point under `homography`; -1 if part of the grid is off frame
+static int gridReceiver_offsets (gridReceiver_t *receiver, const homography_t *homography, int width, int height) {
+  static const double spread[GRID_SAMPLES][2] = { {0, 0}, {-0.2, 0}, {0.2, 0}, {0, -0.2}, {0, 0.2} };
+
+  for (int gy = 0 ; gy < receiver->rows + 2 ; gy++) {
+    for (int gx = 0 ; gx < receiver->columns + 2 ; gx++) {
+      int *offsets = &receiver->offsets[((size_t)gy * (receiver->columns + 2) + gx) * GRID_SAMPLES];
+      for (int i = 0 ; i < GRID_SAMPLES ; i++) {
+        double x, y;
+        homography_apply(homography, gx + 0.5 + spread[i][0], gy + 0.5 + spread[i][1], &x, &y);
+        int px = (int)(x + 0.5);
+        int py = (int)(y + 0.5);
+        if ( (px < 0) || (py < 0) || (px >= width) || (py >= height) ) {
+          return -1;
+        }
+        offsets[i] = py * width + px;
+      }
+    }
+  }
+  return 0;
+}
+
+// Fraction of border cells showing the expected sync pattern
+static double gridReceiver_score (const gridReceiver_t *receiver, const videoFrame_t *frame) {
+  int columns = receiver->columns;
+  int rows = receiver->rows;
+  int match = 0;
+  int total = 0;
+
+  for (int gx = 0 ; gx < columns + 2 ; gx++) {
+    rgb_colour_t top = gridReceiver_sample(receiver, frame, gx, 0);
+    rgb_colour_t bottom = gridReceiver_sample(receiver, frame, gx, rows + 1);
+    int ruler_lit = (gx == 0) || (gx == columns + 1) || !((gx - 1) & 1);
+    match += (top == YELLOW) || (top == WHITE);
+    match += ruler_lit ? (bottom == WHITE) : (bottom == DARK);
+    total += 2;
+  }
+  for (int gy = 1 ; gy < rows + 1 ; gy++) {
+    rgb_colour_t expected = ((gy - 1) & 1) ? DARK : WHITE;
+    match += (gridReceiver_sample(receiver, frame, 0, gy) == expected);
+    match += (gridReceiver_sample(receiver, frame, columns + 1, gy) == expected);
+    total += 2;
+  }
+  return (double)match / total;
+}
+
+/**
+  Find the grid in `frame`.
+
+  Return Values:
+    1 - locked
+    0 - no grid found
+*/
+int gridReceiver_lock (gridReceiver_t *receiver, const videoFrame_t *frame) {
+  double extreme[4] = {0};
+  double found[4][2] = {{0}};
+  int any = 0;
+
+  receiver->locked = 0;
+  receiver->relocks++;
+
+  // Extreme lit pixels along the diagonals: top left, top right, bottom right, bottom left
+  for (int y = 0 ; y < frame->height ; y += receiver->scan_step) {
+    for (int x = 0 ; x < frame->width ; x += receiver->scan_step) {
+      uint8_t rgb[3];
+      videoFrame_rgb(frame, x, y, rgb);
+      if ( (rgb[0] < receiver->classifier.on_level) && (rgb[1] < receiver->classifier.on_level) &&
+           (rgb[2] < receiver->classifier.on_level) ) {
+        continue;
+      }
+      double score[4] = { -(x + y), x - y, x + y, y - x };
+      for (int k = 0 ; k < 4 ; k++) {
+        if ( !any || (score[k] > extreme[k]) ) {
+          extreme[k] = score[k];
+          found[k][0] = x;
+          found[k][1] = y;
+        }
+      }
+      any = 1;
+    }
+  }
+  if (!any) {
+    return 0;
+  }
+
+  double inset = GRID_INSET;
+  double far_x = receiver->columns + 2 - inset;
+  double far_y = receiver->rows + 2 - inset;
+  const double grid[4][2] = { {inset, inset}, {far_x, inset}, {far_x, far_y}, {inset, far_y} };
+  double best_score = -1;
+
+  for (int rotation = 0 ; rotation < 4 ; rotation++) {
+    double image[4][2];
+    homography_t homography;
+    for (int k = 0 ; k < 4 ; k++) {
+      image[k][0] = found[(k + rotation) % 4][0];
+      image[k][1] = found[(k + rotation) % 4][1];
+    }
+    if ( (homography_fromCorners(&homography, grid, image) < 0) ||
+         (gridReceiver_offsets(receiver, &homography, frame->width, frame->height) < 0) ) {
+      continue;
+    }
+    double score = gridReceiver_score(receiver, frame);
+    if (score > best_score) {
+      best_score = score;
+      receiver->homography = homography;
+      memcpy(receiver->corners, image, sizeof(image));
+    }
+  }
+
+  if (best_score < receiver->min_score) {
+    return 0;
+  }
+  gridReceiver_offsets(receiver, &receiver->homography, frame->width, frame->height);
+  receiver->width = frame->width;
+  receiver->height = frame->height;
+  receiver->locked = 1;
+  receiver->lost_frames = 0;
+  return 1;
+}
+
+static void gridReceiver_work (void *context, int index) {
+  gridReceiver_t *receiver = context;
+  int cells = receiver->columns * receiver->rows;
+  int share = (cells + receiver->pool.threads - 1) / receiver->pool.threads;
+  int first = index * share;
+  int last = (first + share < cells) ? first + share : cells;
+  long changed = 0;
+
+  for (int i = first ; i < last ; i++) {
+    rgb_colour_t colour = gridReceiver_sample(receiver, receiver->frame, i % receiver->columns + 1, i / receiver->columns + 1);
+    receiver->returncodes[i] = 0;
+    if (colour == receiver->last[i]) {
+      continue;
+    }
+    receiver->last[i] = colour;
+    receiver->returncodes[i] = colourDecoder_push(&receiver->decoders[i], colour, &receiver->bytes[i]);
+    changed++;
+  }
+  receiver->changed[index] = changed;
+}
+
+// Number of probe cells no longer showing the colour last decoded
+static int gridReceiver_probe (const gridReceiver_t *receiver, const videoFrame_t *frame) {
+  int cells = receiver->columns * receiver->rows;
+  int probes = (cells < GRID_PROBES) ? cells : GRID_PROBES;
+  int moved = 0;
+
+  for (int k = 0 ; k < probes ; k++) {
+    int i = (int)((k * 2654435761u) % (unsigned)cells); // Scattered so probes do not line up with patterns in the data
+    rgb_colour_t colour = gridReceiver_sample(receiver, frame, i % receiver->columns + 1, i / receiver->columns + 1);
+    moved += (colour != receiver->last[i]);
+  }
+  return moved;
+}
+
+/**
+  Process one captured frame.
+
+  Return Values:
+    1 - new symbol decoded
+    0 - repeat of the last symbol, skipped
+   -1 - no grid locked in this frame
+*/
+int gridReceiver_frame (gridReceiver_t *receiver, const videoFrame_t *frame) {
+  receiver->frame_index++;
+  if ( (!receiver->locked || (frame->width != receiver->width) || (frame->height != receiver->height)) &&
+       !gridReceiver_lock(receiver, frame) ) {
+    return -1;
+  }
+
+  // Vsync phase: majority of the top row
+  int yellow = 0;
+  int white = 0;
+  for (int gx = 1 ; gx < receiver->columns + 1 ; gx++) {
+    rgb_colour_t colour = gridReceiver_sample(receiver, frame, gx, 0);
+    yellow += (colour == YELLOW);
+    white += (colour == WHITE);
+  }
+  if (2 * (yellow + white) < receiver->columns) {
+    if (++receiver->lost_frames >= receiver->max_lost) {
+      receiver->locked = 0;
+    }
+    return -1;
+  }
+  receiver->lost_frames = 0;
+  rgb_colour_t vsync = (yellow > white) ? YELLOW : WHITE;
+  if ( (vsync == receiver->vsync) && (gridReceiver_probe(receiver, frame) == 0) ) {
+    receiver->skipped++;
+    return 0;
+  }
+  receiver->vsync = vsync;
+  receiver->symbols++;
+
+  receiver->frame = frame;
+  workerPool_run(&receiver->pool, gridReceiver_work, receiver);
+
+  for (int i = 0 ; i < receiver->pool.threads ; i++) {
+    receiver->cells_changed += receiver->changed[i];
+  }
+  for (int i = 0 ; i < receiver->columns * receiver->rows ; i++) {
+    int returncode = receiver->returncodes[i];
+    if ( receiver->sink && (returncode != 0) && (returncode != -1) ) {
+      receiver->sink(receiver->user, i, receiver->bytes[i], returncode, receiver->frame_index - 1);
+    }
+  }
+  return 1;
+}
+
+
+/*
+  PACKET FRAMING
+
+  Packets are sent as ordinary bytes followed by DARK. The receiver keeps
+  bytes until DARK and hands the packet up only if every byte arrived with
+  good framing and parity, so a receiver joining mid packet just drops the
+  tail it caught. Packet integrity (CRC) is up to the layer above.
+*/
+
+#define PACKET_MAX 264
+
+/**
+  Return Value:
+    Number of colours written (length * 5 + 1)
+*/
+int packetEncode_colours (colourEncoder_t *encoder, const uint8_t *packet, int length, rgb_colour_t *colours) {
+  int count = 0;
+  for (int i = 0 ; i < length ; i++) {
+    count += colourEncoder_put_uint8(encoder, packet[i], colours + count);
+  }
+  colours[count++] = colourEncoder_close(encoder);
+  return count;
+}
+
+typedef struct packetReceiver {
+  colourDecoder_t decoder;
+  uint8_t packet[PACKET_MAX];
+  int length;
+  int bad;
+  uint32_t packets;
+  uint32_t dropped;
+} packetReceiver_t;
+
+void packetReceiver_init (packetReceiver_t *receiver, const colourMap_t *map, paritySel_t paritySelect) {
+  memset(receiver, 0x00, sizeof(packetReceiver_t));
+  colourDecoder_init(&receiver->decoder, map, paritySelect);
+}
+
+/**
+  Feed one colour; repeats are fine.
+
+  Return Values:
+    Packet length when a clean packet ended (packet in receiver->packet), else 0
+*/
+int packetReceiver_push (packetReceiver_t *receiver, rgb_colour_t colour) {
+  uint8_t output_byte;
+  uint32_t framing_errors = receiver->decoder.framing_errors;
+  int returncode = colourDecoder_push(&receiver->decoder, colour, &output_byte);
+
+  if (returncode > 0) {
+    if (receiver->length < PACKET_MAX) {
+      receiver->packet[receiver->length++] = output_byte;
+    } else {
+      receiver->bad = 1;
+    }
+    return 0;
+  }
+  if (returncode < -1) {
+    receiver->bad = 1;
+    return 0;
+  }
+  if (returncode == 0) {
+    return 0;
+  }
+
+  // Channel closed: end of packet
+  int length = receiver->length;
+  int bad = receiver->bad || (receiver->decoder.framing_errors != framing_errors); // Partial byte cut off
+  receiver->length = 0;
+  receiver->bad = 0;
+  if (!length) {
+    return 0;
+  }
+  if (bad) {
+    receiver->dropped++;
+    return 0;
+  }
+  receiver->packets++;
+  return length;
+}
+
+
+/*
+  FOUNTAIN CODE
+
+  LT code broadcast for one way beacons. The payload is split into K source
+  blocks. Each packet is the XOR of a random set of blocks, with the set
+  size drawn from the robust soliton distribution. The set is derived from
+  the packet id, so the packet only has to carry its id:
+
+    [length:16] [block size:8] [id:16] [block XOR ...] [crc8]
+
+  Every packet describes the whole payload, so a receiver can join at any
+  time. Once it holds a little over K packets, whichever ones they were, it
+  can rebuild the payload. The decoder peels: a packet whose set is down
+  to one unknown block gives that block, which is then XORed out of every
+  other packet. When peeling stalls with enough packets in hand, Gauss
+  Jordan elimination over GF(2) finishes the job. Block data and
+  coefficient rows are XORed a 64bit word at a time.
+*/
+
+#define FOUNTAIN_HEADER 5
+#define FOUNTAIN_C 0.1             // Robust soliton tuning
+#define FOUNTAIN_DELTA 0.5
+
+// dst ^= src, a word at a time
+static void xorBytes (uint8_t *dst, const uint8_t *src, size_t length) {
+  size_t i = 0;
+  for ( ; i + 8 <= length ; i += 8) {
+    uint64_t a, b;
+    memcpy(&a, dst + i, 8);
+    memcpy(&b, src + i, 8);
+    a ^= b;
+    memcpy(dst + i, &a, 8);
+  }
+  for ( ; i < length ; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+/**
+  Cumulative robust soliton distribution over degrees 1..k, cdf[d - 1].
+
+  Return Value:
+    Table to free(), or NULL when out of memory
+*/
+double *fountain_degreeTable (int k) {
+  double *cdf = calloc(k, sizeof(double));
+  if (!cdf) {
+    return NULL;
+  }
+
+  double r = FOUNTAIN_C * log(k / FOUNTAIN_DELTA) * sqrt(k);
+  int spike = (r > 0) ? (int)(k / r + 0.5) : k;
+  spike = (spike < 1) ? 1 : (spike > k) ? k : spike;
+  double total = 0;
+
+  for (int d = 1 ; d <= k ; d++) {
+    double rho = (d == 1) ? 1.0 / k : 1.0 / ((double)d * (d - 1));
+    double tau = 0;
+    if (d < spike) {
+      tau = r / ((double)d * k);
+    } else if (d == spike) {
+      tau = r * log(r / FOUNTAIN_DELTA) / k;
+    }
+    total += rho + ((tau > 0) ? tau : 0);
+    cdf[d - 1] = total;
+  }
+  for (int d = 0 ; d < k ; d++) {
+    cdf[d] /= total;
+  }
+  return cdf;
+}
+
+/**
+  Blocks XORed into packet `id`, as a bit set of `(k + 63) / 64` words.
+
+  Return Value:
+    Degree (number of blocks)
+*/
+int fountain_neighbours (int k, const double *cdf, uint32_t id, uint64_t *bits) {
+  simRandom_t rng;
+  int words = (k + 63) / 64;
+
+  memset(bits, 0x00, words * sizeof(uint64_t));
+  simRandom_seed(&rng, 0xF0C0DE00ull ^ id);
+
+  double u = simRandom_uniform(&rng);
+  int low = 0, high = k - 1;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (cdf[middle] < u) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  int degree = low + 1;
+  for (int chosen = 0 ; chosen < degree ; ) {
+    int block = simRandom_u32(&rng) % k;
+    if (!((bits[block / 64] >> (block % 64)) & 1)) {
+      bits[block / 64] |= 1ull << (block % 64);
+      chosen++;
+    }
+  }
+  return degree;
+}
+
+typedef struct fountainEncoder {
+  const uint8_t *payload;
+  long length;
+  int block_size;
+  int k;
+  double *cdf;
+  uint64_t *bits;
+  uint32_t id;
+} fountainEncoder_t;
+
+/**
+  Return Values:
+    0 on success, -1 on bad sizes (length over 65535, block size over 250) or no memory
+*/
+int fountainEncoder_init (fountainEncoder_t *encoder, const uint8_t *payload, long length, int block_size) {
+  memset(encoder, 0x00, sizeof(fountainEncoder_t));
+  if ( (length < 1) || (length > 0xFFFF) || (block_size < 1) || (block_size > PACKET_MAX - FOUNTAIN_HEADER - 1 - 8) ) {
+    return -1;
+  }
+  encoder->payload = payload;
+  encoder->length = length;
+  encoder->block_size = block_size;
+  encoder->k = (length + block_size - 1) / block_size;
+  encoder->cdf = fountain_degreeTable(encoder->k);
+  encoder->bits = calloc((encoder->k + 63) / 64, sizeof(uint64_t));
+  if ( !encoder->cdf || !encoder->bits ) {
+    free(encoder->cdf);
+    free(encoder->bits);
+    return -1;
+  }
+  return 0;
+}
+
+void fountainEncoder_destroy (fountainEncoder_t *encoder) {
+  free(encoder->cdf);
+  free(encoder->bits);
+}
+
+/**
+  Build the next packet of the endless stream.
+
+  Return Value:
+    Packet length (FOUNTAIN_HEADER + block size + 1)
+*/
+int fountainEncoder_packet (fountainEncoder_t *encoder, uint8_t *packet) {
+  uint32_t id = encoder->id++ & 0xFFFF;
+  uint8_t *data = packet + FOUNTAIN_HEADER;
+  int block_size = encoder->block_size;
+
+  packet[0] = encoder->length >> 8;
+  packet[1] = encoder->length & 0xFF;
+  packet[2] = block_size;
+  packet[3] = id >> 8;
+  packet[4] = id & 0xFF;
+  memset(data, 0x00, block_size);
+
+  fountain_neighbours(encoder->k, encoder->cdf, id, encoder->bits);
+  for (int block = 0 ; block < encoder->k ; block++) {
+    if (!((encoder->bits[block / 64] >> (block % 64)) & 1)) {
+      continue;
+    }
+    long offset = (long)block * block_size;
+    long size = (encoder->length - offset < block_size) ? encoder->length - offset : block_size; // Last block zero padded
+    xorBytes(data, encoder->payload + offset, size);
+  }
+
+  data[block_size] = crc8_update(0, packet, FOUNTAIN_HEADER + block_size);
+  return FOUNTAIN_HEADER + block_size + 1;
+}
+
+typedef struct fountainDecoder {
+  long length;               // 0 until the first packet arrives
+  int block_size;
+  int k;
+  int words;
+  double *cdf;
+  uint8_t *blocks;           // k * block_size, the payload once complete
+  uint8_t *known;
+  int recovered;
+  // Packets not yet used up, as equations over the unknown blocks
+  int rows;
+  int max_rows;
+  uint64_t *coefficients;    // max_rows * words
+  uint8_t *row_data;         // max_rows * block_size
+  int *degree;
+  // Statistics
+  uint32_t packets;          // Valid packets taken in
+  uint32_t rejected;         // Bad CRC or not matching the payload
+  uint32_t eliminations;
+} fountainDecoder_t;
+
+void fountainDecoder_init (fountainDecoder_t *decoder) {
+  memset(decoder, 0x00, sizeof(fountainDecoder_t));
+}
+
+void fountainDecoder_destroy (fountainDecoder_t *decoder) {
+  free(decoder->cdf);
+  free(decoder->blocks);
+  free(decoder->known);
+  free(decoder->coefficients);
+  free(decoder->row_data);
+  free(decoder->degree);
+  memset(decoder, 0x00, sizeof(fountainDecoder_t));
+}
+
+static int fountainDecoder_alloc (fountainDecoder_t *decoder, long length, int block_size) {
+  decoder->length = length;
+  decoder->block_size = block_size;
+  decoder->k = (length + block_size - 1) / block_size;
+  decoder->words = (decoder->k + 63) / 64;
+  decoder->max_rows = 2 * decoder->k + 16;
+  decoder->cdf = fountain_degreeTable(decoder->k);
+  decoder->blocks = calloc(decoder->k, block_size);
+  decoder->known = calloc(decoder->k, 1);
+  decoder->coefficients = calloc((size_t)decoder->max_rows * decoder->words, sizeof(uint64_t));
+  decoder->row_data = calloc(decoder->max_rows, block_size);
+  decoder->degree = calloc(decoder->max_rows, sizeof(int));
+  if ( !decoder->cdf || !decoder->blocks || !decoder->known || !decoder->coefficients || !decoder->row_data || !decoder->degree ) {
+    fountainDecoder_destroy(decoder);
+    return -1;
+  }
+  return 0;
+}
+
+static void fountainDecoder_dropRow (fountainDecoder_t *decoder, int row) {
+  int last = --decoder->rows;
+  if (row == last) {
+    return;
+  }
+  memcpy(&decoder->coefficients[(size_t)row * decoder->words], &decoder->coefficients[(size_t)last * decoder->words], decoder->words * sizeof(uint64_t));
+  memcpy(&decoder->row_data[(size_t)row * decoder->block_size], &decoder->row_data[(size_t)last * decoder->block_size], decoder->block_size);
+  decoder->degree[row] = decoder->degree[last];
+}
+
+// Use up rows of degree 0 and 1, XORing each recovered block out of the rest
+static void fountainDecoder_peel (fountainDecoder_t *decoder) {
+  int progress = 1;
+  while (progress) {
+    progress = 0;
+    for (int row = 0 ; row < decoder->rows ; ) {
+      if (decoder->degree[row] > 1) {
+        row++;
+        continue;
+      }
+      if (decoder->degree[row] == 0) {
+        fountainDecoder_dropRow(decoder, row);
+        continue;
+      }
+
+      uint64_t *bits = &decoder->coefficients[(size_t)row * decoder->words];
+      int block = 0;
+      for (int w = 0 ; w < decoder->words ; w++) {
+        if (bits[w]) {
+          block = w * 64 + __builtin_ctzll(bits[w]);
+          break;
+        }
+      }
+      uint8_t *data = &decoder->blocks[(size_t)block * decoder->block_size];
+      memcpy(data, &decoder->row_data[(size_t)row * decoder->block_size], decoder->block_size);
+      decoder->known[block] = 1;
+      decoder->recovered++;
+      fountainDecoder_dropRow(decoder, row);
+
+      uint64_t bit = 1ull << (block % 64);
+      for (int other = 0 ; other < decoder->rows ; other++) {
+        uint64_t *word = &decoder->coefficients[(size_t)other * decoder->words + block / 64];
+        if (*word & bit) {
+          *word ^= bit;
+          decoder->degree[other]--;
+          xorBytes(&decoder->row_data[(size_t)other * decoder->block_size], data, decoder->block_size);
+        }
+      }
+      progress = 1;
+      row = 0;
+    }
+  }
+}
+
+// Gauss Jordan over the unknown blocks; rows left dependent drop out
+static void fountainDecoder_eliminate (fountainDecoder_t *decoder) {
+  int words = decoder->words;
+  int pivot_row = 0;
+
+  decoder->eliminations++;
+  for (int block = 0 ; (block < decoder->k) && (pivot_row < decoder->rows) ; block++) {
+    if (decoder->known[block]) {
+      continue;
+    }
+    int w = block / 64;
+    uint64_t bit = 1ull << (block % 64);
+    int found = -1;
+    for (int row = pivot_row ; row < decoder->rows ; row++) {
+      if (decoder->coefficients[(size_t)row * words + w] & bit) {
+        found = row;
+        break;
+      }
+    }
+    if (found < 0) {
+      continue;
+    }
+
+    uint64_t *pivot = &decoder->coefficients[(size_t)pivot_row * words];
+    uint8_t *pivot_data = &decoder->row_data[(size_t)pivot_row * decoder->block_size];
+    if (found != pivot_row) {
+      uint64_t *other = &decoder->coefficients[(size_t)found * words];
+      uint8_t *other_data = &decoder->row_data[(size_t)found * decoder->block_size];
+      for (int i = 0 ; i < words ; i++) {
+        uint64_t swap = pivot[i];
+        pivot[i] = other[i];
+        other[i] = swap;
+      }
+      xorBytes(pivot_data, other_data, decoder->block_size); // Swap by three XORs
+      xorBytes(other_data, pivot_data, decoder->block_size);
+      xorBytes(pivot_data, other_data, decoder->block_size);
+    }
+
+    for (int row = 0 ; row < decoder->rows ; row++) {
+      uint64_t *bits = &decoder->coefficients[(size_t)row * words];
+      if ( (row == pivot_row) || !(bits[w] & bit) ) {
+        continue;
+      }
+      for (int i = 0 ; i < words ; i++) {
+        bits[i] ^= pivot[i];
+      }
+      xorBytes(&decoder->row_data[(size_t)row * decoder->block_size], pivot_data, decoder->block_size);
+    }
+    pivot_row++;
+  }
+
+  for (int row = 0 ; row < decoder->rows ; row++) {
+    int degree = 0;
+    for (int i = 0 ; i < words ; i++) {
+      degree += __builtin_popcountll(decoder->coefficients[(size_t)row * words + i]);
+    }
+    decoder->degree[row] = degree;
+  }
+  fountainDecoder_peel(decoder);
+}
+
+/**
+  Take in one received packet.
+
+  Return Values:
+    1 - payload complete (decoder->blocks, decoder->length bytes)
+    0 - packet used, more needed
+   -1 - packet rejected (bad CRC, not for this payload, or out of memory)
+*/
+int fountainDecoder_packet (fountainDecoder_t *decoder, const uint8_t *packet, int length) {
+  if ( (length <= FOUNTAIN_HEADER + 1) || (crc8_update(0, packet, length - 1) != packet[length - 1]) ) {
+    decoder->rejected++;
+    return -1;
+  }
+  long payload_length = ((long)packet[0] << 8) | packet[1];
+  int block_size = packet[2];
+  uint32_t id = ((uint32_t)packet[3] << 8) | packet[4];
+  if ( (block_size != length - FOUNTAIN_HEADER - 1) || (payload_length < 1) ) {
+    decoder->rejected++;
+    return -1;
+  }
+  if (!decoder->length) {
+    if (fountainDecoder_alloc(decoder, payload_length, block_size) < 0) {
+      return -1;
+    }
+  } else if ( (payload_length != decoder->length) || (block_size != decoder->block_size) ) {
+    decoder->rejected++;
+    return -1;
+  }
+  decoder->packets++;
+  if (decoder->recovered == decoder->k) {
+    return 1;
+  }
+  if (decoder->rows == decoder->max_rows) {
+    fountainDecoder_eliminate(decoder);
+    if (decoder->rows == decoder->max_rows) {
+      return 0;
+    }
+  }
+
+  int row = decoder->rows++;
+  uint64_t *bits = &decoder->coefficients[(size_t)row * decoder->words];
+  uint8_t *data = &decoder->row_data[(size_t)row * block_size];
+  fountain_neighbours(decoder->k, decoder->cdf, id, bits);
+  memcpy(data, packet + FOUNTAIN_HEADER, block_size);
+
+  int degree = 0;
+  for (int block = 0 ; block < decoder->k ; block++) {
+    uint64_t bit = 1ull << (block % 64);
+    if (!(bits[block / 64] & bit)) {
+      continue;
+    }
+    if (decoder->known[block]) {
+      bits[block / 64] ^= bit;
+      xorBytes(data, &decoder->blocks[(size_t)block * block_size], block_size);
+    } else {
+      degree++;
+    }
+  }
+  decoder->degree[row] = degree;
+
+  fountainDecoder_peel(decoder);
+  if ( (decoder->recovered < decoder->k) && (decoder->recovered + decoder->rows >= decoder->k) ) {
+    fountainDecoder_eliminate(decoder);
+  }
+  return (decoder->recovered == decoder->k) ? 1 : 0;
+}
+
+
+/*
+  CAROUSEL
+
+  A beacon repeating one message forever. The message is cut into blocks,
+  and each block is sent as a packet (see PACKET FRAMING):
+
+    [length:16] [index:16] [block size:8] [crc8 of those 5] [data ...] [crc8 of data]
+
+  Each pass gets corrupted in different places. Rather than waiting for a
+  pass where a block comes through clean, the receiver votes across
+  passes. It votes on colours, not bytes: one misread colour spoils two
+  transitions, and often still gives a byte with good parity, but it is
+  only one wrong colour. Each byte slot (4 data colours and the mark) that
+  arrived with the right number of colours adds one vote to each of its
+  15 colour bits. After each copy of a block, the majority colours are
+  decoded and checked against both CRCs. If 3 or fewer bits are tied,
+  each way of settling them is tried.
+
+  A header CRC is only 8 bits, so one bad header can pass it. The message
+  length and block size are only taken once two headers agree on them.
+  From then on the header of every block is known in advance, and a copy
+  is put to the block whose header colours are nearest its own, so a
+  misread header colour does not lose the copy. A misread colour that
+  turns into a mark, or a mark into a data colour, shifts every later
+  slot. Then the slots before the first misframed one are voted from the
+  start and those after the last one from the end of the packet.
+
+  Votes are bit-sliced: per byte slot there are three 16bit count planes
+  (bit n of plane k is bit k of the ones count for colour bit n) and a
+  vote total. Planes and totals are kept in separate arrays so nothing is
+  lost to padding: 7 bytes of state per byte. When a slot already has 7
+  votes its counts and total are halved (each plane moves down one) before
+  the next vote goes in, so later passes can still overturn a wrong
+  majority.
+*/
+
+#define CAROUSEL_HEADER 6
+#define CAROUSEL_MAX_VOTES 7
+#define CAROUSEL_VOTE_BYTES (3 * sizeof(uint16_t) + 1) // Vote state per byte slot
+#define CAROUSEL_HEADER_MISREADS 2 // Colours a header may differ by from the block it is put to
+
+/**
+  Build the packet for block `index` of `message`.
+
+  Return Value:
+    Packet length (CAROUSEL_HEADER + block_size + 1)
+*/
+int carousel_packet (const uint8_t *message, long length, int block_size, int index, uint8_t *packet) {
+  long offset = (long)index * block_size;
+  long size = (length - offset < block_size) ? length - offset : block_size;
+
+  packet[0] = length >> 8;
+  packet[1] = length & 0xFF;
+  packet[2] = index >> 8;
+  packet[3] = index & 0xFF;
+  packet[4] = block_size;
+  packet[5] = crc8_update(0, packet, 5);
+  memset(packet + CAROUSEL_HEADER, 0x00, block_size);
+  memcpy(packet + CAROUSEL_HEADER, message + offset, size);
+  packet[CAROUSEL_HEADER + block_size] = crc8_update(0, packet + CAROUSEL_HEADER, block_size);
+  return CAROUSEL_HEADER + block_size + 1;
+}
+
+typedef void (*carouselBlockSink_t) (void *user, int index, const uint8_t *data, int length);
+
+typedef struct carouselReceiver {
+  const colourMap_t *map;
+  paritySel_t parity;
+  rgb_colour_t last_colour;
+  // Packet being received, as byte slots of 15 colour bits
+  uint16_t slots[PACKET_MAX];
+  uint8_t good[PACKET_MAX];  // Slot had 4 data colours then a mark
+  int fill;
+  uint16_t slot;
+  int slot_colours;
+  // Message, set up once two good headers agree
+  long pending_length;       // First good header, waiting for a second to agree
+  int pending_block_size;
+  long length;
+  int block_size;
+  int blocks;
+  uint16_t *headers;         // Expected header slots of each block
+  uint16_t *counts;          // Bit-sliced ones counts, 3 planes per slot
+  uint8_t *totals;           // Votes per slot; (CAROUSEL_HEADER + block_size + 1) slots per block
+  uint8_t *done;
+  uint8_t *message;
+  int completed;
+  carouselBlockSink_t sink;
+  void *user;
+  // Statistics
+  uint32_t packets;          // Block copies voted in
+  uint32_t clean;            // Copies that were fine on their own
+  uint32_t tie_breaks;       // Blocks recovered by trying tied bits
+} carouselReceiver_t;
+
+void carouselReceiver_init (carouselReceiver_t *receiver, const colourMap_t *map, paritySel_t paritySelect,
+                            carouselBlockSink_t sink, void *user) {
+  memset(receiver, 0x00, sizeof(carouselReceiver_t));
+  receiver->map = map ? map : colourMap_active;
+  receiver->parity = paritySelect;
+  receiver->last_colour = DARK;
+  receiver->sink = sink;
+  receiver->user = user;
+}
+
+void carouselReceiver_destroy (carouselReceiver_t *receiver) {
+  free(receiver->headers);
+  free(receiver->counts);
+  free(receiver->totals);
+  free(receiver->done);
+  free(receiver->message);
+}
+
+/**
+  Decode byte slots from the start of a packet (after DARK).
+
+  Return Value:
+    Number of leading slots that decoded with good framing and parity
+*/
+static int carousel_decodeSlots (const carouselReceiver_t *receiver, const uint16_t *slots, int count, uint8_t *bytes) {
+  colourDecoder_t decoder;
+  colourDecoder_init(&decoder, receiver->map, receiver->parity);
+  for (int i = 0 ; i < count ; i++) {
+    int returncode = 0;
+    for (int k = 0 ; k < 5 ; k++) {
+      returncode = colourDecoder_push(&decoder, (slots[i] >> (3 * k)) & 0x07, &bytes[i]);
+    }
+    if (returncode <= 0) {
+      return i;
+    }
+  }
+  return count;
+}
+
+static int carouselReceiver_setup (carouselReceiver_t *receiver, long length, int block_size) {
+  receiver->length = length;
+  receiver->block_size = block_size;
+  receiver->blocks = (length + block_size - 1) / block_size;
+  size_t slots = (size_t)receiver->blocks * (CAROUSEL_HEADER + block_size + 1);
+  receiver->headers = calloc((size_t)receiver->blocks * CAROUSEL_HEADER, sizeof(uint16_t));
+  receiver->counts = calloc(slots * 3, sizeof(uint16_t));
+  receiver->totals = calloc(slots, sizeof(uint8_t));
+  receiver->done = calloc(receiver->blocks, 1);
+  receiver->message = calloc((size_t)receiver->blocks * block_size, 1);
+  if ( !receiver->headers || !receiver->counts || !receiver->totals || !receiver->done || !receiver->message ) {
+    carouselReceiver_destroy(receiver);
+    receiver->headers = NULL;
+    receiver->counts = NULL;
+    receiver->totals = NULL;
+    receiver->done = NULL;
+    receiver->message = NULL;
+    receiver->length = 0;
+    return -1;
+  }
+
+  for (int index = 0 ; index < receiver->blocks ; index++) {
+    uint8_t header[CAROUSEL_HEADER];
+    rgb_colour_t colours[5];
+    colourEncoder_t encoder;
+    header[0] = length >> 8;
+    header[1] = length & 0xFF;
+    header[2] = index >> 8;
+    header[3] = index & 0xFF;
+    header[4] = block_size;
+    header[5] = crc8_update(0, header, 5);
+    colourEncoder_init(&encoder, receiver->map, receiver->parity);
+    for (int i = 0 ; i < CAROUSEL_HEADER ; i++) {
+      uint16_t slot = 0;
+      colourEncoder_put_uint8(&encoder, header[i], colours);
+      for (int k = 0 ; k < 5 ; k++) {
+        slot |= (uint16_t)colours[k] << (3 * k);
+      }
+      receiver->headers[(size_t)index * CAROUSEL_HEADER + i] = slot;
+    }
+  }
+  return 0;
+}
+
+// Colours that differ between two byte slots
+static int carousel_slotDistance (uint16_t a, uint16_t b) {
+  int distance = 0;
+  for (uint16_t diff = a ^ b ; diff ; diff >>= 3) {
+    distance += (diff & 0x07) != 0;
+  }
+  return distance;
+}
+
+/**
+  Block whose header is nearest the received header slots, comparing only
+  the slots marked in `usable`.
+
+  Return Value:
+    Block index, or -1 if no block is near enough or two are as near
+*/
+static int carouselReceiver_matchHeader (const carouselReceiver_t *receiver, const uint16_t *slots, const uint8_t *usable) {
+  int best = -1;
+  int best_distance = CAROUSEL_HEADER * 5 + 1, second_distance = CAROUSEL_HEADER * 5 + 1; // Above any distance
+  int compared = 0;
+
+  for (int i = 0 ; i < CAROUSEL_HEADER ; i++) {
+    compared += usable[i];
+  }
+  if (compared < CAROUSEL_HEADER / 2) {
+    return -1;
+  }
+  for (int index = 0 ; index < receiver->blocks ; index++) {
+    const uint16_t *expected = &receiver->headers[(size_t)index * CAROUSEL_HEADER];
+    int distance = 0;
+    for (int i = 0 ; i < CAROUSEL_HEADER ; i++) {
+      distance += usable[i] ? carousel_slotDistance(slots[i], expected[i]) : 0;
+    }
+    if (distance < best_distance) {
+      second_distance = best_distance;
+      best_distance = distance;
+      best = index;
+    } else if (distance < second_distance) {
+      second_distance = distance;
+    }
+  }
+  if ( (best_distance > CAROUSEL_HEADER_MISREADS) || (second_distance == best_distance) ) {
+    return -1;
+  }
+  return best;
+}
+
+// Both CRCs of decoded packet bytes hold
+static int carousel_valid (const uint8_t *bytes, int block_size) {
+  return (crc8_update(0, bytes, 5) == bytes[5]) &&
+         (crc8_update(0, bytes + CAROUSEL_HEADER, block_size) == bytes[CAROUSEL_HEADER + block_size]);
+}
+
+static void carouselReceiver_accept (carouselReceiver_t *receiver, int index, const uint8_t *bytes) {
+  int block_size = receiver->block_size;
+  receiver->done[index] = 1;
+  receiver->completed++;
+  memcpy(&receiver->message[(size_t)index * block_size], bytes + CAROUSEL_HEADER, block_size);
+  if (receiver->sink) {
+    long offset = (long)index * block_size;
+    int size = (receiver->length - offset < block_size) ? (int)(receiver->length - offset) : block_size;
+    receiver->sink(receiver->user, index, bytes + CAROUSEL_HEADER, size);
+  }
+}
+
+// A whole block copy has arrived in receiver->slots
+static void carouselReceiver_block (carouselReceiver_t *receiver) {
+  uint8_t bytes[PACKET_MAX];
+  int fill = receiver->fill;
+
+  if (fill > PACKET_MAX) {
+    return; // Slots past PACKET_MAX were not kept
+  }
+
+  // Until two headers agree the layout is unknown, so only clean headers count
+  if (!receiver->length) {
+    if ( (carousel_decodeSlots(receiver, receiver->slots, CAROUSEL_HEADER, bytes) < CAROUSEL_HEADER) ||
+         (crc8_update(0, bytes, 5) != bytes[5]) ) {
+      return;
+    }
+    long length = ((long)bytes[0] << 8) | bytes[1];
+    int block_size = bytes[4];
+    if ( (length < 1) || (block_size < 1) || (fill != CAROUSEL_HEADER + block_size + 1) ) {
+      return;
+    }
+    if ( (length != receiver->pending_length) || (block_size != receiver->pending_block_size) ) {
+      receiver->pending_length = length; // Wait for a second header to agree
+      receiver->pending_block_size = block_size;
+      return;
+    }
+    if (carouselReceiver_setup(receiver, length, block_size) < 0) {
+      return;
+    }
+  }
+  int block_size = receiver->block_size;
+  int span = CAROUSEL_HEADER + block_size + 1;
+
+  // Slots that line up with the block: all of them when the count is right,
+  // else those before the first misframed slot and, when only a colour or
+  // two went astray, those after the last one counted back from the end
+  uint16_t aligned[PACKET_MAX];
+  uint8_t usable[PACKET_MAX];
+  int first_bad = fill, last_bad = -1;
+  for (int i = 0 ; i < fill ; i++) {
+    if (!receiver->good[i]) {
+      first_bad = (first_bad == fill) ? i : first_bad;
+      last_bad = i;
+    }
+  }
+  memset(usable, 0x00, span);
+  memset(aligned, 0x00, span * sizeof(uint16_t));
+  if (fill == span) {
+    memcpy(aligned, receiver->slots, span * sizeof(uint16_t));
+    memcpy(usable, receiver->good, span);
+  } else {
+    for (int i = 0 ; (i < first_bad) && (i < span) ; i++) {
+      aligned[i] = receiver->slots[i];
+      usable[i] = 1;
+    }
+    if ( (last_bad >= 0) && (abs(fill - span) <= 2) ) {
+      for (int i = last_bad + 1 ; i < fill ; i++) {
+        int position = span - (fill - i);
+        if (position >= first_bad) {
+          aligned[position] = receiver->slots[i];
+          usable[position] = 1;
+        }
+      }
+    }
+  }
+
+  int index = carouselReceiver_matchHeader(receiver, aligned, usable);
+  if ( (index < 0) || receiver->done[index] ) {
+    return;
+  }
+
+  receiver->packets++;
+  if ( (fill == span) && (carousel_decodeSlots(receiver, aligned, span, bytes) == span) && carousel_valid(bytes, block_size) ) {
+    receiver->clean++;
+    carouselReceiver_accept(receiver, index, bytes); // Good on its own, whatever earlier copies said
+    return;
+  }
+
+  uint16_t *counts = &receiver->counts[(size_t)index * span * 3];
+  uint8_t *totals = &receiver->totals[(size_t)index * span];
+  uint16_t majority[PACKET_MAX];
+  int tied_bits = 0;
+  int tied_slot[3];
+  uint16_t tied_mask[3];
+
+  for (int i = 0 ; i < span ; i++) {
+    uint16_t *count = &counts[i * 3];
+    if (usable[i]) {
+      if (totals[i] == CAROUSEL_MAX_VOTES) {
+        count[0] = count[1]; // Halve every count and the total so later passes still count
+        count[1] = count[2];
+        count[2] = 0;
+        totals[i] >>= 1;
+      }
+      uint16_t carry = aligned[i];
+      for (int k = 0 ; k < 3 ; k++) { // Bit-sliced ripple add of one vote per bit
+        uint16_t next = count[k] & carry;
+        count[k] ^= carry;
+        carry = next;
+      }
+      totals[i]++;
+    }
+
+    // Ones count >= total / 2 + 1 is a strict majority; == total / 2 (even total) is a tie
+    int need = totals[i] / 2 + 1;
+    int half = totals[i] / 2;
+    uint16_t greater = 0, equal = 0x7FFF, tie = 0x7FFF;
+    for (int k = 2 ; k >= 0 ; k--) {
+      uint16_t bits = count[k];
+      if ((need >> k) & 1) {
+        equal &= bits;
+      } else {
+        greater |= equal & bits;
+        equal &= ~bits;
+      }
+      tie &= ((half >> k) & 1) ? bits : ~bits;
+    }
+    majority[i] = greater | equal;
+    tie = (totals[i] & 1) ? 0 : tie;
+
+    for ( ; tie ; tie &= tie - 1) {
+      if (tied_bits == 3) {
+        return; // Too many to try, wait for another pass
+      }
+      tied_slot[tied_bits] = i;
+      tied_mask[tied_bits++] = tie & -tie;
+    }
+  }
+
+  for (int attempt = 0 ; attempt < (1 << tied_bits) ; attempt++) {
+    uint16_t trial[PACKET_MAX];
+    memcpy(trial, majority, span * sizeof(uint16_t));
+    for (int t = 0 ; t < tied_bits ; t++) {
+      if ((attempt >> t) & 1) {
+        trial[tied_slot[t]] ^= tied_mask[t];
+      }
+    }
+    if ( (carousel_decodeSlots(receiver, trial, span, bytes) == span) && carousel_valid(bytes, block_size) ) {
+      receiver->tie_breaks += (attempt != 0);
+      carouselReceiver_accept(receiver, index, bytes);
+      return;
+    }
+  }
+}
+
+/**
+  Feed one colour; repeats are fine.
+
+  Return Value:
+    1 once every block of the message is in receiver->message, else 0
+*/
+int carouselReceiver_push (carouselReceiver_t *receiver, rgb_colour_t colour) {
+  if (colour == receiver->last_colour) {
+    return receiver->length && (receiver->completed == receiver->blocks);
+  }
+  receiver->last_colour = colour;
+
+  if (colour == DARK) {
+    if ( receiver->fill && !receiver->slot_colours ) {
+      carouselReceiver_block(receiver);
+    }
+    receiver->fill = 0;
+    receiver->slot = 0;
+    receiver->slot_colours = 0;
+  } else {
+    if (receiver->slot_colours < 5) {
+      receiver->slot |= (uint16_t)colour << (3 * receiver->slot_colours);
+    }
+    receiver->slot_colours++;
+    if ( (colour == WHITE) || (colour == YELLOW) ) {
+      if (receiver->fill < PACKET_MAX) {
+        receiver->slots[receiver->fill] = receiver->slot;
+        receiver->good[receiver->fill] = (receiver->slot_colours == 5);
+      }
+      receiver->fill++;
+      receiver->slot = 0;
+      receiver->slot_colours = 0;
+    }
+  }
+  return receiver->length && (receiver->completed == receiver->blocks);
+}
+
+
+/*
+  RESYNCHRONISATION
+
+  For receivers that join mid stream or lose a transition. Every mark
+  (WHITE/YELLOW) and every DARK is a byte boundary, so alignment can only
+  be regained there. The sync layer starts out searching for one. It then
+  needs `validate_bytes` bytes in a row with good framing and parity
+  before it locks, which rules out a misread colour posing as a mark.
+  Bytes decoded while validating are held and released at lock, so
+  nothing that decoded is lost. In lock, any bad byte drops back to
+  validating from the mark that ended it.
+
+  Buffers of colours are searched for the next boundary 8 colours at a
+  time: a mark has both bits 1 and 2 set, DARK is a zero byte.
+
+  Metrics: symbols from joining or losing lock until lock again
+  (`last_sync_symbols`, `sync_symbols_total` over `syncs`).
+*/
+
+typedef enum syncState {
+  SYNC_SEARCH,               // Waiting for a byte boundary
+  SYNC_VALIDATE,             // Aligned, checking bytes before trusting them
+  SYNC_LOCKED
+} syncState_t;
+
+#define SYNC_MAX_VALIDATE 8
+
+typedef void (*syncByteSink_t) (void *user, uint8_t byte, int returncode);
+
+typedef struct colourSync {
+  colourDecoder_t decoder;
+  syncState_t state;
+  int validate_bytes;
+  uint8_t pending[SYNC_MAX_VALIDATE];
+  int8_t pending_returncode[SYNC_MAX_VALIDATE];
+  int pending_count;
+  long symbol;               // Colours seen so far
+  long lost_at;              // Symbol where lock was last lost (0 at join)
+  // Metrics
+  uint32_t syncs;
+  uint32_t losses;
+  long sync_symbols_total;
+  long last_sync_symbols;
+  uint32_t bytes_dropped;    // Bytes decoded while validating that failed it
+} colourSync_t;
+
+void colourSync_init (colourSync_t *sync, const colourMap_t *map, paritySel_t paritySelect, int validate_bytes) {
+  memset(sync, 0x00, sizeof(colourSync_t));
+  colourDecoder_init(&sync->decoder, map, paritySelect);
+  sync->state = SYNC_SEARCH;
+  sync->validate_bytes = (validate_bytes < 1) ? 1 : (validate_bytes > SYNC_MAX_VALIDATE) ? SYNC_MAX_VALIDATE : validate_bytes;
+}
+
+/**
+  Index of the first mark or DARK in colours[start..count), or count if none.
+*/
+size_t colourSync_scan (const uint8_t *colours, size_t count, size_t start) {
+  const uint64_t ones = 0x0101010101010101ull;
+  size_t i = start;
+
+  for ( ; i + 8 <= count ; i += 8) {
+    uint64_t word;
+    memcpy(&word, colours + i, 8);
+    uint64_t marks = (word & (word >> 1)) & (ones << 1);      // Bits 1 and 2 set: YELLOW or WHITE
+    uint64_t dark = (word - ones) & ~word & (ones << 7);      // Zero bytes
+    uint64_t hits = (marks << 6) | dark;                     // Flag each hit in bit 7 of its byte
+    if (hits) {
+      return i + __builtin_ctzll(hits) / 8;
+    }
+  }
+  for ( ; i < count ; i++) {
+    if ( (colours[i] == DARK) || ((colours[i] & 0x06) == 0x06) ) {
+      return i;
+    }
+  }
+  return count;
+}
+
+static void colourSync_lose (colourSync_t *sync) {
+  sync->bytes_dropped += sync->pending_count;
+  sync->pending_count = 0;
+}
+
+/**
+  Feed one colour.
+
+  Return Value:
+    Number of bytes passed to `sink`
+*/
+int colourSync_push (colourSync_t *sync, rgb_colour_t colour, syncByteSink_t sink, void *user) {
+  sync->symbol++;
+
+  if (sync->state == SYNC_SEARCH) {
+    if ( (colour != DARK) && (colour != WHITE) && (colour != YELLOW) ) {
+      return 0;
+    }
+    sync->decoder.previous_colour = colour; // Aligned from here
+    sync->decoder.halfnibbles = 0;
+    sync->state = SYNC_VALIDATE;
+    return 0;
+  }
+
+  uint8_t output_byte;
+  int returncode = colourDecoder_push(&sync->decoder, colour, &output_byte);
+  if ( (returncode == 0) || (returncode == -1) ) {
+    return 0;
+  }
+
+  if (sync->state == SYNC_LOCKED) {
+    if (returncode < 0) {
+      sync->state = SYNC_VALIDATE; // The bad byte ended on a mark, so still aligned for the next
+      sync->lost_at = sync->symbol;
+      sync->losses++;
+    }
+    if (sink) {
+      sink(user, output_byte, returncode);
+    }
+    return 1;
+  }
+
+  // Validating
+  if (returncode < 0) {
+    colourSync_lose(sync);
+    return 0;
+  }
+  sync->pending[sync->pending_count] = output_byte;
+  sync->pending_returncode[sync->pending_count++] = returncode;
+  if (sync->pending_count < sync->validate_bytes) {
+    return 0;
+  }
+
+  int released = sync->pending_count;
+  sync->state = SYNC_LOCKED;
+  sync->syncs++;
+  sync->last_sync_symbols = sync->symbol - sync->lost_at;
+  sync->sync_symbols_total += sync->last_sync_symbols;
+  for (int i = 0 ; (i < released) && sink ; i++) {
+    sink(user, sync->pending[i], sync->pending_returncode[i]);
+  }
+  sync->pending_count = 0;
+  return released;
+}
+
+/**
+  Feed a buffer of colours, skipping straight to the next byte boundary
+  whenever alignment is being searched for.
+
+  Return Value:
+    Number of bytes passed to `sink`
+*/
+long colourSync_process (colourSync_t *sync, const uint8_t *colours, size_t count, syncByteSink_t sink, void *user) {
+  long bytes = 0;
+  for (size_t i = 0 ; i < count ; i++) {
+    if (sync->state == SYNC_SEARCH) {
+      size_t next = colourSync_scan(colours, count, i);
+      sync->symbol += next - i;
+      i = next;
+      if (i == count) {
+        break;
+      }
+    }
+    bytes += colourSync_push(sync, colours[i], sink, user);
+  }
+  return bytes;
+}
+
+
+/*
+  SELECTIVE REPEAT ARQ
+
+  For setups with a return path (a screen flashing back at the board, or
+  a second LED and sensor pair). Messages are sent as sequence numbered
+  frames (see PACKET FRAMING), each one message:
+
+    data:     [ARQ_FRAME_DATA] [seq] [message ...] [crc8]
+    feedback: [ARQ_FRAME_ACK or ARQ_FRAME_NACK] [next expected seq] [bitmap lo] [bitmap hi] [crc8]
+
+  Bit k of the bitmap says frame (next expected + 1 + k) is being held.
+  The receiver sends an ACK whenever its state changes, and a NACK when a
+  frame arrived damaged (parity, framing or CRC) or out of order. Only the
+  latest feedback is sent; a newer state replaces one not yet started.
+
+  The sender keeps up to `window` frames outstanding, AIMD style: the
+  window grows by 1/window per new ACK and halves, at most once per round
+  trip, on a loss. A NACK resends the holes it reports; a frame whose
+  round trip is well overdue is resent on timeout, or sooner if the link
+  has nothing else to carry. ARQ_GO_BACK_N instead
+  has the receiver take frames only in order and the sender repeat
+  everything outstanding, as the baseline to compare against.
+
+  Both ends step once per symbol tick, taking the colour they see and
+  returning the colour they show, so they can run in one loop or, with
+  arqLoopback_run(), as two processes joined by pipes in lockstep.
+*/
+
+#define ARQ_WINDOW_MAX 16
+#define ARQ_MESSAGE_MAX 32
+#define ARQ_FRAME_MAX (ARQ_MESSAGE_MAX + 3)
+#define ARQ_FRAME_DATA 0x01
+#define ARQ_FRAME_ACK 0x02
+#define ARQ_FRAME_NACK 0x03
+
+/* Symbol channel: a fixed delay line that loses or misreads symbols */
+
+typedef struct symbolChannel {
+  rgb_colour_t *line;
+  int delay;              // Ticks
+  int position;
+  double drop_prob;       // Symbol missed: the previous colour is seen again
+  double misread_prob;    // Symbol seen as a random wrong colour
+  rgb_colour_t last;
+  simRandom_t rng;
+} symbolChannel_t;
+
+/**
+  Return Values:
+    0 on success, -1 when out of memory
+*/
+int symbolChannel_init (symbolChannel_t *channel, int delay, double drop_prob, double misread_prob, uint64_t seed) {
+  memset(channel, 0x00, sizeof(symbolChannel_t));
+  channel->delay = (delay < 1) ? 1 : delay;
+  channel->line = calloc(channel->delay, sizeof(rgb_colour_t)); // DARK
+  channel->drop_prob = drop_prob;
+  channel->misread_prob = misread_prob;
+  channel->last = DARK;
+  simRandom_seed(&channel->rng, seed);
+  return channel->line ? 0 : -1;
+}
+
+void symbolChannel_destroy (symbolChannel_t *channel) {
+  free(channel->line);
+}
+
+// Colour in now, colour out `delay` ticks later
+rgb_colour_t symbolChannel_push (symbolChannel_t *channel, rgb_colour_t colour) {
+  rgb_colour_t out = channel->line[channel->position];
+  channel->line[channel->position] = colour;
+  channel->position = (channel->position + 1 == channel->delay) ? 0 : channel->position + 1;
+
+  if ( (channel->drop_prob > 0) && (simRandom_uniform(&channel->rng) < channel->drop_prob) ) {
+    out = channel->last;
+  } else if ( (channel->misread_prob > 0) && (simRandom_uniform(&channel->rng) < channel->misread_prob) ) {
+    out = (out + 1 + simRandom_u32(&channel->rng) % 7) & 0x07;
+  }
+  channel->last = out;
+  return out;
+}
+
+/* ARQ endpoints */
+
+typedef enum arqMode {
+  ARQ_SELECTIVE_REPEAT,
+  ARQ_GO_BACK_N
+} arqMode_t;
+
+typedef struct arqConfig {
+  arqMode_t mode;
+  const colourMap_t *map;
+  paritySel_t parity;
+  int message_len;        // Bytes per message (up to ARQ_MESSAGE_MAX), one message per frame
+  int messages;
+  int interval;           // Ticks between messages becoming ready (0 = all ready at the start)
+  int delay;              // One way channel delay, ticks
+  double drop_prob;       // Per symbol, both directions
+  double misread_prob;
+  long max_ticks;         // Give up after this many ticks
+  double symbol_period;   // Seconds per tick, for reporting
+  uint64_t seed;
+} arqConfig_t;
+
+// Message contents are a function of the seed so the receiver can check them
+void arqMessage (const arqConfig_t *config, int index, uint8_t *message) {
+  simRandom_t rng;
+  simRandom_seed(&rng, config->seed * 7919u + index);
+  for (int i = 0 ; i < config->message_len ; i++) {
+    message[i] = simRandom_u32(&rng);
+  }
+}
+
+// Tracks which unwrapped sequence number an 8bit one refers to, given one known nearby
+static int arq_unwrap (int near, uint8_t seq) {
+  return near + (int8_t)(seq - (uint8_t)near);
+}
+
+typedef struct arqSender {
+  const arqConfig_t *config;
+  colourEncoder_t encoder;
+  packetReceiver_t receiver;
+  rgb_colour_t queue[ARQ_FRAME_MAX * 5 + 1];
+  int queue_length;
+  int queue_position;
+  int base;               // Oldest message not yet acknowledged
+  int next;               // Next message never sent
+  // Per outstanding frame, by message % ARQ_WINDOW_MAX
+  uint8_t acked[ARQ_WINDOW_MAX];
+  uint8_t resend[ARQ_WINDOW_MAX];
+  uint8_t retransmitted[ARQ_WINDOW_MAX];
+  long sent_tick[ARQ_WINDOW_MAX];   // When the last copy finished going out
+  double window;          // Frames
+  double srtt;            // Smoothed round trip from end of frame to feedback, ticks
+  long last_decrease;
+  long tick;
+  // Statistics
+  uint32_t frames_sent;
+  uint32_t retransmissions;
+  uint32_t timeouts;
+  uint32_t nacks;
+} arqSender_t;
+
+void arqSender_init (arqSender_t *sender, const arqConfig_t *config) {
+  memset(sender, 0x00, sizeof(arqSender_t));
+  sender->config = config;
+  colourEncoder_init(&sender->encoder, config->map, config->parity);
+  packetReceiver_init(&sender->receiver, config->map, config->parity);
+  sender->window = 2;
+  sender->srtt = 2 * config->delay + 5 * 5 + 1; // Until measured: both delays and a feedback frame
+  sender->last_decrease = -1000000;
+}
+
+int arqSender_done (const arqSender_t *sender) {
+  return sender->base >= sender->config->messages;
+}
+
+static void arqSender_loss (arqSender_t *sender) {
+  if (sender->tick - sender->last_decrease > sender->srtt) {
+    sender->window = (sender->window / 2 < 1) ? 1 : sender->window / 2;
+    sender->last_decrease = sender->tick;
+  }
+}
+
+static void arqSender_resend (arqSender_t *sender, int message) {
+  int slot = message % ARQ_WINDOW_MAX;
+  if (sender->acked[slot] || sender->resend[slot]) {
+    return;
+  }
+  if (sender->config->mode == ARQ_GO_BACK_N) {
+    for (int i = sender->base ; i < sender->next ; i++) {
+      if (!sender->acked[i % ARQ_WINDOW_MAX]) {
+        sender->resend[i % ARQ_WINDOW_MAX] = 1;
+      }
+    }
+  } else {
+    sender->resend[slot] = 1;
+  }
+  arqSender_loss(sender);
+}
+
+static void arqSender_feedback (arqSender_t *sender, const uint8_t *frame) {
+  int expected = arq_unwrap(sender->base, frame[1]);
+  uint16_t bitmap = frame[2] | (frame[3] << 8);
+  int highest = -1;
+
+  if ( (expected < sender->base) || (expected > sender->next) ) {
+    return; // Stale
+  }
+  for (int i = sender->base ; i < sender->next ; i++) {
+    int slot = i % ARQ_WINDOW_MAX;
+    int held = (i < expected) || ( (sender->config->mode == ARQ_SELECTIVE_REPEAT) && (i > expected) && (bitmap >> (i - expected - 1) & 1) );
+    if (!held) {
+      continue;
+    }
+    highest = i;
+    if (sender->acked[slot]) {
+      continue;
+    }
+    sender->acked[slot] = 1;
+    sender->resend[slot] = 0;
+    if (!sender->retransmitted[slot]) {
+      sender->srtt += (sender->tick - sender->sent_tick[slot] - sender->srtt) / 8;
+    }
+    sender->window += 1 / sender->window;
+    if (sender->window > ARQ_WINDOW_MAX) {
+      sender->window = ARQ_WINDOW_MAX;
+    }
+  }
+  while ( (sender->base < sender->next) && sender->acked[sender->base % ARQ_WINDOW_MAX] ) {
+    sender->base++;
+  }
+
+  if (frame[0] != ARQ_FRAME_NACK) {
+    return;
+  }
+  sender->nacks++;
+  if (highest > expected) {
+    // Holes below a frame that got through, or that had time to get through, are lost
+    for (int i = expected ; i < highest ; i++) {
+      long sent = sender->sent_tick[i % ARQ_WINDOW_MAX];
+      if ( (sent < sender->sent_tick[highest % ARQ_WINDOW_MAX]) || (sender->tick - sent > sender->srtt) ) {
+        arqSender_resend(sender, i);
+      }
+    }
+  } else if ( (expected < sender->next) && (sender->tick - sender->sent_tick[expected % ARQ_WINDOW_MAX] > sender->srtt / 2) ) {
+    arqSender_resend(sender, expected); // Damaged, and could have been seen by now
+  }
+}
+
+static void arqSender_queueFrame (arqSender_t *sender, int message) {
+  uint8_t frame[ARQ_FRAME_MAX];
+  int length = sender->config->message_len + 3;
+  int slot = message % ARQ_WINDOW_MAX;
+
+  frame[0] = ARQ_FRAME_DATA;
+  frame[1] = message & 0xFF;
+  arqMessage(sender->config, message, frame + 2);
+  frame[length - 1] = crc8_update(0, frame, length - 1);
+  sender->queue_length = packetEncode_colours(&sender->encoder, frame, length, sender->queue);
+  sender->queue_position = 0;
+  sender->sent_tick[slot] = sender->tick + sender->queue_length;
+  sender->frames_sent++;
+}
+
+/**
+  One tick: `seen` is the colour arriving on the back channel.
+
+  Return Value:
+    Colour to show this tick
+*/
+rgb_colour_t arqSender_tick (arqSender_t *sender, rgb_colour_t seen) {
+  const arqConfig_t *config = sender->config;
+  int length = packetReceiver_push(&sender->receiver, seen);
+
+  if ( (length == 5) && (crc8_update(0, sender->receiver.packet, 4) == sender->receiver.packet[4]) &&
+       ( (sender->receiver.packet[0] == ARQ_FRAME_ACK) || (sender->receiver.packet[0] == ARQ_FRAME_NACK) ) ) {
+    arqSender_feedback(sender, sender->receiver.packet);
+  }
+
+  // Overdue frames; the estimate allows for feedback queued behind other feedback
+  for (int i = sender->base ; i < sender->next ; i++) {
+    int slot = i % ARQ_WINDOW_MAX;
+    if ( !sender->acked[slot] && !sender->resend[slot] && (sender->tick - sender->sent_tick[slot] > 2 * sender->srtt + 5 * 5 + 1) ) {
+      sender->timeouts++;
+      arqSender_resend(sender, i);
+    }
+  }
+
+  if (sender->queue_position == sender->queue_length) {
+    int message = -1;
+    for (int i = sender->base ; i < sender->next ; i++) {
+      if (sender->resend[i % ARQ_WINDOW_MAX]) {
+        message = i;
+        break;
+      }
+    }
+    if (message >= 0) {
+      int slot = message % ARQ_WINDOW_MAX;
+      sender->resend[slot] = 0;
+      sender->retransmitted[slot] = 1;
+      sender->retransmissions++;
+      arqSender_queueFrame(sender, message);
+    } else if ( (sender->next < config->messages) && (sender->next - sender->base < (int)sender->window) &&
+                (sender->tick >= (long)sender->next * config->interval) ) {
+      int slot = sender->next % ARQ_WINDOW_MAX;
+      sender->acked[slot] = 0;
+      sender->resend[slot] = 0;
+      sender->retransmitted[slot] = 0;
+      arqSender_queueFrame(sender, sender->next++);
+    } else if ( (sender->base < sender->next) && (sender->tick - sender->sent_tick[sender->base % ARQ_WINDOW_MAX] > sender->srtt + sender->srtt / 4) ) {
+      // Nothing else to send and the oldest frame is overdue: repeat it now rather than idle until the timeout
+      int slot = sender->base % ARQ_WINDOW_MAX;
+      sender->retransmitted[slot] = 1;
+      sender->retransmissions++;
+      arqSender_queueFrame(sender, sender->base);
+    }
+  }
+
+  sender->tick++;
+  if (sender->queue_position < sender->queue_length) {
+    return sender->queue[sender->queue_position++];
+  }
+  return DARK;
+}
+
+typedef struct arqReceiver {
+  const arqConfig_t *config;
+  colourEncoder_t encoder;
+  packetReceiver_t receiver;
+  rgb_colour_t queue[5 * 5 + 1];
+  int queue_length;
+  int queue_position;
+  int expected;           // Next message to deliver
+  uint8_t held[ARQ_WINDOW_MAX];
+  uint8_t buffer[ARQ_WINDOW_MAX][ARQ_MESSAGE_MAX];
+  int feedback;           // 0, or the feedback frame type waiting to go out
+  long tick;
+  // Statistics
+  uint32_t delivered;
+  uint32_t corrupted;     // Delivered but not what was sent
+  uint32_t damaged;       // Frames dropped for parity, framing or CRC
+  uint32_t duplicates;
+  uint64_t latency_sum;   // Ticks from a message being ready to its delivery
+  long latency_max;
+} arqReceiver_t;
+
+void arqReceiver_init (arqReceiver_t *receiver, const arqConfig_t *config) {
+  memset(receiver, 0x00, sizeof(arqReceiver_t));
+  receiver->config = config;
+  colourEncoder_init(&receiver->encoder, config->map, config->parity);
+  packetReceiver_init(&receiver->receiver, config->map, config->parity);
+}
+
+static void arqReceiver_data (arqReceiver_t *receiver, const uint8_t *frame) {
+  const arqConfig_t *config = receiver->config;
+  int message = arq_unwrap(receiver->expected, frame[1]);
+
+  if (message < receiver->expected) {
+    receiver->duplicates++;
+    receiver->feedback = receiver->feedback ? receiver->feedback : ARQ_FRAME_ACK;
+    return;
+  }
+  if (message >= receiver->expected + ARQ_WINDOW_MAX) {
+    return;
+  }
+  if ( (message > receiver->expected) && (config->mode == ARQ_GO_BACK_N) ) {
+    receiver->feedback = ARQ_FRAME_NACK; // Out of order: discarded
+    return;
+  }
+
+  int slot = message % ARQ_WINDOW_MAX;
+  if (receiver->held[slot]) {
+    receiver->duplicates++;
+  }
+  receiver->held[slot] = 1;
+  memcpy(receiver->buffer[slot], frame + 2, config->message_len);
+  receiver->feedback = (message > receiver->expected) ? ARQ_FRAME_NACK : (receiver->feedback ? receiver->feedback : ARQ_FRAME_ACK);
+
+  while (receiver->held[receiver->expected % ARQ_WINDOW_MAX]) {
+    uint8_t sent[ARQ_MESSAGE_MAX];
+    slot = receiver->expected % ARQ_WINDOW_MAX;
+    arqMessage(config, receiver->expected, sent);
+    if (memcmp(sent, receiver->buffer[slot], config->message_len) != 0) {
+      receiver->corrupted++;
+    }
+    long latency = receiver->tick - (long)receiver->expected * config->interval;
+    receiver->latency_sum += latency;
+    receiver->latency_max = (latency > receiver->latency_max) ? latency : receiver->latency_max;
+    receiver->delivered++;
+    receiver->held[slot] = 0;
+    receiver->expected++;
+  }
+}
+
+/**
+  One tick: `seen` is the colour arriving on the forward channel.
+
+  Return Value:
+    Colour to show on the back channel this tick
+*/
+rgb_colour_t arqReceiver_tick (arqReceiver_t *receiver, rgb_colour_t seen) {
+  const arqConfig_t *config = receiver->config;
+  uint32_t dropped = receiver->receiver.dropped;
+  int length = packetReceiver_push(&receiver->receiver, seen);
+
+  if (length > 0) {
+    const uint8_t *frame = receiver->receiver.packet;
+    if ( (length == config->message_len + 3) && (frame[0] == ARQ_FRAME_DATA) && (crc8_update(0, frame, length - 1) == frame[length - 1]) ) {
+      arqReceiver_data(receiver, frame);
+    } else {
+      receiver->damaged++;
+      receiver->feedback = ARQ_FRAME_NACK;
+    }
+  } else if (receiver->receiver.dropped != dropped) {
+    receiver->damaged++;
+    receiver->feedback = ARQ_FRAME_NACK;
+  }
+
+  if ( (receiver->queue_position == receiver->queue_length) && receiver->feedback ) {
+    uint8_t frame[5];
+    uint16_t bitmap = 0;
+    for (int k = 0 ; k < ARQ_WINDOW_MAX - 1 ; k++) {
+      if (receiver->held[(receiver->expected + 1 + k) % ARQ_WINDOW_MAX]) {
+        bitmap |= 1 << k;
+      }
+    }
+    frame[0] = receiver->feedback;
+    frame[1] = receiver->expected & 0xFF;
+    frame[2] = bitmap & 0xFF;
+    frame[3] = bitmap >> 8;
+    frame[4] = crc8_update(0, frame, 4);
+    receiver->queue_length = packetEncode_colours(&receiver->encoder, frame, 5, receiver->queue);
+    receiver->queue_position = 0;
+    receiver->feedback = 0;
+  }
+
+  receiver->tick++;
+  if (receiver->queue_position < receiver->queue_length) {
+    return receiver->queue[receiver->queue_position++];
+  }
+  return DARK;
+}
+
+/* Loopback harness */
+
+typedef struct arqResult {
+  long ticks;
+  uint32_t frames_sent;
+  uint32_t retransmissions;
+  uint32_t timeouts;
+  uint32_t nacks;
+  uint32_t delivered;
+  uint32_t corrupted;
+  uint32_t damaged;
+  uint64_t latency_sum;
+  long latency_max;
+  double goodput;         // Correct message bytes per second
+  double mean_latency;    // Seconds
+} arqResult_t;
+
+typedef struct arqTick {
+  uint8_t colour;
+  uint8_t done;           // Sender finished: the receiver stops after this tick
+} arqTick_t;
+
+static void arqResult_receiver (arqResult_t *result, const arqReceiver_t *receiver) {
+  result->delivered = receiver->delivered;
+  result->corrupted = receiver->corrupted;
+  result->damaged = receiver->damaged;
+  result->latency_sum = receiver->latency_sum;
+  result->latency_max = receiver->latency_max;
+}
+
+// Receiver side of the loopback, in the child process
+static void arqLoopback_child (const arqConfig_t *config, int from_sender, int to_sender, int to_parent) {
+  arqReceiver_t receiver;
+  symbolChannel_t back;
+  arqResult_t result;
+  arqTick_t record = { DARK, 0 };
+  rgb_colour_t seen = DARK;
+
+  memset(&result, 0x00, sizeof(arqResult_t));
+  arqReceiver_init(&receiver, config);
+  if (symbolChannel_init(&back, config->delay, config->drop_prob, config->misread_prob, config->seed * 2 + 1) == 0) {
+    for (;;) {
+      record.colour = symbolChannel_push(&back, arqReceiver_tick(&receiver, seen));
+      if ( (write(to_sender, &record, sizeof(record)) != sizeof(record)) ||
+           (read(from_sender, &record, sizeof(record)) != sizeof(record)) || record.done ) {
+        break;
+      }
+      seen = record.colour;
+      record.done = 0;
+    }
+    symbolChannel_destroy(&back);
+  }
+  arqResult_receiver(&result, &receiver);
+  if (write(to_parent, &result, sizeof(result)) != sizeof(result)) {
+    _exit(1);
+  }
+  _exit(0);
+}
+
+/**
+  Run a transfer between an arqSender and an arqReceiver, each in its own
+  process, exchanging one colour per tick over pipes through a
+  symbolChannel each way. Falls back to one process if it cannot fork.
+
+  Return Values:
+    0 when the transfer completed, 1 when it ran out of ticks, -1 on error
+*/
+int arqLoopback_run (const arqConfig_t *config, arqResult_t *result) {
+  arqSender_t sender;
+  arqReceiver_t receiver;
+  symbolChannel_t forward, back;
+  int to_receiver[2], to_sender[2], results[2];
+  pid_t pid = -1;
+
+  memset(result, 0x00, sizeof(arqResult_t));
+  if ( (config->message_len < 1) || (config->message_len > ARQ_MESSAGE_MAX) ) {
+    return -1;
+  }
+  if (symbolChannel_init(&forward, config->delay, config->drop_prob, config->misread_prob, config->seed * 2) < 0) {
+    return -1;
+  }
+  arqSender_init(&sender, config);
+
+  if ( (pipe(to_receiver) == 0) ) {
+    if (pipe(to_sender) == 0) {
+      if (pipe(results) == 0) {
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+          close(to_receiver[1]);
+          close(to_sender[0]);
+          close(results[0]);
+          arqLoopback_child(config, to_receiver[0], to_sender[1], results[1]);
+        }
+        close(results[1]);
+        if (pid < 0) {
+          close(results[0]);
+        }
+      }
+      close(to_sender[1]);
+      if (pid < 0) {
+        close(to_sender[0]);
+      }
+    }
+    close(to_receiver[0]);
+    if (pid < 0) {
+      close(to_receiver[1]);
+    }
+  }
+
+  int returncode = 0;
+  arqTick_t record = { DARK, 0 };
+  rgb_colour_t seen = DARK;
+  if (pid > 0) {
+    for (;;) {
+      record.colour = symbolChannel_push(&forward, arqSender_tick(&sender, seen));
+      record.done = arqSender_done(&sender) || (sender.tick >= config->max_ticks);
+      if (write(to_receiver[1], &record, sizeof(record)) != sizeof(record)) {
+        returncode = -1;
+        break;
+      }
+      if (record.done) {
+        break;
+      }
+      if (read(to_sender[0], &record, sizeof(record)) != sizeof(record)) {
+        returncode = -1;
+        break;
+      }
+      seen = record.colour;
+    }
+    close(to_receiver[1]);
+    if ( (read(results[0], result, sizeof(arqResult_t)) != sizeof(arqResult_t)) ) {
+      returncode = -1;
+    }
+    close(to_sender[0]);
+    close(results[0]);
+    waitpid(pid, NULL, 0);
+  } else {
+    // No second process: step both ends here
+    rgb_colour_t seen_back = DARK;
+    arqReceiver_init(&receiver, config);
+    if (symbolChannel_init(&back, config->delay, config->drop_prob, config->misread_prob, config->seed * 2 + 1) < 0) {
+      symbolChannel_destroy(&forward);
+      return -1;
+    }
+    for (;;) {
+      rgb_colour_t shown = symbolChannel_push(&forward, arqSender_tick(&sender, seen_back));
+      rgb_colour_t shown_back = symbolChannel_push(&back, arqReceiver_tick(&receiver, seen));
+      if (arqSender_done(&sender) || (sender.tick >= config->max_ticks)) {
+        break;
+      }
+      seen = shown;
+      seen_back = shown_back;
+    }
+    symbolChannel_destroy(&back);
+    arqResult_receiver(result, &receiver);
+  }
+  symbolChannel_destroy(&forward);
+
+  result->ticks = sender.tick;
+  result->frames_sent = sender.frames_sent;
+  result->retransmissions = sender.retransmissions;
+  result->timeouts = sender.timeouts;
+  result->nacks = sender.nacks;
+  double seconds = result->ticks * config->symbol_period;
+  result->goodput = seconds ? (double)(result->delivered - result->corrupted) * config->message_len / seconds : 0;
+  result->mean_latency = result->delivered ? (double)result->latency_sum / result->delivered * config->symbol_period : 0;
+  if (returncode < 0) {
+    return -1;
+  }
+  return arqSender_done(&sender) ? 0 : 1;
+}
+
+
+/*
+  ADAPTIVE CODING
+
+  Picks how much protection frames carry from the error rate the receiver
+  measures, instead of one fixed setting for every deployment. The
+  operating points, cheapest first:
+
+    CODE_PARITY   [seq] [payload]                          byte parity only
+    CODE_CRC      [seq] [payload] [crc8]
+    CODE_FEC_n    [seq] [payload] [group parity ...] [crc8]
+
+  Byte parity costs no symbols (every byte ends in a mark anyway, parity
+  just picks which one), so "no check" is not worth a mode of its own.
+  For CODE_FEC_n, byte j of [seq][payload] belongs to group j % groups,
+  with groups = ceil(bytes / n), and each group gets an XOR parity byte.
+  A byte that failed parity or framing is an erasure, and one erasure per
+  group is rebuilt before the CRC check. Neighbouring bytes are in
+  different groups, so a short burst costs one byte of several groups.
+
+  The sender announces a new mode in band with a control frame
+
+    [CODE_CONTROL] [mode] [~mode] [crc8]
+
+  sent ahead of every data frame until the receiver confirms the mode.
+  The receiver reports back now and then:
+
+    [CODE_REPORT] [mode] [slots:16] [erased:16] [bad frames] [crc8]
+
+  where bad frames had no erasures but failed the CRC, i.e. errors byte
+  parity missed. The controller keeps slot weighted averages of both
+  rates and picks the mode with the best expected payload bytes per
+  symbol. CODE_PARITY is only allowed while the chance of accepting a bad
+  frame stays under `max_undetected`; parity misses about half of all
+  misreads, so this is estimated from the erasure rate when no CRC is
+  running. A change must promise `hysteresis` better to be taken.
+*/
+
+#define CODE_PAYLOAD_MAX 64
+#define CODE_FRAME_MAX (2 * (CODE_PAYLOAD_MAX + 1) + 1)
+#define CODE_CONTROL 0xC5
+#define CODE_REPORT 0xE7
+#define CODE_WINDOW_SLOTS 400    // Slots the averages mostly reflect
+
+typedef enum codeMode {
+  CODE_PARITY,
+  CODE_CRC,
+  CODE_FEC_16,
+  CODE_FEC_8,
+  CODE_FEC_4,
+  CODE_FEC_2,
+  CODE_MODES
+} codeMode_t;
+
+static const int codeMode_group[CODE_MODES] = { 0, 0, 16, 8, 4, 2 };
+
+static int codeMode_groups (codeMode_t mode, int payload_len) {
+  int group = codeMode_group[mode];
+  return group ? (payload_len + 1 + group - 1) / group : 0;
+}
+
+int codeFrame_length (codeMode_t mode, int payload_len) {
+  return 1 + payload_len + codeMode_groups(mode, payload_len) + ( (mode == CODE_PARITY) ? 0 : 1 );
+}
+
+/**
+  Return Value:
+    Frame length
+*/
+int codeFrame_encode (codeMode_t mode, uint8_t seq, const uint8_t *payload, int payload_len, uint8_t *frame) {
+  int data = 1 + payload_len;
+  int groups = codeMode_groups(mode, payload_len);
+  int length = data;
+
+  frame[0] = seq;
+  memcpy(frame + 1, payload, payload_len);
+  if (groups) {
+    memset(frame + data, 0x00, groups);
+    for (int j = 0 ; j < data ; j++) {
+      frame[data + j % groups] ^= frame[j];
+    }
+    length += groups;
+  }
+  if (mode != CODE_PARITY) {
+    frame[length] = crc8_update(0, frame, length);
+    length++;
+  }
+  return length;
+}
+
+/**
+  Decode a frame in place; `ok` flags the slots that arrived without
+  parity or framing errors.
+
+  Return Values:
+    1 when [seq][payload] in frame is good
+    0 when erasures could not be rebuilt
+   -1 when the CRC failed with no erasures left (errors parity missed)
+*/
+int codeFrame_decode (codeMode_t mode, uint8_t *frame, uint8_t *ok, int payload_len) {
+  int data = 1 + payload_len;
+  int groups = codeMode_groups(mode, payload_len);
+  int length = codeFrame_length(mode, payload_len);
+
+  for (int g = 0 ; g < groups ; g++) {
+    int erased = 0, missing = 0;
+    uint8_t parity = frame[data + g];
+    for (int j = g ; j < data ; j += groups) {
+      if (!ok[j]) {
+        erased++;
+        missing = j;
+      } else {
+        parity ^= frame[j];
+      }
+    }
+    if ( (erased == 1) && ok[data + g] ) {
+      frame[missing] = parity;
+      ok[missing] = 1;
+    }
+  }
+  for (int j = 0 ; j < data ; j++) {
+    if (!ok[j]) {
+      return 0;
+    }
+  }
+  if (mode == CODE_PARITY) {
+    return 1;
+  }
+  if (!ok[length - 1]) {
+    return 0;
+  }
+  if (groups) {
+    // The CRC covers the group parity too, which may itself have been erased
+    memset(frame + data, 0x00, groups);
+    for (int j = 0 ; j < data ; j++) {
+      frame[data + j % groups] ^= frame[j];
+    }
+  }
+  return (crc8_update(0, frame, length - 1) == frame[length - 1]) ? 1 : -1;
+}
+
+typedef struct codeController {
+  codeMode_t mode;
+  int payload_len;
+  double erasure_rate;      // Per slot
+  double error_rate;        // Per slot, errors byte parity let through
+  int error_measured;
+  double max_undetected;    // Accepted chance of a bad frame getting through in CODE_PARITY
+  double hysteresis;        // Fraction better a new mode must be
+  uint32_t switches;
+} codeController_t;
+
+void codeController_init (codeController_t *controller, int payload_len, codeMode_t mode) {
+  memset(controller, 0x00, sizeof(codeController_t));
+  controller->mode = mode;
+  controller->payload_len = payload_len;
+  controller->max_undetected = 0.001;
+  controller->hysteresis = 0.05;
+}
+
+// Payload bytes per symbol expected from `mode` at erasure rate p and missed error rate q
+double codeMode_expected (codeMode_t mode, int payload_len, double p, double q) {
+  int length = codeFrame_length(mode, payload_len);
+  int groups = codeMode_groups(mode, payload_len);
+  double success = pow(1 - q, length);
+
+  if (!groups) {
+    success *= pow(1 - p, length);
+  } else {
+    int data = 1 + payload_len;
+    for (int g = 0 ; g < groups ; g++) {
+      int n = (data - g + groups - 1) / groups + 1; // Group members and their parity byte
+      success *= pow(1 - p, n) + n * p * pow(1 - p, n - 1);
+    }
+    success *= 1 - p; // CRC byte
+  }
+  return success * payload_len / (5.0 * length + 1);
+}
+
+// Counts since the last report, from the receiver in mode `receiver_mode`
+void codeController_report (codeController_t *controller, codeMode_t receiver_mode, int slots, int erased, int bad_frames) {
+  if (slots <= 0) {
+    return;
+  }
+  double weight = (double)slots / (slots + CODE_WINDOW_SLOTS);
+  controller->erasure_rate += ((double)erased / slots - controller->erasure_rate) * weight;
+  if (receiver_mode != CODE_PARITY) {
+    // A bad frame had at least one missed error among its slots
+    controller->error_rate += ((double)bad_frames / slots - controller->error_rate) * weight;
+    controller->error_measured = 1;
+  }
+}
+
+/**
+  Return Value:
+    Mode to use for the next frame
+*/
+codeMode_t codeController_choose (codeController_t *controller) {
+  double p = controller->erasure_rate;
+  double q = controller->error_measured ? controller->error_rate : 0;
+  double missed = (q > p / 2) ? q : p / 2;
+  int length = codeFrame_length(CODE_PARITY, controller->payload_len);
+  codeMode_t best = controller->mode;
+  double best_rate = 0;
+
+  for (int mode = CODE_PARITY ; mode < CODE_MODES ; mode++) {
+    if ( (mode == CODE_PARITY) && (1 - pow(1 - missed, length) > controller->max_undetected) ) {
+      continue;
+    }
+    double rate = codeMode_expected(mode, controller->payload_len, p, q);
+    if (mode == (int)controller->mode) {
+      rate *= 1 + controller->hysteresis;
+    }
+    if (rate > best_rate) {
+      best_rate = rate;
+      best = mode;
+    }
+  }
+  if (best != controller->mode) {
+    controller->mode = best;
+    controller->switches++;
+  }
+  return best;
+}
+
+/* Link endpoints */
+
+typedef struct codeSender {
+  codeController_t controller;
+  int adaptive;             // 0: stay in the initial mode
+  int payload_len;
+  colourEncoder_t encoder;
+  packetReceiver_t receiver;
+  rgb_colour_t queue[(CODE_FRAME_MAX + 4) * 5 + 2];
+  int queue_length;
+  int queue_position;
+  codeMode_t confirmed;     // Mode the receiver last reported
+  uint32_t seq;
+  uint64_t seed;
+  uint32_t control_frames;
+} codeSender_t;
+
+typedef struct codeReceiver {
+  codeMode_t mode;
+  int payload_len;
+  uint64_t seed;
+  colourDecoder_t decoder;
+  uint8_t frame[CODE_FRAME_MAX + 1];
+  uint8_t ok[CODE_FRAME_MAX + 1];
+  int length;
+  uint32_t expected;        // Unwrapped sequence number expected next
+  // Counts for the next report
+  int slots;
+  int erased;
+  int bad_frames;
+  int mode_changed;
+  colourEncoder_t encoder;
+  rgb_colour_t queue[8 * 5 + 1];
+  int queue_length;
+  int queue_position;
+  // Statistics
+  uint32_t frames;          // Data frames accepted
+  uint32_t lost;            // Data frames dropped
+  uint32_t undetected;      // Accepted but wrong
+} codeReceiver_t;
+
+// Payload of frame `seq`, a function of the seed so the receiver can check it
+void codePayload (uint64_t seed, uint32_t seq, uint8_t *payload, int payload_len) {
+  simRandom_t rng;
+  simRandom_seed(&rng, seed * 6151u + seq);
+  for (int i = 0 ; i < payload_len ; i++) {
+    payload[i] = simRandom_u32(&rng);
+  }
+}
+
+void codeSender_init (codeSender_t *sender, int payload_len, codeMode_t mode, int adaptive, uint64_t seed) {
+  memset(sender, 0x00, sizeof(codeSender_t));
+  codeController_init(&sender->controller, payload_len, mode);
+  sender->adaptive = adaptive;
+  sender->payload_len = payload_len;
+  sender->confirmed = mode;
+  sender->seed = seed;
+  colourEncoder_init(&sender->encoder, NULL, EVEN_PARITY);
+  packetReceiver_init(&sender->receiver, NULL, EVEN_PARITY);
+}
+
+rgb_colour_t codeSender_tick (codeSender_t *sender, rgb_colour_t seen) {
+  int length = packetReceiver_push(&sender->receiver, seen);
+  const uint8_t *report = sender->receiver.packet;
+
+  if ( (length == 8) && (report[0] == CODE_REPORT) && (report[1] < CODE_MODES) && (crc8_update(0, report, 7) == report[7]) ) {
+    sender->confirmed = report[1];
+    codeController_report(&sender->controller, report[1], (report[2] << 8) | report[3], (report[4] << 8) | report[5], report[6]);
+  }
+
+  if (sender->queue_position == sender->queue_length) {
+    uint8_t frame[CODE_FRAME_MAX];
+    uint8_t payload[CODE_PAYLOAD_MAX];
+    codeMode_t mode = sender->adaptive ? codeController_choose(&sender->controller) : sender->controller.mode;
+    int count = 0;
+
+    if (mode != sender->confirmed) {
+      uint8_t control[4] = { CODE_CONTROL, mode, mode ^ 0xFF, 0 };
+      control[3] = crc8_update(0, control, 3);
+      count += packetEncode_colours(&sender->encoder, control, 4, sender->queue);
+      sender->control_frames++;
+    }
+    codePayload(sender->seed, sender->seq, payload, sender->payload_len);
+    length = codeFrame_encode(mode, sender->seq & 0xFF, payload, sender->payload_len, frame);
+    count += packetEncode_colours(&sender->encoder, frame, length, sender->queue + count);
+    sender->seq++;
+    sender->queue_length = count;
+    sender->queue_position = 0;
+  }
+  return sender->queue[sender->queue_position++];
+}
+
+void codeReceiver_init (codeReceiver_t *receiver, int payload_len, codeMode_t mode, uint64_t seed) {
+  memset(receiver, 0x00, sizeof(codeReceiver_t));
+  receiver->mode = mode;
+  receiver->payload_len = payload_len;
+  receiver->seed = seed;
+  colourDecoder_init(&receiver->decoder, NULL, EVEN_PARITY);
+  colourEncoder_init(&receiver->encoder, NULL, EVEN_PARITY);
+}
+
+static void codeReceiver_frame (codeReceiver_t *receiver) {
+  uint8_t *frame = receiver->frame;
+  int length = receiver->length;
+  int good = 1;
+
+  for (int i = 0 ; i < length ; i++) {
+    good &= receiver->ok[i];
+  }
+  receiver->slots += length;
+  receiver->erased += length;
+  for (int i = 0 ; i < length ; i++) {
+    receiver->erased -= receiver->ok[i];
+  }
+
+  if ( good && (length == 4) && (frame[0] == CODE_CONTROL) && (frame[1] < CODE_MODES) &&
+       (frame[2] == (frame[1] ^ 0xFF)) && (crc8_update(0, frame, 3) == frame[3]) ) {
+    receiver->mode_changed |= (receiver->mode != frame[1]);
+    receiver->mode = frame[1];
+    return;
+  }
+  if (length != codeFrame_length(receiver->mode, receiver->payload_len)) {
+    receiver->lost++;
+    return;
+  }
+
+  int returncode = codeFrame_decode(receiver->mode, frame, receiver->ok, receiver->payload_len);
+  if (returncode <= 0) {
+    receiver->bad_frames += (returncode < 0);
+    receiver->lost++;
+    return;
+  }
+
+  uint8_t payload[CODE_PAYLOAD_MAX];
+  uint32_t seq = receiver->expected + (int8_t)(frame[0] - (uint8_t)receiver->expected);
+  codePayload(receiver->seed, seq, payload, receiver->payload_len);
+  if (memcmp(payload, frame + 1, receiver->payload_len) != 0) {
+    receiver->undetected++;
+  } else {
+    receiver->frames++;
+    receiver->expected = seq + 1;
+  }
+}
+
+rgb_colour_t codeReceiver_tick (codeReceiver_t *receiver, rgb_colour_t seen) {
+  uint8_t output_byte;
+  uint32_t framing_errors = receiver->decoder.framing_errors;
+  int returncode = colourDecoder_push(&receiver->decoder, seen, &output_byte);
+
+  if ( (returncode != 0) && (returncode != -1) ) {
+    if (receiver->length <= CODE_FRAME_MAX) {
+      receiver->frame[receiver->length] = output_byte;
+      receiver->ok[receiver->length] = (returncode > 0);
+      receiver->length++;
+    }
+  } else if (returncode == -1) {
+    if ( (receiver->decoder.framing_errors != framing_errors) && (receiver->length <= CODE_FRAME_MAX) ) {
+      receiver->ok[receiver->length++] = 0; // Last byte cut off
+    }
+    if (receiver->length) {
+      codeReceiver_frame(receiver);
+    }
+    receiver->length = 0;
+  }
+
+  if ( (receiver->queue_position == receiver->queue_length) && (receiver->mode_changed || (receiver->slots >= 64)) ) {
+    int slots = (receiver->slots > 0xFFFF) ? 0xFFFF : receiver->slots;
+    int erased = (receiver->erased > slots) ? slots : receiver->erased;
+    uint8_t report[8] = { CODE_REPORT, receiver->mode, slots >> 8, slots & 0xFF, erased >> 8, erased & 0xFF,
+                          (receiver->bad_frames > 0xFF) ? 0xFF : receiver->bad_frames, 0 };
+    report[7] = crc8_update(0, report, 7);
+    receiver->queue_length = packetEncode_colours(&receiver->encoder, report, 8, receiver->queue);
+    receiver->queue_position = 0;
+    receiver->slots = 0;
+    receiver->erased = 0;
+    receiver->bad_frames = 0;
+    receiver->mode_changed = 0;
+  }
+  if (receiver->queue_position < receiver->queue_length) {
+    return receiver->queue[receiver->queue_position++];
+  }
+  return DARK;
+}
+
+/* Link simulation */
+
+typedef struct codePhase {
+  long ticks;
+  double drop_prob;
+  double misread_prob;
+} codePhase_t;
+
+typedef struct codeLinkConfig {
+  int payload_len;          // 8 to CODE_PAYLOAD_MAX
+  codeMode_t mode;          // Fixed mode, or where the controller starts
+  int adaptive;
+  const codePhase_t *phases;
+  int phase_count;
+  int delay;                // Ticks each way
+  double symbol_period;
+  uint64_t seed;
+} codeLinkConfig_t;
+
+typedef struct codeLinkResult {
+  uint32_t frames;
+  uint32_t lost;
+  uint32_t undetected;
+  uint32_t switches;
+  uint32_t control_frames;
+  double goodput;           // Payload bytes of good frames per second
+} codeLinkResult_t;
+
+/**
+  Stream frames one way through the phases, with reports coming back,
+  stepping both ends once per tick.
+
+  Return Values:
+    0 on success, -1 on bad configuration or out of memory
+*/
+int codeLink_run (const codeLinkConfig_t *config, codeLinkResult_t *result) {
+  codeSender_t sender;
+  codeReceiver_t receiver;
+  symbolChannel_t forward, back;
+  long ticks = 0;
+
+  memset(result, 0x00, sizeof(codeLinkResult_t));
+  if ( (config->payload_len < 8) || (config->payload_len > CODE_PAYLOAD_MAX) ) {
+    return -1;
+  }
+  if (symbolChannel_init(&forward, config->delay, 0, 0, config->seed * 2) < 0) {
+    return -1;
+  }
+  if (symbolChannel_init(&back, config->delay, 0, 0, config->seed * 2 + 1) < 0) {
+    symbolChannel_destroy(&forward);
+    return -1;
+  }
+  codeSender_init(&sender, config->payload_len, config->mode, config->adaptive, config->seed);
+  codeReceiver_init(&receiver, config->payload_len, config->mode, config->seed);
+
+  rgb_colour_t seen = DARK, seen_back = DARK;
+  for (int phase = 0 ; phase < config->phase_count ; phase++) {
+    forward.drop_prob = back.drop_prob = config->phases[phase].drop_prob;
+    forward.misread_prob = back.misread_prob = config->phases[phase].misread_prob;
+    for (long t = 0 ; t < config->phases[phase].ticks ; t++) {
+      rgb_colour_t shown = symbolChannel_push(&forward, codeSender_tick(&sender, seen_back));
+      seen_back = symbolChannel_push(&back, codeReceiver_tick(&receiver, seen));
+      seen = shown;
+    }
+    ticks += config->phases[phase].ticks;
+  }
+  symbolChannel_destroy(&forward);
+  symbolChannel_destroy(&back);
+
+  result->frames = receiver.frames;
+  result->lost = receiver.lost;
+  result->undetected = receiver.undetected;
+  result->switches = sender.controller.switches;
+  result->control_frames = sender.control_frames;
+  result->goodput = (double)receiver.frames * config->payload_len / (ticks * config->symbol_period);
+  return 0;
+}
+
+
+/*
+  CHANNEL MUX
+
+  Several logical streams (stdout, stderr, telemetry, control ...) over
+  one LED, giving the two marks the meaning the colour table hints at
+  instead of parity. Data goes in segments:
+
+    [channel:3 length-1:5] ended by Mark 2 (YELLOW)
+    [payload ...]          each ended by Mark 1 (WHITE)
+    [crc8 of header and payload] ended by Mark 1 (WHITE)
+
+  A YELLOW byte always starts a segment, so the receiver finds its place
+  again after any damage, and every segment is checked by its CRC.
+
+  The transmitter keeps a queue per channel and, at every segment
+  boundary, serves the non empty channel with the highest priority (round
+  robin among equals). A segment cannot be cut short, so a byte on the
+  top priority channel waits at most one segment of any other channel:
+  (segment_max + 2) * 5 symbols, however saturated the link is. Bulk
+  channels with a small segment_max keep that bound tight for the rest.
+*/
+
+#define MUX_CHANNELS 8
+#define MUX_SEGMENT_MAX 32
+#define MUX_QUEUE 256
+
+typedef struct muxChannel {
+  uint8_t queue[MUX_QUEUE];
+  int head;
+  int count;
+  int priority;             // Higher is served first
+  int segment_max;          // Payload bytes per segment, 1 to MUX_SEGMENT_MAX
+} muxChannel_t;
+
+typedef struct muxTransmitter {
+  colourEncoder_t encoder;
+  muxChannel_t channels[MUX_CHANNELS];
+  int last;                 // Channel served last, for round robin
+  rgb_colour_t pending[(MUX_SEGMENT_MAX + 2) * 5];
+  int pending_count;
+  int pending_position;
+  uint32_t segments;
+} muxTransmitter_t;
+
+void muxTransmitter_init (muxTransmitter_t *tx, const colourMap_t *map) {
+  memset(tx, 0x00, sizeof(muxTransmitter_t));
+  colourEncoder_init(&tx->encoder, map, NO_PARITY);
+  for (int c = 0 ; c < MUX_CHANNELS ; c++) {
+    tx->channels[c].segment_max = MUX_SEGMENT_MAX;
+  }
+  tx->last = MUX_CHANNELS - 1;
+}
+
+void muxTransmitter_channel (muxTransmitter_t *tx, int channel, int priority, int segment_max) {
+  muxChannel_t *ch = &tx->channels[channel & (MUX_CHANNELS - 1)];
+  ch->priority = priority;
+  ch->segment_max = (segment_max < 1) ? 1 : (segment_max > MUX_SEGMENT_MAX) ? MUX_SEGMENT_MAX : segment_max;
+}
+
+/**
+  Queue bytes on a channel.
+
+  Return Value:
+    Number of bytes queued (less than `length` when the queue is full)
+*/
+int muxTransmitter_write (muxTransmitter_t *tx, int channel, const uint8_t *data, int length) {
+  muxChannel_t *ch = &tx->channels[channel & (MUX_CHANNELS - 1)];
+  int written = 0;
+  while ( (written < length) && (ch->count < MUX_QUEUE) ) {
+    ch->queue[(ch->head + ch->count) % MUX_QUEUE] = data[written++];
+    ch->count++;
+  }
+  return written;
+}
+
+static int muxTransmitter_pick (muxTransmitter_t *tx) {
+  int best = -1;
+  for (int i = 1 ; i <= MUX_CHANNELS ; i++) {
+    int c = (tx->last + i) % MUX_CHANNELS;
+    if ( tx->channels[c].count && ( (best < 0) || (tx->channels[c].priority > tx->channels[best].priority) ) ) {
+      best = c;
+    }
+  }
+  return best;
+}
+
+/**
+  Return Value:
+    Colour to show for the next symbol (DARK when every queue is empty)
+*/
+rgb_colour_t muxTransmitter_next (muxTransmitter_t *tx) {
+  if (tx->pending_position == tx->pending_count) {
+    int channel = muxTransmitter_pick(tx);
+    if (channel < 0) {
+      return colourEncoder_close(&tx->encoder);
+    }
+
+    muxChannel_t *ch = &tx->channels[channel];
+    uint8_t segment[MUX_SEGMENT_MAX + 1];
+    int length = (ch->count < ch->segment_max) ? ch->count : ch->segment_max;
+    int count = 0;
+
+    segment[0] = (channel << 5) | (length - 1);
+    for (int i = 0 ; i < length ; i++) {
+      segment[1 + i] = ch->queue[ch->head];
+      ch->head = (ch->head + 1) % MUX_QUEUE;
+    }
+    ch->count -= length;
+
+    count += colourEncoder_put_marked(&tx->encoder, segment[0], YELLOW, &tx->pending[count]);
+    for (int i = 1 ; i <= length ; i++) {
+      count += colourEncoder_put_marked(&tx->encoder, segment[i], WHITE, &tx->pending[count]);
+    }
+    count += colourEncoder_put_marked(&tx->encoder, crc8_update(0, segment, length + 1), WHITE, &tx->pending[count]);
+    tx->pending_count = count;
+    tx->pending_position = 0;
+    tx->last = channel;
+    tx->segments++;
+  }
+  return tx->pending[tx->pending_position++];
+}
+
+typedef void (*muxSink_t) (void *user, int channel, const uint8_t *data, int length);
+
+typedef struct muxReceiver {
+  colourDecoder_t decoder;
+  muxSink_t sinks[MUX_CHANNELS];
+  void *users[MUX_CHANNELS];
+  uint8_t segment[MUX_SEGMENT_MAX + 2];
+  int fill;                 // 0 when not in a segment
+  int expected;             // Segment bytes including header and CRC
+  uint32_t segments;
+  uint32_t dropped;         // Segments cut short or failing the CRC
+  uint32_t stray;           // WHITE bytes outside any segment
+} muxReceiver_t;
+
+void muxReceiver_init (muxReceiver_t *rx, const colourMap_t *map) {
+  memset(rx, 0x00, sizeof(muxReceiver_t));
+  colourDecoder_init(&rx->decoder, map, NO_PARITY);
+}
+
+void muxReceiver_sink (muxReceiver_t *rx, int channel, muxSink_t sink, void *user) {
+  rx->sinks[channel & (MUX_CHANNELS - 1)] = sink;
+  rx->users[channel & (MUX_CHANNELS - 1)] = user;
+}
+
+// Feed one colour; complete segments go to their channel's sink
+void muxReceiver_push (muxReceiver_t *rx, rgb_colour_t colour) {
+  uint8_t output_byte;
+  int returncode = colourDecoder_push(&rx->decoder, colour, &output_byte);
+
+  switch (returncode) {
+  case (0):
+    return;
+  case (2): // Mark 2: header
+    if (rx->fill) {
+      rx->dropped++;
+    }
+    rx->segment[0] = output_byte;
+    rx->expected = (output_byte & 0x1F) + 1 + 2;
+    rx->fill = 1;
+    return;
+  case (1): // Mark 1: payload or CRC
+    if (!rx->fill) {
+      rx->stray++;
+      return;
+    }
+    rx->segment[rx->fill++] = output_byte;
+    if (rx->fill < rx->expected) {
+      return;
+    }
+    if (crc8_update(0, rx->segment, rx->fill - 1) == rx->segment[rx->fill - 1]) {
+      int channel = rx->segment[0] >> 5;
+      rx->segments++;
+      if (rx->sinks[channel]) {
+        rx->sinks[channel](rx->users[channel], channel, rx->segment + 1, rx->fill - 2);
+      }
+    } else {
+      rx->dropped++;
+    }
+    rx->fill = 0;
+    return;
+  default: // Framing error or channel closed
+    if (rx->fill) {
+      rx->dropped++;
+    }
+    rx->fill = 0;
+    return;
+  }
+}
+
+
+/*
+  VARINT
+
+  LEB128 style: 7 bits per byte, low bits first, top bit set on all but
+  the last byte. Signed values go through zigzag first so small negative
+  numbers stay short too (0, -1, 1, -2 ... -> 0, 1, 2, 3 ...).
+*/
+
+#define VARINT_MAX 5
+
+static inline uint32_t zigzag_encode (int32_t value) {
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t zigzag_decode (uint32_t value) {
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+/**
+  Return Value:
+    Bytes written (1 to VARINT_MAX)
+*/
+int varint_put (uint32_t value, uint8_t *out) {
+  int length = 0;
+  while (value >= 0x80) {
+    out[length++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[length++] = value;
+  return length;
+}
+
+/**
+  Return Value:
+    Bytes read, or 0 when `length` ends mid varint or it is too long
+*/
+int varint_get (const uint8_t *in, int length, uint32_t *value) {
+  uint32_t result = 0;
+  for (int i = 0 ; (i < length) && (i < VARINT_MAX) ; i++) {
+    result |= (uint32_t)(in[i] & 0x7F) << (7 * i);
+    if (!(in[i] & 0x80)) {
+      *value = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+
+/*
+  DEFERRED LOGGING
+
+  Debug text at 5 symbols a character is slow. Instead the device sends
+  which message it is and its arguments, and the host does the printf:
+
+    [message id: varint] [argument: zigzag varint] ...
+
+  one record per packet (see PACKET FRAMING). "battery 3712 mV, 24 C" is
+  21 characters of text but a 4 byte record, and the device never runs
+  a formatter.
+
+  Messages are listed once in DEFERRED_LOG_MESSAGES, which generates the
+  ids, the argument counts the device needs and the format strings only
+  the host needs (a device build that never calls deferredLog_expand()
+  leaves them out). Append new messages at the end so ids of existing
+  ones stay put. Arguments are int32_t; the host reads them back as the
+  conversion asks: %d %i %u %x %X %c with flags and width, and %%.
+*/
+
+#define DEFERRED_LOG_MESSAGES(X) \
+  X(LOG_BOOT,          3, "boot: firmware %u.%u, reset cause %u") \
+  X(LOG_BATTERY,       2, "battery %u mV, %d C") \
+  X(LOG_SENSOR_FAIL,   2, "sensor %u read failed, error %d") \
+  X(LOG_TX_DONE,       2, "sent %u bytes in %u ms") \
+  X(LOG_POSITION,      3, "fix lat %d lon %d, %u satellites") \
+  X(LOG_REGISTER,      2, "reg 0x%02X = 0x%08x") \
+  X(LOG_WATCHDOG,      0, "watchdog fed late") \
+  X(LOG_STATE,         2, "state %c -> %c")
+
+#define DEFERRED_LOG_ID(id, argc, format) id,
+#define DEFERRED_LOG_ARGC(id, argc, format) argc,
+#define DEFERRED_LOG_FORMAT(id, argc, format) format,
+
+typedef enum deferredLogId {
+  DEFERRED_LOG_MESSAGES(DEFERRED_LOG_ID)
+  LOG_MESSAGE_COUNT
+} deferredLogId_t;
+
+static const uint8_t deferredLog_argc[LOG_MESSAGE_COUNT] = { DEFERRED_LOG_MESSAGES(DEFERRED_LOG_ARGC) };
+static const char *deferredLog_formats[LOG_MESSAGE_COUNT] = { DEFERRED_LOG_MESSAGES(DEFERRED_LOG_FORMAT) };
+
+#define DEFERRED_LOG_ARGS_MAX 8
+#define DEFERRED_LOG_RECORD_MAX ((1 + DEFERRED_LOG_ARGS_MAX) * VARINT_MAX)
+
+/**
+  Device side: build the record for one log call. `args` holds
+  deferredLog_argc[id] values.
+
+  Return Value:
+    Record length in bytes, 0 for an unknown id
+*/
+int deferredLog_record (deferredLogId_t id, const int32_t *args, uint8_t *record) {
+  if ((unsigned)id >= LOG_MESSAGE_COUNT) {
+    return 0;
+  }
+  int length = varint_put(id, record);
+  for (int i = 0 ; i < deferredLog_argc[id] ; i++) {
+    length += varint_put(zigzag_encode(args[i]), record + length);
+  }
+  return length;
+}
+
+/**
+  Device side: encode one log call straight to colours, as a packet.
+
+  Return Value:
+    Number of colours written (at most DEFERRED_LOG_RECORD_MAX * 5 + 1)
+*/
+int deferredLog_colours (colourEncoder_t *encoder, deferredLogId_t id, const int32_t *args, rgb_colour_t *colours) {
+  uint8_t record[DEFERRED_LOG_RECORD_MAX];
+  int length = deferredLog_record(id, args, record);
+  return length ? packetEncode_colours(encoder, record, length, colours) : 0;
+}
+
+/**
+  Host side: expand a record back into text (always NUL terminated).
+
+  Return Values:
+    Length of the text, or -1 when the record is malformed
+*/
+int deferredLog_expand (const uint8_t *record, int length, char *text, int size) {
+  uint32_t id;
+  int used = varint_get(record, length, &id);
+  int out = 0;
+
+  if ( !used || (id >= LOG_MESSAGE_COUNT) || (size < 1) ) {
+    return -1;
+  }
+  text[0] = '\0';
+  for (const char *f = deferredLog_formats[id] ; *f ; f++) {
+    char spec[16];
+    int spec_length = 0;
+    int written;
+
+    if (*f != '%') {
+      written = snprintf(text + out, size - out, "%c", *f);
+    } else if (f[1] == '%') {
+      written = snprintf(text + out, size - out, "%%");
+      f++;
+    } else {
+      // Copy flags and width, then the conversion
+      spec[spec_length++] = *f++;
+      while (*f && strchr("-+ #0123456789", *f) && (spec_length < (int)sizeof(spec) - 2)) {
+        spec[spec_length++] = *f++;
+      }
+      if (!*f || !strchr("diuxXc", *f)) {
+        return -1;
+      }
+      spec[spec_length++] = *f;
+      spec[spec_length] = '\0';
+
+      uint32_t raw;
+      int n = varint_get(record + used, length - used, &raw);
+      if (!n) {
+        return -1;
+      }
+      used += n;
+      int32_t value = zigzag_decode(raw);
+      if ( (*f == 'd') || (*f == 'i') || (*f == 'c') ) {
+        written = snprintf(text + out, size - out, spec, (int)value);
+      } else {
+        written = snprintf(text + out, size - out, spec, (unsigned)value);
+      }
+    }
+    out += written;
+    if (out >= size) {
+      return size - 1; // Truncated
+    }
+  }
+  return (used == length) ? out : -1;
+}
+
+
+/*
+  TELEMETRY SCHEMA
+
+  Fixed structure sensor samples described once in TELEMETRY_FIELDS,
+  which generates the sample struct, a struct of arrays for the receiving
+  end, and the encoder and decoder. On the wire:
+
+    [packed bits] [varint] ...
+
+  Enum and boolean fields are packed first, `bits` each, low bits of the
+  first byte first. Then every numeric field, in schema order, as a
+  varint (zigzag for signed ones; see VARINT). A sample of counters,
+  temperatures and states that is 15 bytes as a raw struct comes to
+  about 10, so updates can go out more often at the same symbol rate.
+  The decoder writes each field straight into its column, ready for
+  analysis over many samples.
+
+  Add fields at the end; enum fields are at most 31 bits, and all packed
+  fields together at most 64.
+*/
+
+typedef enum telemetryKind {
+  TELEMETRY_UNSIGNED,
+  TELEMETRY_SIGNED,
+  TELEMETRY_ENUM,
+  TELEMETRY_BOOL
+} telemetryKind_t;
+
+//  name,            kind,                bits (packed kinds only)
+#define TELEMETRY_FIELDS(X) \
+  X(uptime_s,        TELEMETRY_UNSIGNED,  0) \
+  X(temperature_cc,  TELEMETRY_SIGNED,    0) /* Hundredths of a degree C */ \
+  X(humidity_pct,    TELEMETRY_UNSIGNED,  0) \
+  X(battery_mv,      TELEMETRY_UNSIGNED,  0) \
+  X(state,           TELEMETRY_ENUM,      3) \
+  X(charging,        TELEMETRY_BOOL,      1) \
+  X(door_open,       TELEMETRY_BOOL,      1) \
+  X(error_count,     TELEMETRY_UNSIGNED,  0)
+
+#define TELEMETRY_IS_PACKED(kind) ( ((kind) == TELEMETRY_ENUM) || ((kind) == TELEMETRY_BOOL) )
+#define TELEMETRY_MASK(bits) ((uint32_t)((1ull << (bits)) - 1))
+
+#define TELEMETRY_STRUCT_FIELD(name, kind, bits) int32_t name;
+#define TELEMETRY_COLUMN_FIELD(name, kind, bits) int32_t *name;
+#define TELEMETRY_COUNT_FIELD(name, kind, bits) + 1
+#define TELEMETRY_COUNT_BITS(name, kind, bits) + (TELEMETRY_IS_PACKED(kind) ? (bits) : 0)
+
+enum {
+  TELEMETRY_FIELD_COUNT = 0 TELEMETRY_FIELDS(TELEMETRY_COUNT_FIELD),
+  TELEMETRY_PACKED_BITS = 0 TELEMETRY_FIELDS(TELEMETRY_COUNT_BITS),
+  TELEMETRY_PACKED_BYTES = (TELEMETRY_PACKED_BITS + 7) / 8,
+  TELEMETRY_MAX_BYTES = TELEMETRY_PACKED_BYTES + TELEMETRY_FIELD_COUNT * VARINT_MAX
+};
+
+_Static_assert(TELEMETRY_PACKED_BITS <= 64, "packed telemetry fields must fit in 64 bits");
+
+typedef struct telemetry {
+  TELEMETRY_FIELDS(TELEMETRY_STRUCT_FIELD)
+} telemetry_t;
+
+typedef struct telemetryColumns {
+  TELEMETRY_FIELDS(TELEMETRY_COLUMN_FIELD)
+  int count;                // Samples decoded
+  int capacity;
+} telemetryColumns_t;
+
+void telemetryColumns_destroy (telemetryColumns_t *columns) {
+#define TELEMETRY_FREE_COLUMN(name, kind, bits) free(columns->name);
+  TELEMETRY_FIELDS(TELEMETRY_FREE_COLUMN)
+#undef TELEMETRY_FREE_COLUMN
+}
+
+/**
+  Return Values:
+    0 on success, -1 when out of memory
+*/
+int telemetryColumns_init (telemetryColumns_t *columns, int capacity) {
+  int ok = 1;
+  memset(columns, 0x00, sizeof(telemetryColumns_t));
+  columns->capacity = capacity;
+#define TELEMETRY_ALLOC_COLUMN(name, kind, bits) \
+  columns->name = malloc(capacity * sizeof(int32_t)); \
+  ok &= (columns->name != NULL);
+  TELEMETRY_FIELDS(TELEMETRY_ALLOC_COLUMN)
+#undef TELEMETRY_ALLOC_COLUMN
+  if (!ok) {
+    telemetryColumns_destroy(columns);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+  Return Value:
+    Encoded length in bytes (at most TELEMETRY_MAX_BYTES)
+*/
+int telemetry_encode (const telemetry_t *sample, uint8_t *out) {
+  uint64_t packed = 0;
+  int shift = 0;
+  int length = TELEMETRY_PACKED_BYTES;
+
+#define TELEMETRY_PUT_PACKED(name, kind, bits) \
+  if (TELEMETRY_IS_PACKED(kind)) { \
+    packed |= (uint64_t)((uint32_t)sample->name & TELEMETRY_MASK(bits)) << shift; \
+    shift += (bits); \
+  }
+  TELEMETRY_FIELDS(TELEMETRY_PUT_PACKED)
+#undef TELEMETRY_PUT_PACKED
+  for (int i = 0 ; i < TELEMETRY_PACKED_BYTES ; i++) {
+    out[i] = packed >> (8 * i);
+  }
+
+#define TELEMETRY_PUT_VARINT(name, kind, bits) \
+  if ((kind) == TELEMETRY_UNSIGNED) { \
+    length += varint_put((uint32_t)sample->name, out + length); \
+  } else if ((kind) == TELEMETRY_SIGNED) { \
+    length += varint_put(zigzag_encode(sample->name), out + length); \
+  }
+  TELEMETRY_FIELDS(TELEMETRY_PUT_VARINT)
+#undef TELEMETRY_PUT_VARINT
+  return length;
+}
+
+/**
+  Decode one sample, exactly `length` bytes, into the next row of
+  `columns`.
+
+  Return Values:
+    `length`, or -1 when `in` is malformed, has bytes left over or the
+    columns are full
+*/
+int telemetry_decode (const uint8_t *in, int length, telemetryColumns_t *columns) {
+  int row = columns->count;
+  uint64_t packed = 0;
+  int shift = 0;
+  int used = TELEMETRY_PACKED_BYTES;
+  uint32_t raw;
+  int n;
+
+  if ( (row >= columns->capacity) || (length < TELEMETRY_PACKED_BYTES) ) {
+    return -1;
+  }
+  for (int i = 0 ; i < TELEMETRY_PACKED_BYTES ; i++) {
+    packed |= (uint64_t)in[i] << (8 * i);
+  }
+
+#define TELEMETRY_GET_PACKED(name, kind, bits) \
+  if (TELEMETRY_IS_PACKED(kind)) { \
+    columns->name[row] = (packed >> shift) & TELEMETRY_MASK(bits); \
+    shift += (bits); \
+  }
+  TELEMETRY_FIELDS(TELEMETRY_GET_PACKED)
+#undef TELEMETRY_GET_PACKED
+
+#define TELEMETRY_GET_VARINT(name, kind, bits) \
+  if (!TELEMETRY_IS_PACKED(kind)) { \
+    n = varint_get(in + used, length - used, &raw); \
+    if (!n) { \
+      return -1; \
+    } \
+    used += n; \
+    columns->name[row] = ((kind) == TELEMETRY_SIGNED) ? zigzag_decode(raw) : (int32_t)raw; \
+  }
+  TELEMETRY_FIELDS(TELEMETRY_GET_VARINT)
+#undef TELEMETRY_GET_VARINT
+
+  if (used != length) {
+    return -1; // Trailing bytes: not a sample of this schema
+  }
+  columns->count++;
+  return used;
+}
+
+
+/*
+  TEST TOOLS
+*/
+
+// Colour String
+static char *rgb_colour_str[] = {
+  "Dark",
+  "Blue",
+  "Green",
+  "Cyan",
+  "Red",
+  "Magenta",
+  "Yellow",
+  "White"
+};
+
+// Colour Short Version
+static char *rgb_colour_short_str[] = {
+  "D",
+  "B",
+  "G",
+  "C",
+  "R",
+  "M",
+  "Y",
+  "W"
+};
+
+// Colour Short Version Marked
+static char *rgb_colour_short_marked_str[] = {
+  "_D_",
+  " B ",
+  " G ",
+  " C ",
+  " R ",
+  " M ",
+  "!Y!",
+  "|W|"
+};
+
+
+
+uint8_t displayBinary_uint8_t(uint8_t input) {
+  printf(" %x '%c' = ", input, input);
+  int i;
+  for (i = 8 - 1; i >= 0 ; i--) {
+    if ( (input >> i) & 1u ) {
+      printf("1");
+    } else {
+      printf("0");
+    }
+  }
+  printf("\n");
+  return input;
+}
+
+/*
+  Simulates a camera that samples each colour for 3 frames and catches one
+  blended frame on most transitions, then decodes it with and without the
+  blend filter.
+*/
+void testBlendFilter(void) {
+  const char *message = "HELLO WORLD";
+  rgb_colour_t colourSeq[100];
+  rgb_colour_t frames[500];
+  int seq_len = 0;
+  int frame_count = 0;
+
+  memset(colourSeq, 0x00, sizeof(colourSeq));
+  for (int i = 0 ; message[i] ; i++) {
+    toColourSeq_uint8(message[i], colourSeq, &seq_len);
+  }
+
+  rgb_colour_t previous_colour = DARK;
+  for (int i = 0 ; i <= seq_len ; i++) {
+    rgb_colour_t colour = (i < seq_len) ? colourSeq[i] : DARK;
+    rgb_colour_t blend = (i % 2) ? (previous_colour | colour) : (previous_colour & colour);
+    if (isTransitionBlend(blend, previous_colour, colour)) {
+      frames[frame_count++] = blend;
+    }
+    for (int k = 0 ; k < 3 ; k++) {
+      frames[frame_count++] = colour;
+    }
+    previous_colour = colour;
+  }
+  frames[frame_count++] = DARK;
+
+  printf("# BLEND FILTER Test\n");
+  printf("%d symbols sampled as %d frames\n", seq_len, frame_count);
+
+  // Without filter: run length sampler straight into the decoder
+  colourSampler_t sampler;
+  colourDecoder_t decoder;
+  colourSampler_init(&sampler);
+  colourDecoder_init(&decoder, NULL, PARITY_SETTING);
+  printf("unfiltered : ");
+  for (int i = 0 ; i < frame_count ; i++) {
+    colourRun_t run;
+    uint8_t output_byte;
+    if (colourSampler_push(&sampler, frames[i], &run)) {
+      int returncode = colourDecoder_push(&decoder, sampler.run.colour, &output_byte);
+      if (returncode > 0) {
+        printf("%c", output_byte);
+      } else if (returncode < -1) {
+        printf("?");
+      }
+    }
+  }
+  printf(" (parity errors %u, framing errors %u)\n", (unsigned)decoder.parity_errors, (unsigned)decoder.framing_errors);
+
+  // With filter
+  colourStream_t stream;
+  colourStream_init(&stream, NULL, PARITY_SETTING, 0);
+  printf("filtered   : ");
+  for (int i = 0 ; i < frame_count ; i++) {
+    uint8_t output_byte;
+    int returncode = colourStream_push(&stream, frames[i], &output_byte);
+    if (returncode > 0) {
+      printf("%c", output_byte);
+    } else if (returncode < -1) {
+      printf("?");
+    }
+  }
+  printf(" (parity errors %u, framing errors %u, blends suppressed %u)\n\n",
+         (unsigned)stream.decoder.parity_errors, (unsigned)stream.decoder.framing_errors, (unsigned)stream.filter.suppressed);
+}
+
+/*
+  Confusion matrix where BLUE/CYAN and RED/MAGENTA are often mixed up, as
+  seen on a typical RGB LED, then search for a better colour cycle order.
+*/
+void testColourMap(void) {
+  double confusion[8][8];
+  colourMap_t optimised;
+
+  memset(confusion, 0x00, sizeof(confusion));
+  for (int sent = DARK ; sent <= WHITE ; sent++) {
+    for (int seen = DARK ; seen <= WHITE ; seen++) {
+      confusion[sent][seen] = (sent == seen) ? 0.93 : 0.01;
+    }
+  }
+  confusion[BLUE][CYAN] = confusion[CYAN][BLUE] = 0.08;
+  confusion[RED][MAGENTA] = confusion[MAGENTA][RED] = 0.08;
+  confusion[BLUE][BLUE] = confusion[CYAN][CYAN] = 0.86;
+  confusion[RED][RED] = confusion[MAGENTA][MAGENTA] = 0.86;
+
+  printf("# COLOUR MAP OPTIMISER Test\n");
+  printf("default   : ");
+  for (int i = 0 ; i < 5 ; i++) {
+    printf("%s ", rgb_colour_short_str[colourMap_default.order[i]]);
+  }
+  printf("expected bit errors/symbol = %.5f\n", colourMap_expectedBitErrors(&colourMap_default, confusion));
+
+  double errors = colourMap_optimise(confusion, &optimised);
+  printf("optimised : ");
+  for (int i = 0 ; i < 5 ; i++) {
+    printf("%s ", rgb_colour_short_str[optimised.order[i]]);
+  }
+  printf("steps ");
+  for (int i = 0 ; i < 4 ; i++) {
+    printf("%d", optimised.step[i]);
+  }
+  printf(" expected bit errors/symbol = %.5f\n", errors);
+
+  // Round trip through encoder and decoder built from the optimised map
+  const char *message = "HELLO WORLD";
+  colourEncoder_t encoder;
+  colourDecoder_t decoder;
+  colourEncoder_init(&encoder, &optimised, PARITY_SETTING);
+  colourDecoder_init(&decoder, &optimised, PARITY_SETTING);
+  printf("round trip: ");
+  for (int i = 0 ; message[i] ; i++) {
+    rgb_colour_t colours[5];
+    int count = colourEncoder_put_uint8(&encoder, message[i], colours);
+    for (int k = 0 ; k < count ; k++) {
+      uint8_t output_byte;
+      printf("%s", rgb_colour_short_str[colours[k]]);
+      if (colourDecoder_push(&decoder, colours[k], &output_byte) > 0) {
+        printf("'%c' ", output_byte);
+      }
+    }
+  }
+  printf("\n\n");
+}
+
+void printSimResult(const char *mode, const simResult_t *result) {
+  printf("%-12s | BER %.4f | rejected %6llu | undetected %5llu | goodput %6.2f B/s | latency %5.1f ms\n",
+         mode, result->byte_error_rate, (unsigned long long)result->bytes_rejected,
+         (unsigned long long)result->bytes_undetected, result->goodput, result->mean_latency * 1000);
+}
+
+void testChannelSimulator(void) {
+  static const char *parity_str[] = { "no parity", "even parity", "odd parity" };
+  simConfig_t config = {
+    .camera = {
+      .fps = 30,
+      .exposure = 0.5,
+      .frame_jitter = 0.05,
+      .drop_prob = 0.01,
+      .misclass_prob = 0.002
+    },
+    .symbol_period = 0.1,
+    .symbol_jitter = 0.1,
+    .map = NULL,
+    .max_blend_len = 0,
+    .payload_len = 200,
+    .trials = 64,
+    .threads = 4,
+    .seed = 1
+  };
+  simResult_t result;
+
+  printf("# CHANNEL SIMULATOR Test\n");
+  printf("%d trials x %d bytes, %.0f fps camera, %.0f ms symbols\n", config.trials, config.payload_len, config.camera.fps, config.symbol_period * 1000);
+  for (int parity = NO_PARITY ; parity <= ODD_PARITY ; parity++) {
+    config.parity = parity;
+    if (simRun(&config, &result) == 0) {
+      printSimResult(parity_str[parity], &result);
+    }
+  }
+  printf("\n");
+}
+
+void testSyntheticVideo(void) {
+  rgb_colour_t colourSeq[100];
+  int seq_len = 0;
+  const char *message = "HI";
+
+  for (int i = 0 ; message[i] ; i++) {
+    toColourSeq_uint8(message[i], colourSeq, &seq_len);
+  }
+
+  videoTransmitter_t transmitters[2] = {
+    { .colours = colourSeq, .count = seq_len, .symbol_period = 0.1, .start_time = 0.1, .x = 12, .y = 16, .vx = 10, .vy = 0, .radius = 5 },
+    { .colours = colourSeq, .count = seq_len, .symbol_period = 0.2, .start_time = 0.0, .x = 36, .y = 16, .vx = 0, .vy = 0, .radius = 4 }
+  };
+  videoScene_t scene = {
+    .width = 48, .height = 32, .fps = 30, .row_time = 0, .blur = 2, .noise = 6,
+    .background = { 40, 40, 40 },
+    .transmitters = transmitters, .transmitter_count = 2, .seed = 7
+  };
+
+  printf("# SYNTHETIC VIDEO Test\n");
+
+  FILE *out = tmpfile();
+  if (!out) {
+    printf("no temporary file\n\n");
+    return;
+  }
+  long frames = videoRender_stream(&scene, VIDEO_Y4M, 0, 30, 4, out);
+  printf("frames written = %ld, bytes = %ld\n", frames, ftell(out));
+  fclose(out);
+
+  // Check the colour at each LED centre against the sequence being played
+  uint8_t rgb[48 * 32 * 3];
+  int matches = 0;
+  for (long frame = 0 ; frame < 30 ; frame++) {
+    videoRender_frame(&scene, frame, rgb);
+    for (int i = 0 ; i < 2 ; i++) {
+      double t = frame / scene.fps;
+      int x = (int)(transmitters[i].x + transmitters[i].vx * t + 0.5);
+      int y = (int)(transmitters[i].y + 0.5);
+      uint8_t *pixel = &rgb[(y * scene.width + x) * 3];
+      rgb_colour_t seen = (pixel[0] > 128 ? RED : 0) | (pixel[1] > 128 ? GREEN : 0) | (pixel[2] > 128 ? BLUE : 0);
+      matches += (seen == videoTransmitter_colourAt(&transmitters[i], t));
+    }
+  }
+  printf("LED centre colours matching the sequence = %d / 60\n\n", matches);
+}
+
+void printVideoByte(void *user, uint8_t byte, int returncode, long frame) {
+  if (returncode > 0) {
+    printf("%c", byte);
+  } else {
+    printf("?");
+  }
+}
+
+void testVideoPipeline(void) {
+  rgb_colour_t colourSeq[100];
+  int seq_len = 0;
+  const char *message = "HELLO WORLD";
+
+  memset(colourSeq, 0x00, sizeof(colourSeq));
+  for (int i = 0 ; message[i] ; i++) {
+    toColourSeq_uint8(message[i], colourSeq, &seq_len);
+  }
+
+  // 30 fps camera, 3 frames per symbol with the switch part way through a frame
+  videoTransmitter_t led = { .colours = colourSeq, .count = seq_len, .symbol_period = 0.1, .start_time = 0.2 + 0.013, .x = 40, .y = 30, .radius = 6 };
+  videoScene_t scene = {
+    .width = 80, .height = 60, .fps = 30, .blur = 2, .noise = 8,
+    .background = { 30, 30, 40 },
+    .transmitters = &led, .transmitter_count = 1, .seed = 3
+  };
+  long frame_count = (long)((led.start_time + seq_len * led.symbol_period) * scene.fps) + 10;
+
+  printf("# VIDEO PIPELINE Test\n");
+  for (int format = VIDEO_RAW_RGB24 ; format <= VIDEO_Y4M ; format++) {
+    FILE *video = tmpfile();
+    if (!video) {
+      printf("no temporary file\n\n");
+      return;
+    }
+    videoRender_stream(&scene, format, 0, frame_count, 2, video);
+    rewind(video);
+
+    videoPipelineConfig_t config = {
+      .format = format, .width = scene.width, .height = scene.height,
+      .region = { .x = 30, .y = 20, .width = 20, .height = 20 },
+      .classifier = { .on_level = 128, .min_pixels = 4, .step = 1 },
+      .map = NULL, .parity = PARITY_SETTING, .max_blend_len = 0,
+      .queue_depth = 4, .sink = printVideoByte, .user = NULL
+    };
+    videoPipelineStats_t stats;
+    printf("%s: ", (format == VIDEO_Y4M) ? "y4m" : "raw");
+    int status = videoPipeline_run(&config, video, &stats);
+    printf(" (status %d, frames %ld, bytes %ld, errors %ld)\n", status, stats.frames, stats.bytes, stats.errors);
+    fclose(video);
+  }
+  printf("\n");
+}
+
+void testLedTracking(void) {
+  rgb_colour_t colourSeq[100];
+  int seq_len = 0;
+  const char *message = "HELLO WORLD";
+
+  memset(colourSeq, 0x00, sizeof(colourSeq));
+  for (int i = 0 ; message[i] ; i++) {
+    toColourSeq_uint8(message[i], colourSeq, &seq_len);
+  }
+
+  // LED drifting across a 320x240 frame
+  videoTransmitter_t led = { .colours = colourSeq, .count = seq_len, .symbol_period = 0.1, .start_time = 0.2, .x = 60, .y = 80, .vx = 30, .vy = 12, .radius = 5 };
+  videoScene_t scene = {
+    .width = 320, .height = 240, .fps = 30, .blur = 2, .noise = 8,
+    .background = { 30, 30, 40 },
+    .transmitters = &led, .transmitter_count = 1, .seed = 5
+  };
+  long frame_count = (long)((led.start_time + seq_len * led.symbol_period) * scene.fps) + 10;
+
+  printf("# LED TRACKING Test\n");
+  FILE *video = tmpfile();
+  if (!video) {
+    printf("no temporary file\n\n");
+    return;
+  }
+  videoRender_stream(&scene, VIDEO_RAW_RGB24, 0, frame_count, 2, video);
+
+  for (int track = 0 ; track <= 1 ; track++) {
+    rewind(video);
+    videoPipelineConfig_t config = {
+      .format = VIDEO_RAW_RGB24, .width = scene.width, .height = scene.height,
+      .region = { 0, 0, 0, 0 }, .track_led = track,
+      .classifier = { .on_level = 128, .min_pixels = 4, .step = 1 },
+      .map = NULL, .parity = PARITY_SETTING, .max_blend_len = 0,
+      .queue_depth = 4, .sink = printVideoByte, .user = NULL
+    };
+    videoPipelineStats_t stats;
+    printf("%s: ", track ? "tracked   " : "full frame");
+    videoPipeline_run(&config, video, &stats);
+    printf(" (bytes %ld, pixels per frame %ld)\n", stats.bytes, stats.pixels / stats.frames);
+  }
+  fclose(video);
+  printf("\n");
+}
+
+typedef struct channelText {
+  char text[24][16];
+  int length[24];
+} channelText_t;
+
+void collectChannelByte(void *user, int channel, uint8_t byte, int returncode, long frame) {
+  channelText_t *texts = user;
+  if ( (channel < 24) && (texts->length[channel] < 15) ) {
+    texts->text[channel][texts->length[channel]++] = (returncode > 0) ? byte : '?';
+  }
+}
+
+void testMultiReceiver(void) {
+  enum { LEDS = 24 };
+  static rgb_colour_t colourSeq[LEDS][100];
+  videoTransmitter_t leds[LEDS];
+  channelText_t texts;
+  int seq_len = 0;
+
+  memset(&texts, 0x00, sizeof(texts));
+  for (int i = 0 ; i < LEDS ; i++) {
+    char message[8];
+    snprintf(message, sizeof(message), "LED%02d", i);
+    seq_len = 0;
+    for (int k = 0 ; message[k] ; k++) {
+      toColourSeq_uint8(message[k], colourSeq[i], &seq_len);
+    }
+    // 6 x 4 grid, each LED starting at a different time
+    leds[i] = (videoTransmitter_t){
+      .colours = colourSeq[i], .count = seq_len, .symbol_period = 0.1, .start_time = 0.3 + 0.01 * i,
+      .x = 24 + 52 * (i % 6), .y = 30 + 60 * (i / 6), .vx = 2, .vy = -1, .radius = 5
+    };
+  }
+  videoScene_t scene = {
+    .width = 320, .height = 240, .fps = 30, .blur = 2, .noise = 8,
+    .background = { 30, 30, 40 },
+    .transmitters = leds, .transmitter_count = LEDS, .seed = 9
+  };
+
+  multiReceiver_t receiver;
+  if (multiReceiver_init(&receiver, 64, 4) < 0) {
+    return;
+  }
+  receiver.classifier = (colourClassifier_t){ .on_level = 128, .min_pixels = 4, .step = 1 };
+  receiver.sink = collectChannelByte;
+  receiver.user = &texts;
+
+  uint8_t *rgb = malloc(scene.width * scene.height * 3);
+  videoFrame_t frame = { .width = scene.width, .height = scene.height, .format = VIDEO_RAW_RGB24, .data = rgb };
+  long frame_count = (long)((0.3 + 0.01 * LEDS + seq_len * 0.1) * scene.fps) + 10;
+  int channels = 0;
+  for (long i = 0 ; i < frame_count ; i++) {
+    videoRender_frame(&scene, i, rgb);
+    channels = multiReceiver_frame(&receiver, &frame);
+  }
+
+  printf("# MULTI STREAM RECEIVER Test\n");
+  printf("%d channels, pixels per channel per frame %ld\n", channels, multiReceiver_visited(&receiver) / frame_count / (channels ? channels : 1));
+  for (int i = 0 ; i < channels && i < LEDS ; i++) {
+    printf("%s%s", texts.text[i], (i % 6 == 5) ? "\n" : " ");
+  }
+  printf("\n");
+
+  free(rgb);
+  multiReceiver_destroy(&receiver);
+}
+
+void printStripeByte(void *user, uint8_t byte, int returncode) {
+  printf("%c", (returncode > 0) ? byte : '?');
+}
+
+void testRollingShutter(void) {
+  rgb_colour_t colourSeq[200];
+  int seq_len = 0;
+  const char *message = "ROLLING SHUTTER STRIPES DECODED";
+
+  memset(colourSeq, 0x00, sizeof(colourSeq));
+  for (int i = 0 ; message[i] ; i++) {
+    toColourSeq_uint8(message[i], colourSeq, &seq_len);
+  }
+
+  // LED lighting the whole view, rows read out back to back over the frame
+  // period (no blanking), symbols 8 rows long
+  videoTransmitter_t led = { .colours = colourSeq, .count = seq_len, .x = 40, .y = 60, .radius = 1000 };
+  videoScene_t scene = {
+    .width = 80, .height = 120, .fps = 30, .blur = 0, .noise = 20,
+    .background = { 20, 20, 20 },
+    .transmitters = &led, .transmitter_count = 1, .seed = 11
+  };
+  scene.row_time = 1.0 / (scene.fps * scene.height);
+  led.symbol_period = 8 * scene.row_time + 0.000013;
+  led.start_time = 0.01;
+  long frame_count = (long)((led.start_time + seq_len * led.symbol_period) * scene.fps) + 2;
+
+  printf("# ROLLING SHUTTER Test\n");
+  stripeDecoder_t stripe;
+  colourClassifier_t classifier = { .on_level = 128, .min_pixels = 0, .step = 1 };
+  if (stripeDecoder_init(&stripe, &classifier, NULL, PARITY_SETTING, scene.height) < 0) {
+    return;
+  }
+  uint8_t *rgb = malloc(scene.width * scene.height * 3);
+  videoFrame_t frame = { .width = scene.width, .height = scene.height, .format = VIDEO_RAW_RGB24, .data = rgb };
+  for (long i = 0 ; i < frame_count ; i++) {
+    videoRender_frame(&scene, i, rgb);
+    stripeDecoder_frame(&stripe, &frame, printStripeByte, NULL);
+  }
+  printf("\n%d chars at %.0f symbols/s in %ld frames (%ld stripes)\n\n",
+         (int)strlen(message), 1 / led.symbol_period, frame_count, stripe.stripe_count);
+  free(rgb);
+  stripeDecoder_destroy(&stripe);
+}
+
+/*
+  Colour sensor waveform: symbols of random length, channels with different
+  gains and rise times (so they cross their thresholds at different times)
+  plus noise.
+*/
+void testAdcReceiver(void) {
+  const char *message = "COLOUR SENSOR";
+  rgb_colour_t colourSeq[100];
+  int seq_len = 0;
+  enum { SAMPLES = 20000 };
+  static uint16_t adc[3][SAMPLES];
+  static const double gain[3] = { 30000, 42000, 21000 };
+  static const double rise[3] = { 0.30, 0.15, 0.08 }; // Fraction of the step per sample
+  double level[3] = { 0, 0, 0 };
+  simRandom_t rng;
+  int n = 0;
+
+  memset(colourSeq, 0x00, sizeof(colourSeq));
+  for (int i = 0 ; message[i] ; i++) {
+    toColourSeq_uint8(message[i], colourSeq, &seq_len);
+  }
+
+  simRandom_seed(&rng, 34);
+  for (int s = -1 ; s <= seq_len ; s++) {
+    rgb_colour_t colour = ( (s < 0) || (s == seq_len) ) ? DARK : colourSeq[s];
+    int hold = 40 + simRandom_u32(&rng) % 80; // Timing insensitive: any length will do
+    for (int k = 0 ; (k < hold) && (n < SAMPLES) ; k++, n++) {
+      for (int channel = 0 ; channel < 3 ; channel++) {
+        double target = (colour & (RED >> channel)) ? gain[channel] : 0;
+        level[channel] += (target - level[channel]) * rise[channel];
+        double noise = 1500 * (simRandom_uniform(&rng) - 0.5);
+        adc[channel][n] = (uint16_t)(2000 + level[channel] + noise);
+      }
+    }
+  }
+
+  printf("# COLOUR SENSOR RECEIVER Test\n");
+  adcReceiver_t receiver;
+  adcReceiver_init(&receiver, NULL, PARITY_SETTING, 12);
+  receiver.auto_level = 1;
+  // Feed in uneven chunks as a DMA double buffer would
+  for (int base = 0 ; base < n ; base += 1000) {
+    int chunk = (n - base < 1000) ? (n - base) : 1000;
+    adcReceiver_process(&receiver, &adc[0][base], &adc[1][base], &adc[2][base], chunk, printStripeByte, NULL);
+  }
+  printf("\n%d samples, %llu transitions, %u blends removed\n\n", n, (unsigned long long)receiver.transitions, (unsigned)receiver.filter.suppressed);
+}
+
+void testEdgeReceiver(void) {
+  const char *message = "EDGE EVENTS";
+  colourEvent_t events[120];
+  colourEncoder_t encoder;
+  simRandom_t rng;
+  int count = 0;
+  uint32_t now = 0xFFFF0000u; // Timer about to wrap
+
+  simRandom_seed(&rng, 35);
+  colourEncoder_init(&encoder, NULL, PARITY_SETTING);
+  rgb_colour_t previous_colour = DARK;
+  for (int i = 0 ; message[i] ; i++) {
+    rgb_colour_t colours[5];
+    int symbols = colourEncoder_put_uint8(&encoder, message[i], colours);
+    for (int k = 0 ; k < symbols ; k++) {
+      // Every so often the sensor reports the in-between colour for a moment
+      rgb_colour_t blend = previous_colour | colours[k];
+      if ( (simRandom_u32(&rng) % 4 == 0) && isTransitionBlend(blend, previous_colour, colours[k]) ) {
+        events[count++] = (colourEvent_t){ now, blend };
+        now += 20;
+      }
+      events[count++] = (colourEvent_t){ now, colours[k] };
+      now += 800 + simRandom_u32(&rng) % 2400; // 0.8 to 3.2 ms in us ticks
+      previous_colour = colours[k];
+    }
+  }
+  events[count++] = (colourEvent_t){ now, colourEncoder_close(&encoder) };
+
+  printf("# EDGE EVENT RECEIVER Test\n");
+  edgeReceiver_t receiver;
+  edgeReceiver_init(&receiver, NULL, PARITY_SETTING, 200);
+  edgeReceiver_process(&receiver, events, count, printStripeByte, NULL);
+  printf("\n%d events, %u symbols, hold min %u mean %llu max %u ticks, %u blends removed\n\n",
+         count, (unsigned)receiver.symbols, (unsigned)receiver.min_hold,
+         (unsigned long long)(receiver.sum_hold / receiver.symbols), (unsigned)receiver.max_hold, (unsigned)receiver.filter.suppressed);
+}
+
+/*
+  Timed link over a clean clock, then over a jittery one where the
+  receiver asks for fallback and the transmitter switches to plain bytes.
+  Last, plain bytes that each lose a colour must not pass as timed ones.
+*/
+void testTimedMode(void) {
+  const char *message = "TIMED MODE 2 BITS/TRANSITION";
+  static const double jitter[2] = { 0.05, 0.45 };
+
+  printf("# TIMED SYMBOL MODE Test\n");
+  for (int run = 0 ; run < 2 ; run++) {
+    timedEncoder_t encoder;
+    timedReceiver_t receiver;
+    simRandom_t rng;
+    uint32_t now = 0;
+    int transitions = 0;
+
+    simRandom_seed(&rng, 36 + run);
+    timedEncoder_init(&encoder, NULL, PARITY_SETTING, 1000, 1600);
+    timedReceiver_init(&receiver, NULL, PARITY_SETTING, 1000, 1600, 0.2, 100);
+    printf("jitter %2.0f%%: ", jitter[run] * 100);
+
+    for (int i = 0 ; message[i] ; i++) {
+      timedSymbol_t symbols[5];
+      encoder.timed = !receiver.fallback; // Feedback from receiver to transmitter
+      int count = timedEncoder_put_uint8(&encoder, message[i], symbols);
+      for (int k = 0 ; k < count ; k++) {
+        colourEvent_t event = { now, symbols[k].colour };
+        uint8_t output_byte;
+        int returncode = timedReceiver_push(&receiver, &event, &output_byte);
+        if ( (returncode != 0) && (returncode != -1) ) {
+          printf("%c", (returncode > 0) ? output_byte : '?');
+        }
+        now += (uint32_t)(symbols[k].hold * (1 + jitter[run] * (2 * simRandom_uniform(&rng) - 1)));
+        transitions++;
+      }
+    }
+    colourEvent_t end = { now, DARK };
+    uint8_t output_byte;
+    if (timedReceiver_push(&receiver, &end, &output_byte) > 0) {
+      printf("%c", output_byte);
+    }
+    printf("\n  %d transitions, timed %u plain %u, timing errors %u, fallback %d\n",
+           transitions, (unsigned)receiver.timed_bytes, (unsigned)receiver.plain_bytes, (unsigned)receiver.timing_errors, receiver.fallback);
+  }
+
+  timedEncoder_t encoder;
+  timedReceiver_t receiver;
+  uint32_t now = 0;
+  int sent = 0, accepted = 0;
+  timedEncoder_init(&encoder, NULL, PARITY_SETTING, 1000, 1600);
+  timedReceiver_init(&receiver, NULL, PARITY_SETTING, 1000, 1600, 0.2, 100);
+  encoder.timed = 0;
+  for (int i = 0 ; message[i] ; i++) {
+    timedSymbol_t symbols[5];
+    int count = timedEncoder_put_uint8(&encoder, message[i], symbols);
+    for (int k = 0 ; k < count ; k++) {
+      if (k == 1) {
+        continue; // Second data colour never seen
+      }
+      colourEvent_t event = { now, symbols[k].colour };
+      uint8_t output_byte;
+      accepted += (timedReceiver_push(&receiver, &event, &output_byte) > 0);
+      now += symbols[k].hold;
+    }
+    sent++;
+  }
+  colourEvent_t end = { now, DARK };
+  uint8_t output_byte;
+  accepted += (timedReceiver_push(&receiver, &end, &output_byte) > 0);
+  printf("plain bytes missing a colour: %d sent, %d accepted, %u framing errors\n\n",
+         sent, accepted, (unsigned)receiver.framing_errors);
+}
+
+/*
+  Colour sensor with uneven gains, crosstalk, an offset and noise. The
+  message goes over 2, 3 and 4 levels, with the classifier used as is and
+  after a calibration burst.
+*/
+static void paletteSensor_read (const palette_t *palette, paletteColour_t colour, simRandom_t *rng, double rgb[3]) {
+  static const double response[3][3] = {
+    { 0.80, 0.12, 0.03 },
+    { 0.20, 0.95, 0.15 },
+    { 0.02, 0.25, 0.70 },
+  };
+  uint8_t duty[3];
+  palette_duty(palette, colour, duty);
+  for (int channel = 0 ; channel < 3 ; channel++) {
+    rgb[channel] = 10 + 6 * (2 * simRandom_uniform(rng) - 1);
+    for (int led = 0 ; led < 3 ; led++) {
+      rgb[channel] += response[channel][led] * duty[led];
+    }
+  }
+}
+
+void testPalette(void) {
+  const char *message = "MULTI LEVEL PALETTE";
+  int length = strlen(message);
+
+  printf("# MULTI LEVEL PALETTE Test\n");
+  for (int levels = 2 ; levels <= PALETTE_MAX_LEVELS ; levels++) {
+    palette_t palette;
+    palette_init(&palette, levels);
+
+    for (int calibrated = 0 ; calibrated < 2 ; calibrated++) {
+      paletteClassifier_t classifier;
+      paletteEncoder_t encoder;
+      paletteDecoder_t decoder;
+      simRandom_t rng;
+      char text[64] = {0};
+      int symbols = 0;
+
+      simRandom_seed(&rng, 37);
+      paletteClassifier_init(&classifier, &palette);
+      if (calibrated) {
+        double burst[4 * PALETTE_MAX_COLOURS][3];
+        int count = 4 * palette.colours;
+        for (int i = 0 ; i < count ; i++) {
+          paletteSensor_read(&palette, i % palette.colours, &rng, burst[i]);
+        }
+        paletteClassifier_calibrate(&classifier, burst, count);
+      }
+      paletteEncoder_init(&encoder, &palette, PARITY_SETTING);
+      paletteDecoder_init(&decoder, &palette, PARITY_SETTING);
+
+      for (int i = 0 ; i < length ; i++) {
+        paletteColour_t colours[5];
+        int count = paletteEncoder_put_uint8(&encoder, message[i], colours);
+        for (int k = 0 ; k < count ; k++) {
+          for (int sample = 0 ; sample < 3 ; sample++) { // Oversampled
+            double rgb[3];
+            uint8_t output_byte;
+            paletteSensor_read(&palette, colours[k], &rng, rgb);
+            int returncode = paletteDecoder_push(&decoder, paletteClassifier_classify(&classifier, rgb, NULL), &output_byte);
+            if (returncode > 0) {
+              text[strlen(text)] = output_byte;
+            } else if (returncode < -1) {
+              text[strlen(text)] = '?';
+            }
+          }
+        }
+        symbols += count;
+      }
+
+      printf("levels %d %-10s: %2d colours, %d bits/transition, %.1f symbols/byte: %s\n",
+             levels, calibrated ? "calibrated" : "nominal", palette.colours, palette.bits,
+             (double)symbols / length, text);
+    }
+  }
+  printf("\n");
+}
+
+void collectLaneByte(void *user, int lane, uint8_t byte, int returncode, long step) {
+  char *text = (char *)user;
+  text[strlen(text)] = (returncode > 0) ? byte : '?';
+}
+
+void collectLaneText(void *user, int lane, uint8_t byte, int returncode, long step) {
+  char (*texts)[32] = (char (*)[32])user;
+  collectLaneByte(texts[lane], lane, byte, returncode, step);
+}
+
+/*
+  One message striped across 1, 4 and 16 lanes, then 3 lanes carrying
+  independent streams of different lengths.
+*/
+void testMultiLane(void) {
+  const char *message = "BIT SLICED LANES MOVE MANY BYTES PER STEP";
+  static const int lane_counts[3] = { 1, 4, 16 };
+
+  printf("# MULTI LANE Test\n");
+  for (int run = 0 ; run < 3 ; run++) {
+    int lanes = lane_counts[run];
+    multiLaneEncoder_t encoder;
+    multiLaneDecoder_t decoder;
+    laneWord_t words[256];
+    char text[128] = {0};
+
+    multiLaneEncoder_init(&encoder, lanes, NULL, PARITY_SETTING);
+    multiLaneDecoder_init(&decoder, lanes, NULL, PARITY_SETTING);
+    long count = multiLaneEncoder_stripe(&encoder, (const uint8_t *)message, strlen(message), words, 255);
+    words[count++] = multiLaneEncoder_close(&encoder);
+    for (long i = 0 ; i < count ; i++) {
+      multiLaneDecoder_push(&decoder, &words[i], collectLaneByte, text);
+    }
+    printf("%2d lanes: %3ld steps, %5.2f bytes/step: %s\n", lanes, count - 1, (double)decoder.bytes / (count - 1), text);
+  }
+
+  const char *streams[3] = { "RED LANE", "GREEN", "BLUE LANE LONGEST" };
+  char texts[3][32] = {{0}};
+  multiLaneEncoder_t encoder;
+  multiLaneDecoder_t decoder;
+  multiLaneEncoder_init(&encoder, 3, NULL, PARITY_SETTING);
+  multiLaneDecoder_init(&decoder, 3, NULL, PARITY_SETTING);
+  for (int i = 0 ; i < 17 ; i++) {
+    uint8_t data[3];
+    uint32_t active = 0;
+    laneWord_t words[5];
+    for (int lane = 0 ; lane < 3 ; lane++) {
+      if (i < (int)strlen(streams[lane])) {
+        data[lane] = streams[lane][i];
+        active |= 1u << lane;
+      }
+    }
+    multiLaneEncoder_put(&encoder, data, active, words);
+    for (int k = 0 ; k < 5 ; k++) {
+      multiLaneDecoder_push(&decoder, &words[k], collectLaneText, texts);
+    }
+  }
+  for (int lane = 0 ; lane < 3 ; lane++) {
+    printf("lane %d: %s\n", lane, texts[lane]);
+  }
+  printf("\n");
+}
+
+void collectStripeChunk(void *user, const uint8_t *data, int length) {
+  char *text = (char *)user;
+  if (!data) {
+    strcat(text, "_");
+    return;
+  }
+  strncat(text, (const char *)data, length);
+}
+
+/*
+  Four lanes with different speeds and start offsets; lane 3 also loses
+  symbols and gets removed from the stripe set.
+*/
+void testLaneStriping(void) {
+  const char *message = "SKEWED LANES ARE REASSEMBLED IN ORDER AND A LANE THAT KEEPS LOSING SYMBOLS IS DROPPED FROM THE STRIPE SET";
+  static const double rate[4] = { 1.0, 0.9, 0.6, 0.8 };
+  static const int offset[4] = { 0, 37, 11, 5 };
+  static const double drop[4] = { 0, 0, 0, 0.05 };
+  rgb_colour_t queue[4][(STRIPE_CHUNK_MAX + 2) * 5 + 1];
+  int queue_len[4] = {0};
+  int queue_pos[4] = {0};
+  char text[256] = {0};
+  laneStripeTx_t tx;
+  laneStripeRx_t rx;
+  simRandom_t rng;
+  long step;
+
+  printf("# LANE STRIPING Test\n");
+  simRandom_seed(&rng, 39);
+  laneStripeTx_init(&tx, 4, 4, NULL, PARITY_SETTING, (const uint8_t *)message, strlen(message));
+  laneStripeRx_init(&rx, 4, NULL, PARITY_SETTING, collectStripeChunk, text);
+
+  for (step = 0 ; step < 5000 ; step++) {
+    int busy = 0;
+    tx.active = rx.active; // Feedback from receiver to transmitter
+    for (int lane = 0 ; lane < 4 ; lane++) {
+      if (queue_pos[lane] == queue_len[lane]) {
+        queue_len[lane] = laneStripeTx_next(&tx, lane, queue[lane]);
+        queue_pos[lane] = 0;
+      }
+      if (queue_pos[lane] == queue_len[lane]) {
+        continue;
+      }
+      busy = 1;
+      if ( (step < offset[lane]) || (simRandom_uniform(&rng) >= rate[lane]) ) {
+        continue;
+      }
+      rgb_colour_t colour = queue[lane][queue_pos[lane]++];
+      if (simRandom_uniform(&rng) >= drop[lane]) {
+        laneStripeRx_push(&rx, lane, colour, step);
+      }
+    }
+    if (!busy) {
+      break;
+    }
+  }
+  laneStripeRx_flush(&rx, step);
+
+  printf("%s\n", text);
+  printf("%ld steps, %u chunks delivered, %u lost\n", step, (unsigned)rx.delivered, (unsigned)rx.lost);
+  for (int lane = 0 ; lane < 4 ; lane++) {
+    laneStats_t *stats = &rx.stats[lane];
+    printf("lane %d: %2u chunks, %2u errors, rate %4.2f%s\n", lane, (unsigned)stats->chunks, (unsigned)stats->errors,
+           stats->error_q8 / 256.0, ((rx.active >> lane) & 1) ? "" : " removed");
+  }
+  printf("\n");
+}
+
+/*
+  Layout of a small grid for the first symbols, then a 32x32 grid at
+  720p60 written as PPM and read back to check the cells.
+*/
+void testScreenGrid(void) {
+  static const char letters[8] = { '.', 'B', 'G', 'C', 'R', 'M', 'Y', 'W' };
+  const char *message = "SCREEN GRID";
+  gridTransmitter_t tx;
+
+  printf("# SCREEN GRID Test\n");
+  gridTransmitter_init(&tx, 64, 48, 60, 4, 3, NULL, PARITY_SETTING);
+  gridTransmitter_load(&tx, (const uint8_t *)message, strlen(message));
+  for (int symbol = 0 ; symbol < 2 ; symbol++) {
+    gridTransmitter_next(&tx);
+    printf("symbol %d:\n", symbol);
+    for (int gy = 0 ; gy < tx.rows + 2 ; gy++) {
+      printf("  ");
+      for (int gx = 0 ; gx < tx.columns + 2 ; gx++) {
+        printf("%c", letters[gridTransmitter_layout(&tx, gx, gy)]);
+      }
+      printf("\n");
+    }
+  }
+  gridTransmitter_destroy(&tx);
 
-  // Guard
-  halfnibble = halfnibble & 0x03;
+  static uint8_t payload[4096];
+  for (int i = 0 ; i < (int)sizeof(payload) ; i++) {
+    payload[i] = (uint8_t)(i * 7 + 3);
+  }
+  if (gridTransmitter_init(&tx, 1280, 720, 60, 32, 32, NULL, PARITY_SETTING) < 0) {
+    printf("grid init failed\n\n");
+    return;
+  }
+  gridTransmitter_load(&tx, payload, sizeof(payload));
 
-  // Find Offset: Cannot repeat colour when sending every 2 bits of data (Since this is clocked by each colour transition)
-  switch (previous_colour) {
-  case (DARK):  // Channel Offline
-    offset = 0;
-    break;
-  case (BLUE):
-    offset = 1;
-    break;
-  case (GREEN):
-    offset = 2;
-    break;
-  case (CYAN):
-    offset = 3;
-    break;
-  case (RED):
-    offset = 4;
-    break;
-  case (MAGENTA):
-    offset = 5;
-    break;
-  case (YELLOW):
-    offset = 0;
-    break;
-  case (WHITE):
-    offset = 0;
-    break;
+  FILE *video = tmpfile();
+  long frames = video ? gridTransmitter_stream(&tx, VIDEO_PPM, video) : -1;
+  printf("32x32 grid, %d px cells: %ld frames for %d bytes, %.0f bytes/s at %.0f Hz (one LED: %.0f bytes/s)\n",
+         tx.cell, frames, (int)sizeof(payload), sizeof(payload) * tx.scene.fps / frames, tx.scene.fps, tx.scene.fps / 5);
+
+  // Read back and decode each cell from its centre pixel
+  videoReader_t reader;
+  colourClassifier_t classifier = { .on_level = 128, .min_pixels = 1, .step = 1 };
+  int errors = 0;
+  long decoded = 0;
+  if (video) {
+    rewind(video);
+  }
+  if ( video && (videoReader_open(&reader, video, VIDEO_PPM, 0, 0) == 0) ) {
+    colourDecoder_t *decoders = calloc(32 * 32, sizeof(colourDecoder_t));
+    uint8_t *data = malloc(reader.frame_size);
+    videoFrame_t frame = { .data = data };
+    for (int i = 0 ; i < 32 * 32 ; i++) {
+      colourDecoder_init(&decoders[i], NULL, PARITY_SETTING);
+    }
+    for (long f = 0 ; videoReader_read(&reader, &frame) == 1 ; f++) {
+      for (int i = 0 ; i < 32 * 32 ; i++) {
+        uint8_t rgb[3], output_byte;
+        int x = tx.origin_x + (i % 32 + 1) * tx.cell + tx.cell / 2;
+        int y = tx.origin_y + (i / 32 + 1) * tx.cell + tx.cell / 2;
+        videoFrame_rgb(&frame, x, y, rgb);
+        int returncode = colourDecoder_push(&decoders[i], colourClassify_rgb(&classifier, rgb), &output_byte);
+        if (returncode > 0) {
+          errors += (output_byte != payload[(decoders[i].byte_count - 1) * 32 * 32 + i]);
+          decoded++;
+        } else if (returncode < -1) {
+          errors++;
+        }
+      }
+    }
+    free(decoders);
+    free(data);
   }
+  printf("read back %ld bytes, %d errors\n\n", decoded, errors);
+  if (video) {
+    fclose(video);
+  }
+  gridTransmitter_destroy(&tx);
+}
 
-  // 5 colour state for transmitting 2bits without seperate clock.
-  rgb_colour_t halfByteColour[5] = {
-    BLUE,
-    GREEN,
-    CYAN,
-    RED,
-    MAGENTA
-  };
+typedef struct gridCheck {
+  const uint8_t *payload;
+  long length;
+  int cells;
+  long slots[32 * 32];   // Bytes seen per cell
+  long bytes;
+  long errors;
+} gridCheck_t;
 
+void checkGridByte(void *user, int cell, uint8_t byte, int returncode, long frame) {
+  gridCheck_t *check = (gridCheck_t *)user;
+  long index = check->slots[cell]++ * check->cells + cell;
+  if ( (returncode > 0) && (index < check->length) && (byte == check->payload[index]) ) {
+    check->bytes++;
+  } else {
+    check->errors++;
+  }
+}
 
-  // Returns the next colour in seqence
-  return halfByteColour[ (halfnibble + offset) % 5 ];
+// Photograph `screen` through `to_screen` (capture pixel -> screen pixel) with some sensor noise
+static void gridCamera_capture (const uint8_t *screen, int screen_width, int screen_height, const homography_t *to_screen,
+                                uint8_t *capture, int width, int height, uint32_t frame) {
+  for (int y = 0 ; y < height ; y++) {
+    for (int x = 0 ; x < width ; x++) {
+      double sx, sy;
+      uint8_t *pixel = &capture[((size_t)y * width + x) * 3];
+      homography_apply(to_screen, x, y, &sx, &sy);
+      int px = (int)sx;
+      int py = (int)sy;
+      uint32_t noise = videoNoise_hash(41, frame, x, y);
+      for (int c = 0 ; c < 3 ; c++) {
+        int level = ( (px >= 0) && (py >= 0) && (px < screen_width) && (py < screen_height) ) ?
+                    screen[((size_t)py * screen_width + px) * 3 + c] * 7 / 8 + 12 : 12;
+        pixel[c] = clampByte(level + (int)((noise >> (10 * c)) & 0x1F) - 16);
+      }
+    }
+  }
 }
 
+/*
+  A 32x32 grid on a 720p screen, held 2 frames per symbol, filmed at
+  1080p with perspective, then again with the camera upside down.
+*/
+void testGridReceiver(void) {
+  static const double screen_corners[4][2] = { {0, 0}, {1280, 0}, {1280, 720}, {0, 720} };
+  static const double seen_corners[4][2] = { {260, 140}, {1700, 210}, {1640, 960}, {300, 900} };
+  static uint8_t payload[2048];
+  int width = 1920, height = 1080;
 
-void toColourSeq_uint8 (const uint8_t data, rgb_colour_t colourSeq[100], int *seq_ptr) {
-  int j = *seq_ptr;
-  rgb_colour_t previous_colour;
+  printf("# GRID RECEIVER Test\n");
+  for (int i = 0 ; i < (int)sizeof(payload) ; i++) {
+    payload[i] = (uint8_t)(i * 13 + 5);
+  }
+  uint8_t *screen = malloc(1280 * 720 * 3);
+  uint8_t *capture = malloc((size_t)width * height * 3);
+  if (!screen || !capture) {
+    free(screen);
+    free(capture);
+    return;
+  }
 
-  previous_colour = (j == 0) ? DARK : colourSeq[j - 1];
+  for (int rotation = 0 ; rotation < 4 ; rotation += 2) {
+    gridTransmitter_t tx;
+    gridReceiver_t rx;
+    gridCheck_t check = { .payload = payload, .length = sizeof(payload), .cells = 32 * 32 };
+    homography_t to_screen;
+    double seen[4][2];
+    long frames = 0;
 
+    for (int k = 0 ; k < 4 ; k++) {
+      seen[k][0] = seen_corners[(k + rotation) % 4][0];
+      seen[k][1] = seen_corners[(k + rotation) % 4][1];
+    }
+    homography_fromCorners(&to_screen, seen, screen_corners);
+    gridTransmitter_init(&tx, 1280, 720, 60, 32, 32, NULL, PARITY_SETTING);
+    gridTransmitter_load(&tx, payload, sizeof(payload));
+    if (gridReceiver_init(&rx, 32, 32, NULL, PARITY_SETTING, 4) < 0) {
+      gridTransmitter_destroy(&tx);
+      continue;
+    }
+    rx.sink = checkGridByte;
+    rx.user = &check;
 
-  // Data
-  for (int i = 0 ; i < 4; i++) { // 4 data seq + 1 mark seq
-    uint8_t half_nibble = (data >> 2 * (3 - i)) & 0x3; // next 2 bits
+    while (gridTransmitter_next(&tx)) {
+      gridTransmitter_render(&tx, screen);
+      for (int repeat = 0 ; repeat < 2 ; repeat++) {
+        videoFrame_t frame = { .width = width, .height = height, .format = VIDEO_RAW_RGB24, .data = capture };
+        gridCamera_capture(screen, 1280, 720, &to_screen, capture, width, height, frames++);
+        gridReceiver_frame(&rx, &frame);
+      }
+    }
 
-    colourSeq[j] = nextColourSeq_from_2bit(half_nibble, previous_colour);
+    printf("rotation %3d: %s, corners (%.0f,%.0f) (%.0f,%.0f) (%.0f,%.0f) (%.0f,%.0f)\n", rotation * 90,
+           rx.locked ? "locked" : "not locked", rx.corners[0][0], rx.corners[0][1], rx.corners[1][0], rx.corners[1][1],
+           rx.corners[2][0], rx.corners[2][1], rx.corners[3][0], rx.corners[3][1]);
+    printf("  %ld frames, %ld symbols, %ld repeats skipped, %ld cell changes of %ld cells sampled\n",
+           frames, rx.symbols, rx.skipped, rx.cells_changed, rx.symbols * 32 * 32);
+    printf("  %ld of %ld bytes correct, %ld errors\n", check.bytes, (long)sizeof(payload), check.errors);
+    gridReceiver_destroy(&rx);
+    gridTransmitter_destroy(&tx);
+  }
+  free(screen);
+  free(capture);
+  printf("\n");
+}
 
-    previous_colour = colourSeq[j];
-    j++;
+/*
+  A 1200 byte payload in 24 byte blocks (K = 50) over a channel losing a
+  quarter of the packets, with receivers joining at random times. Then one
+  receiver decoding the colour stream itself, joining mid packet.
+*/
+void testFountain(void) {
+  static uint8_t payload[1200];
+  uint8_t packet[PACKET_MAX];
+  fountainEncoder_t encoder;
+  simRandom_t rng;
+
+  printf("# FOUNTAIN CODE Test\n");
+  for (int i = 0 ; i < (int)sizeof(payload) ; i++) {
+    payload[i] = (uint8_t)(i * 31 + 7);
   }
+  if (fountainEncoder_init(&encoder, payload, sizeof(payload), 24) < 0) {
+    printf("encoder init failed\n\n");
+    return;
+  }
+  simRandom_seed(&rng, 42);
 
-  // Mark End of Word (And also include parity bit)
-  if ( (calcParity_u8bit(data, PARITY_SETTING ) == 0 ) || PARITY_SETTING == NO_PARITY ) { //1
-    colourSeq[j] = WHITE; // parity = 0
-  } else {
-    colourSeq[j] = YELLOW; // parity = 1
+  double overhead = 0;
+  double elapsed = 0;
+  int complete = 0;
+  const int receivers = 8;
+  for (int r = 0 ; r < receivers ; r++) {
+    fountainDecoder_t decoder;
+    fountainDecoder_init(&decoder);
+    encoder.id = simRandom_u32(&rng) % 5000; // Joins at a random point of the stream
+    uint32_t start = encoder.id;
+    int done = 0;
+    while ( !done && (encoder.id - start < 1000) ) {
+      int length = fountainEncoder_packet(&encoder, packet);
+      if (simRandom_uniform(&rng) < 0.25) {
+        continue; // Lost
+      }
+      done = (fountainDecoder_packet(&decoder, packet, length) == 1);
+    }
+    if ( done && !memcmp(decoder.blocks, payload, sizeof(payload)) ) {
+      complete++;
+      overhead += (double)decoder.packets / decoder.k;
+      elapsed += (double)(encoder.id - start) / decoder.k;
+    }
+    fountainDecoder_destroy(&decoder);
   }
+  printf("%d of %d late joiners complete, K = %d: %.2f K packets received, %.2f K sent since joining (25%% loss)\n",
+         complete, receivers, encoder.k, overhead / complete, elapsed / complete);
 
-  j++;
+  // Colour level: join 3 colours into a packet
+  colourEncoder_t colour_encoder;
+  packetReceiver_t receiver;
+  fountainDecoder_t decoder;
+  rgb_colour_t colours[PACKET_MAX * 5 + 1];
+  long symbols = 0;
+  int result = 0;
 
-  // Return Values
-  *seq_ptr = j;
-  return;
+  colourEncoder_init(&colour_encoder, NULL, PARITY_SETTING);
+  packetReceiver_init(&receiver, NULL, PARITY_SETTING);
+  fountainDecoder_init(&decoder);
+  encoder.id = 777;
+  for (int p = 0 ; (p < 1000) && (result != 1) ; p++) {
+    int count = packetEncode_colours(&colour_encoder, packet, fountainEncoder_packet(&encoder, packet), colours);
+    for (int i = (p == 0) ? 3 : 0 ; (i < count) && (result != 1) ; i++) {
+      int length = packetReceiver_push(&receiver, colours[i]);
+      symbols++;
+      if (length) {
+        result = fountainDecoder_packet(&decoder, receiver.packet, length);
+      }
+    }
+  }
+  long minimum = (long)encoder.k * (FOUNTAIN_HEADER + encoder.block_size + 1) * 5;
+  printf("colour stream: %s after %ld symbols (%.2f x the %ld symbols of K packets), %u packets, %u dropped\n",
+         ( (result == 1) && !memcmp(decoder.blocks, payload, sizeof(payload)) ) ? "payload rebuilt" : "failed",
+         symbols, (double)symbols / minimum, minimum, (unsigned)receiver.packets, (unsigned)receiver.dropped);
+  fountainDecoder_destroy(&decoder);
+  fountainEncoder_destroy(&encoder);
+  printf("\n");
 }
 
 /*
-  DECODE
+  A 480 byte message in 16 byte blocks repeated over a channel that
+  misreads 2% of the colours. Voting across passes against waiting for a
+  clean copy of every block.
 */
+void testCarousel(void) {
+  static uint8_t message[480];
+  uint8_t packet[PACKET_MAX];
+  rgb_colour_t colours[PACKET_MAX * 5 + 1];
+  colourEncoder_t encoder;
+  carouselReceiver_t voting;
+  packetReceiver_t plain;
+  uint8_t clean_done[30] = {0};
+  int clean_count = 0;
+  int voting_pass = 0, clean_pass = 0;
+  simRandom_t rng;
 
-/**
+  printf("# CAROUSEL Test\n");
+  for (int i = 0 ; i < (int)sizeof(message) ; i++) {
+    message[i] = (uint8_t)(i * 11 + 1);
+  }
+  simRandom_seed(&rng, 43);
+  colourEncoder_init(&encoder, NULL, PARITY_SETTING);
+  carouselReceiver_init(&voting, NULL, PARITY_SETTING, NULL, NULL);
+  packetReceiver_init(&plain, NULL, PARITY_SETTING);
 
-  Return Values:
-    0 - succesful return of value
-    1 - mark 1
-    2 - mark 2
-*/
-int nextColourSeq_to_2bit (const rgb_colour_t incoming_colour, const rgb_colour_t previous_colour, uint8_t *halfnibble_out) {
-  if (incoming_colour == previous_colour) {
-    return -1; // Indicate that the channel is iding
+  for (int pass = 1 ; (pass <= 100) && (!voting_pass || !clean_pass) ; pass++) {
+    for (int index = 0 ; index < 30 ; index++) {
+      int count = packetEncode_colours(&encoder, packet, carousel_packet(message, sizeof(message), 16, index, packet), colours);
+      for (int i = 0 ; i < count ; i++) {
+        rgb_colour_t colour = colours[i];
+        if (simRandom_uniform(&rng) < 0.02) {
+          colour = (colour + 1 + simRandom_u32(&rng) % 7) & 0x07; // Misread as some other colour
+        }
+        if ( carouselReceiver_push(&voting, colour) && !voting_pass ) {
+          voting_pass = pass;
+        }
+        int length = packetReceiver_push(&plain, colour);
+        if ( (length == CAROUSEL_HEADER + 17) && (crc8_update(0, plain.packet, 5) == plain.packet[5]) &&
+             (crc8_update(0, plain.packet + CAROUSEL_HEADER, 16) == plain.packet[CAROUSEL_HEADER + 16]) ) {
+          int block = (plain.packet[2] << 8) | plain.packet[3];
+          if ( (block < 30) && !clean_done[block] ) {
+            clean_done[block] = 1;
+            if ( (++clean_count == 30) && !clean_pass ) {
+              clean_pass = pass;
+            }
+          }
+        }
+      }
+    }
   }
-  // Find Offset: Cannot repeat colour when sending every 2 bits of data (Since this is clocked by each colour transition)
-  uint8_t offset = 0;
-  switch (previous_colour) {
-  case (DARK):  // Channel Offline
-    offset = 0;
-    break;
-  case (BLUE):
-    offset = 1;
-    break;
-  case (GREEN):
-    offset = 2;
-    break;
-  case (CYAN):
-    offset = 3;
-    break;
-  case (RED):
-    offset = 4;
-    break;
-  case (MAGENTA):
-    offset = 5;
-    break;
-  case (YELLOW):
-    offset = 0;
-    break;
-  case (WHITE):
-    offset = 0;
-    break;
+
+  printf("voting:      complete after pass %d, %s, %u of %u copies clean, %u tie breaks\n", voting_pass,
+         (voting.length && !memcmp(voting.message, message, sizeof(message))) ? "message correct" : "message wrong",
+         (unsigned)voting.clean, (unsigned)voting.packets, (unsigned)voting.tie_breaks);
+  printf("clean copy:  complete after pass %d\n", clean_pass);
+  printf("vote state:  %d bytes for %d message bytes\n\n", voting.blocks * (CAROUSEL_HEADER + voting.block_size + 1) * (int)CAROUSEL_VOTE_BYTES, (int)sizeof(message));
+  carouselReceiver_destroy(&voting);
+}
+
+void collectSyncByte(void *user, uint8_t byte, int returncode) {
+  char *text = (char *)user;
+  text[strlen(text)] = (returncode > 0) ? byte : '?';
+}
+
+/*
+  Receivers joining a stream at different points, and one that misses a
+  transition part way through.
+*/
+void testResync(void) {
+  const char *message = "LATE JOINERS LOCK WITHIN A FEW SYMBOLS";
+  static const int joins[5] = { 0, 2, 4, 9, 23 };
+  uint8_t colours[256];
+  colourEncoder_t encoder;
+  int count = 0;
+
+  printf("# RESYNC Test\n");
+  colourEncoder_init(&encoder, NULL, PARITY_SETTING);
+  colours[count++] = DARK; // Channel opens
+  for (int i = 0 ; message[i] ; i++) {
+    rgb_colour_t out[5];
+    colourEncoder_put_uint8(&encoder, message[i], out);
+    for (int k = 0 ; k < 5 ; k++) {
+      colours[count++] = out[k];
+    }
   }
 
-  // Corresponding Nibble Base
-  uint8_t nibblebase = 0;
-  switch (incoming_colour) {
-  case (DARK): //0
-    return -2; // Channel Going Down
-    break;
-  case (BLUE): //1
-    nibblebase = 0;
-    break;
-  case (GREEN): //2
-    nibblebase = 1;
-    break;
-  case (CYAN): //3
-    nibblebase = 2;
-    break;
-  case (RED): //4
-    nibblebase = 3;
-    break;
-  case (MAGENTA): //5
-    nibblebase = 4;
-    break;
-  case (YELLOW): //6
-    return 2; // Mark 2
-    break;
-  case (WHITE): //7
-    return 1; // Mark 1
-    break;
+  for (int j = 0 ; j < 5 ; j++) {
+    colourSync_t sync;
+    char text[64] = {0};
+    colourSync_init(&sync, NULL, PARITY_SETTING, 2);
+    colourSync_process(&sync, colours + joins[j], count - joins[j], collectSyncByte, text);
+    printf("join at %2d: locked after %2ld symbols, %u dropped: %s\n", joins[j], sync.last_sync_symbols, (unsigned)sync.bytes_dropped, text);
   }
 
-  uint8_t halfnibble;
+  // Miss one transition in the middle of byte 10
+  colourSync_t sync;
+  char text[64] = {0};
+  uint8_t damaged[256];
+  memcpy(damaged, colours, 53);
+  memcpy(damaged + 53, colours + 54, count - 54);
+  colourSync_init(&sync, NULL, PARITY_SETTING, 2);
+  colourSync_process(&sync, damaged, count - 1, collectSyncByte, text);
+  printf("missed one: %u loss, relocked after %2ld symbols: %s\n", (unsigned)sync.losses, sync.last_sync_symbols, text);
+  printf("\n");
+}
+
+void testInterleaver(void) {
+  static const char *mode_str[] = { "uncoded", "xor 8", "xor 8 block", "xor 8 conv" };
+  static const int codeword[] = { 0, 8, 8, 8 };
+  static const interleaveMode_t interleave[] = { INTERLEAVE_NONE, INTERLEAVE_NONE, INTERLEAVE_BLOCK, INTERLEAVE_CONVOLUTIONAL };
+  simConfig_t config = {
+    .camera = {
+      .fps = 30,
+      .exposure = 0.5,
+      .frame_jitter = 0.05,
+      .drop_prob = 0.0,
+      .misclass_prob = 0.0,
+      .burst_prob = 0.002,
+      .burst_frames = 12
+    },
+    .symbol_period = 0.1,
+    .symbol_jitter = 0.1,
+    .map = NULL,
+    .parity = EVEN_PARITY,
+    .max_blend_len = 0,
+    .payload_len = 224,
+    .interleave_depth = 8,
+    .trials = 64,
+    .threads = 4,
+    .seed = 3
+  };
+  simResult_t result;
+  uint8_t in[40 * 37], out[40 * 37], back[40 * 37];
+  int round_trip = 1;
 
-  /*
-  This check is required because of the effect of subtraction operation result going below zero in an unsigned variable.
-  */
-  //if (incoming_colour > previous_colour) {
-  if (nibblebase >= offset) {
-    halfnibble = (nibblebase - offset) % 4;
-  } else {
-    halfnibble = (5 + nibblebase - offset) % 4;
+  printf("# INTERLEAVER Test\n");
+  for (int i = 0 ; i < 40 * 37 ; i++) {
+    in[i] = i * 7 + 3;
+  }
+  blockInterleave(in, out, 40, 37);
+  blockDeinterleave(out, back, 40, 37);
+  round_trip = (memcmp(in, back, sizeof(in)) == 0) && (out[1] == in[37]) && (out[40] == in[1]);
+  printf("block transpose 40x37 round trip: %s\n", round_trip ? "ok" : "FAIL");
+
+  printf("%d trials x %d bytes, bursts of %d dropped frames (p=%.3f per frame), depth %d\n",
+         config.trials, config.payload_len, config.camera.burst_frames, config.camera.burst_prob, config.interleave_depth);
+  for (int mode = 0 ; mode < 4 ; mode++) {
+    config.codeword_len = codeword[mode];
+    config.interleave = interleave[mode];
+    if (simRun(&config, &result) == 0) {
+      // Rejections count decoder events uncoded but payload bytes coded, so compare what got through
+      printf("%-12s | BER %.4f | not delivered %5llu of %llu | undetected %4llu | goodput %6.2f B/s | latency %6.0f ms\n",
+             mode_str[mode], result.byte_error_rate, (unsigned long long)(result.bytes_sent - result.bytes_correct),
+             (unsigned long long)result.bytes_sent, (unsigned long long)result.bytes_undetected, result.goodput,
+             result.mean_latency * 1000);
+    }
   }
+  printf("\n");
+}
 
+void testArq(void) {
+  static const char *mode_str[] = { "selective", "go-back-N" };
+  static const int interval[] = { 0, 100 };
+  arqConfig_t config = {
+    .map = NULL,
+    .parity = EVEN_PARITY,
+    .message_len = 8,
+    .messages = 120,
+    .delay = 30,
+    .drop_prob = 0.003,
+    .misread_prob = 0.0005,
+    .max_ticks = 200000,
+    .symbol_period = 0.1,
+    .seed = 5
+  };
+  arqResult_t result;
 
+  printf("# SELECTIVE REPEAT ARQ Test\n");
+  printf("%d messages x %d bytes, %d tick delay each way, %.1f%% of symbols dropped\n",
+         config.messages, config.message_len, config.delay, config.drop_prob * 100);
+  for (int i = 0 ; i < 2 ; i++) {
+    config.interval = interval[i];
+    for (int mode = ARQ_SELECTIVE_REPEAT ; mode <= ARQ_GO_BACK_N ; mode++) {
+      config.mode = mode;
+      int returncode = arqLoopback_run(&config, &result);
+      if (returncode < 0) {
+        continue;
+      }
+      printf("%-5s %-10s | %s | frames %4u (resent %3u, timeouts %2u) | damaged %3u | wrong %u | goodput %4.2f B/s | latency %5.1f s\n",
+             config.interval ? "paced" : "bulk", mode_str[mode], returncode ? "timed out" : "complete", result.frames_sent,
+             result.retransmissions, result.timeouts, result.damaged, result.corrupted, result.goodput, result.mean_latency);
+    }
+  }
+  printf("\n");
+}
 
-  // Return Nibble
-  *halfnibble_out = halfnibble & 0x03;
+void testAdaptiveCoding(void) {
+  static const char *mode_str[] = { "parity", "crc", "fec 16", "fec 8", "fec 4", "fec 2" };
+  static const codePhase_t phases[] = {
+    { 6000, 0.0001, 0.0001 },   // Close and dim
+    { 6000, 0.004, 0.002 },     // Further away
+    { 6000, 0.015, 0.005 },     // Bright light, far away
+    { 6000, 0.0001, 0.0001 }
+  };
+  codeLinkConfig_t config = {
+    .payload_len = 32,
+    .phases = phases,
+    .phase_count = 4,
+    .delay = 30,
+    .symbol_period = 0.1,
+    .seed = 9
+  };
+  codeLinkResult_t result;
 
-  return 0; // Sucessfully returned a nibble
+  printf("# ADAPTIVE CODING Test\n");
+  printf("%d byte frames, drop rate per symbol by phase:", config.payload_len);
+  for (int i = 0 ; i < config.phase_count ; i++) {
+    printf(" %.2f%%", phases[i].drop_prob * 100);
+  }
+  printf("\n");
+  for (int mode = CODE_PARITY ; mode <= CODE_MODES ; mode++) {
+    config.adaptive = (mode == CODE_MODES);
+    config.mode = config.adaptive ? CODE_CRC : mode;
+    if (codeLink_run(&config, &result) == 0) {
+      printf("%-8s | frames %4u | lost %4u | undetected %2u | switches %2u | goodput %5.2f B/s\n",
+             config.adaptive ? "adaptive" : mode_str[mode], result.frames, result.lost, result.undetected,
+             result.switches, result.goodput);
+    }
+  }
+  printf("\n");
 }
 
+#define MUX_DEMO_MESSAGES 512
 
-int fromColourSeq_get_uint8 (const rgb_colour_t colourSeq[100], int *seq_ptr, uint8_t *output ) {
-  rgb_colour_t previous_colour;
-  rgb_colour_t incoming_colour;
+typedef struct muxDemoLog {
+  long tick;
+  long written[MUX_CHANNELS][MUX_DEMO_MESSAGES];   // Tick each message was queued
+  int writes[MUX_CHANNELS];
+  int arrivals[MUX_CHANNELS];
+  long latency_sum[MUX_CHANNELS];
+  long latency_max[MUX_CHANNELS];
+} muxDemoLog_t;
 
-  previous_colour = ((*seq_ptr) == 0) ? DARK : colourSeq[ (*seq_ptr) - 1];
+void collectMuxSegment(void *user, int channel, const uint8_t *data, int length) {
+  muxDemoLog_t *log = (muxDemoLog_t *)user;
+  for (int i = 0 ; i < length ; i++) {
+    if ( (data[i] == '\n') && (log->arrivals[channel] < log->writes[channel]) ) {
+      long latency = log->tick - log->written[channel][log->arrivals[channel]++];
+      log->latency_sum[channel] += latency;
+      log->latency_max[channel] = (latency > log->latency_max[channel]) ? latency : log->latency_max[channel];
+    }
+  }
+}
 
-  // Communication Line is Closed
-  rgb_colour_t seqPeek = colourSeq[(*seq_ptr)];
-  if ( seqPeek == DARK ){
-    return -1;
+void muxDemo_write(muxTransmitter_t *tx, muxDemoLog_t *log, int channel, const char *message) {
+  if ( (log->writes[channel] < MUX_DEMO_MESSAGES) &&
+       (muxTransmitter_write(tx, channel, (const uint8_t *)message, strlen(message)) == (int)strlen(message)) ) {
+    log->written[channel][log->writes[channel]++] = log->tick;
   }
+}
 
-  // Extract next 8bit from stream
-  *output = 0x00;
-  for (int i = 0 ; i < 5 ; i++) {
-    uint8_t halfnibble_out;
+/*
+  Telemetry keeps the link saturated while stdout, stderr and control
+  messages come and go. Latency from queueing a message to its last byte
+  arriving, with priorities and with plain round robin.
+*/
+void testChannelMux(void) {
+  static const char *channel_str[4] = { "stdout", "stderr", "telemetry", "control" };
+  static const int priority[4] = { 1, 3, 0, 2 };
+  static const int segment_max[4] = { 16, 8, 16, 4 };
+  const double symbol_period = 0.01;
+  static muxDemoLog_t log;
 
-    incoming_colour = colourSeq[(*seq_ptr)];
-    int return_code = nextColourSeq_to_2bit ( incoming_colour, previous_colour, &halfnibble_out);
-    previous_colour = incoming_colour;
+  printf("# CHANNEL MUX Test\n");
+  for (int prioritised = 1 ; prioritised >= 0 ; prioritised--) {
+    muxTransmitter_t tx;
+    muxReceiver_t rx;
+    simRandom_t rng;
+    long next_stderr = 300;
+    char message[32];
 
-    (*seq_ptr)++;
+    memset(&log, 0x00, sizeof(log));
+    simRandom_seed(&rng, 11);
+    muxTransmitter_init(&tx, NULL);
+    muxReceiver_init(&rx, NULL);
+    for (int c = 0 ; c < 4 ; c++) {
+      muxTransmitter_channel(&tx, c, prioritised ? priority[c] : 0, segment_max[c]);
+      muxReceiver_sink(&rx, c, collectMuxSegment, &log);
+    }
 
-    switch (return_code) {
-    case (2): // Mark 2
-      return 2; // Yellow: Sucessfully Received a Byte (Parity bit = 1)
-      break;
-    case (1): // Mark 1
-      return 1; // White: Sucessfully Received a Byte (Parity bit = 0)
-      break;
-    case (0): // Shift in half a nibble
-      *output = *output << 2; // Shift by half nibble
-      *output |= halfnibble_out;
-      break;
-    case (-1): // idling line keep scanning
-      break;
-    case (-2): // Communication Closed Unexpectedly
-      return -1;
-      break;
+    for (log.tick = 0 ; log.tick < 30000 ; log.tick++) {
+      if (tx.channels[2].count < 64) {
+        snprintf(message, sizeof(message), "T%05ld:%08x\n", log.tick % 100000, (unsigned)simRandom_u32(&rng));
+        muxDemo_write(&tx, &log, 2, message);
+      }
+      if (log.tick % 400 == 0) {
+        snprintf(message, sizeof(message), "tick %6ld ok\n", log.tick);
+        muxDemo_write(&tx, &log, 0, message);
+      }
+      if (log.tick == next_stderr) {
+        snprintf(message, sizeof(message), "E%03d!\n", log.writes[1]);
+        muxDemo_write(&tx, &log, 1, message);
+        next_stderr += 400 + simRandom_u32(&rng) % 800;
+      }
+      if (log.tick % 1500 == 750) {
+        muxDemo_write(&tx, &log, 3, "C1\n");
+      }
+      muxReceiver_push(&rx, muxTransmitter_next(&tx));
     }
 
+    printf("%s: %u segments, %u dropped", prioritised ? "priority" : "round robin", rx.segments, rx.dropped);
+    if (prioritised) {
+      // One segment of 16 bytes ahead of it, then its own 6 bytes
+      printf(", stderr bound %.0f ms", ((16 + 2) * 5 + (6 + 2) * 5) * symbol_period * 1000);
+    }
+    printf("\n");
+    for (int c = 0 ; c < 4 ; c++) {
+      printf("  %-9s | prio %d | messages %3d of %3d | latency mean %7.1f ms, max %7.1f ms\n",
+             channel_str[c], prioritised ? priority[c] : 0, log.arrivals[c], log.writes[c],
+             log.arrivals[c] ? (double)log.latency_sum[c] / log.arrivals[c] * symbol_period * 1000 : 0,
+             log.latency_max[c] * symbol_period * 1000);
+    }
   }
-  return 0; // Only supports up to 8bit
+  printf("\n");
 }
 
+/*
+  A burst of log calls sent as deferred records, received through the
+  packet receiver and expanded on the host, against sending the same
+  lines as text.
+*/
+void testDeferredLog(void) {
+  static const struct { deferredLogId_t id; int32_t args[3]; } calls[] = {
+    { LOG_BOOT, { 2, 7, 1 } },
+    { LOG_BATTERY, { 3712, 24 } },
+    { LOG_SENSOR_FAIL, { 3, -110 } },
+    { LOG_TX_DONE, { 1536, 412 } },
+    { LOG_POSITION, { -33868820, 151209290, 9 } },
+    { LOG_REGISTER, { 0x1F, (int32_t)0xDEADBEEF } },
+    { LOG_WATCHDOG, { 0 } },
+    { LOG_STATE, { 'I', 'S' } },
+    { LOG_BATTERY, { 3698, -5 } }
+  };
+  int count = sizeof(calls) / sizeof(calls[0]);
+  colourEncoder_t encoder;
+  packetReceiver_t receiver;
+  rgb_colour_t colours[DEFERRED_LOG_RECORD_MAX * 5 + 1];
+  long text_bytes = 0, record_bytes = 0, text_symbols = 0, record_symbols = 0;
+
+  printf("# DEFERRED LOGGING Test\n");
+  colourEncoder_init(&encoder, NULL, EVEN_PARITY);
+  packetReceiver_init(&receiver, NULL, EVEN_PARITY);
+  for (int i = 0 ; i < count ; i++) {
+    uint8_t record[DEFERRED_LOG_RECORD_MAX];
+    char text[96];
+    int record_length = deferredLog_record(calls[i].id, calls[i].args, record);
+    int colour_count = deferredLog_colours(&encoder, calls[i].id, calls[i].args, colours);
+    int length = 0;
+
+    for (int k = 0 ; k < colour_count ; k++) {
+      int packet = packetReceiver_push(&receiver, colours[k]);
+      length = packet ? packet : length;
+    }
+    int text_length = length ? deferredLog_expand(receiver.packet, length, text, sizeof(text)) : -1;
+    if (text_length < 0) {
+      printf("  %2d bytes -> (bad record)\n", record_length);
+      continue;
+    }
+    printf("  %2d bytes -> %2d chars | %s\n", record_length, text_length, text);
+    text_bytes += text_length + 1; // With its newline
+    text_symbols += (text_length + 1) * 5;
+    record_bytes += record_length;
+    record_symbols += colour_count;
+  }
+  printf("text %ld bytes, %ld symbols | deferred %ld bytes, %ld symbols | %.1fx fewer bytes, %.1fx fewer symbols\n\n",
+         text_bytes, text_symbols, record_bytes, record_symbols,
+         (double)text_bytes / record_bytes, (double)text_symbols / record_symbols);
+}
 
 /*
-  TEST TOOLS
+  A day of sensor samples, one every 6 minutes, sent as schema encoded
+  packets with a CRC, decoded into columns and summarised from there.
 */
+void testTelemetry(void) {
+  static const int raw_bytes = 4 + 2 + 2 + 2 + 1 + 1 + 1 + 2; // The same fields as a fixed width struct
+  const int samples = 240;
+  static telemetry_t sent[240];
+  telemetryColumns_t columns;
+  colourEncoder_t encoder;
+  packetReceiver_t receiver;
+  rgb_colour_t colours[(TELEMETRY_MAX_BYTES + 1) * 5 + 1];
+  simRandom_t rng;
+  long bytes = 0, symbols = 0;
+  int mismatches = 0;
 
-// Colour String
-static char *rgb_colour_str[] = {
-  "Dark",
-  "Blue",
-  "Green",
-  "Cyan",
-  "Red",
-  "Magenta",
-  "Yellow",
-  "White"
-};
+  printf("# TELEMETRY SCHEMA Test\n");
+  if (telemetryColumns_init(&columns, samples) < 0) {
+    return;
+  }
+  simRandom_seed(&rng, 21);
+  colourEncoder_init(&encoder, NULL, EVEN_PARITY);
+  packetReceiver_init(&receiver, NULL, EVEN_PARITY);
 
-// Colour Short Version
-static char *rgb_colour_short_str[] = {
-  "D",
-  "B",
-  "G",
-  "C",
-  "R",
-  "M",
-  "Y",
-  "W"
-};
+  telemetry_t sample = { .uptime_s = 86400, .temperature_cc = 1850, .humidity_pct = 55, .battery_mv = 3900 };
+  for (int i = 0 ; i < samples ; i++) {
+    uint8_t frame[TELEMETRY_MAX_BYTES + 1];
+    sample.uptime_s += 360;
+    sample.temperature_cc += (int)(simRandom_u32(&rng) % 61) - 30 + ( (i < samples / 2) ? 8 : -8 ); // Warm day, cool night
+    sample.humidity_pct = 45 + simRandom_u32(&rng) % 20;
+    sample.charging = (i % 80) >= 60;
+    sample.battery_mv += sample.charging ? 12 : -3;
+    sample.state = (i / 10) % 6;
+    sample.door_open = (simRandom_u32(&rng) % 16) == 0;
+    sample.error_count += (simRandom_u32(&rng) % 50) == 0;
+    sent[i] = sample;
 
-// Colour Short Version Marked
-static char *rgb_colour_short_marked_str[] = {
-  "_D_",
-  " B ",
-  " G ",
-  " C ",
-  " R ",
-  " M ",
-  "!Y!",
-  "|W|"
-};
+    int length = telemetry_encode(&sample, frame);
+    frame[length] = crc8_update(0, frame, length);
+    int count = packetEncode_colours(&encoder, frame, length + 1, colours);
+    bytes += length + 1;
+    symbols += count;
 
+    for (int k = 0 ; k < count ; k++) {
+      int packet = packetReceiver_push(&receiver, colours[k]);
+      if ( (packet > 1) && (crc8_update(0, receiver.packet, packet - 1) == receiver.packet[packet - 1]) ) {
+        telemetry_decode(receiver.packet, packet - 1, &columns);
+      }
+    }
+  }
 
+  for (int i = 0 ; i < columns.count ; i++) {
+#define TELEMETRY_CHECK_FIELD(name, kind, bits) mismatches += (columns.name[i] != sent[i].name);
+    TELEMETRY_FIELDS(TELEMETRY_CHECK_FIELD)
+#undef TELEMETRY_CHECK_FIELD
+  }
+  printf("%d fields, %d packed bits | %d of %d samples decoded, %d field mismatches\n",
+         TELEMETRY_FIELD_COUNT, TELEMETRY_PACKED_BITS, columns.count, samples, mismatches);
+  printf("schema %.1f bytes/sample (with crc), raw struct %d bytes | %.1f vs %d symbols/sample | %.1f vs %.1f updates/min at 10 symbols/s\n",
+         (double)bytes / samples, raw_bytes + 1, (double)symbols / samples, (raw_bytes + 1) * 5 + 1,
+         600.0 * samples / symbols, 600.0 / ((raw_bytes + 1) * 5 + 1));
 
-uint8_t displayBinary_uint8_t(uint8_t input) {
-  printf(" %x '%c' = ", input, input);
-  int i;
-  for (i = 8 - 1; i >= 0 ; i--) {
-    if ( (input >> i) & 1u ) {
-      printf("1");
-    } else {
-      printf("0");
+  // Analysis straight off the columns
+  int32_t t_min = columns.temperature_cc[0], t_max = columns.temperature_cc[0];
+  long t_sum = 0, charging = 0, states[8] = { 0 };
+  for (int i = 0 ; i < columns.count ; i++) {
+    t_min = (columns.temperature_cc[i] < t_min) ? columns.temperature_cc[i] : t_min;
+    t_max = (columns.temperature_cc[i] > t_max) ? columns.temperature_cc[i] : t_max;
+    t_sum += columns.temperature_cc[i];
+    charging += columns.charging[i];
+    states[columns.state[i] & 7]++;
+  }
+  if (columns.count) {
+    printf("temperature %.2f / %.2f / %.2f C (min / mean / max), charging %ld%% of samples, samples per state:",
+           t_min / 100.0, t_sum / 100.0 / columns.count, t_max / 100.0, charging * 100 / columns.count);
+    for (int s = 0 ; s < 6 ; s++) {
+      printf(" %ld", states[s]);
     }
+    printf(", battery %d mV, %d errors at the end\n", columns.battery_mv[columns.count - 1], columns.error_count[columns.count - 1]);
   }
+  telemetryColumns_destroy(&columns);
   printf("\n");
-  return input;
 }
 
 int main( void )
@@ -415,7 +9152,7 @@ int main( void )
 
   printf("# Nibble ENCODING & DECODING Test\n");
   uint8_t halfnibble_input;
-  uint8_t halfnibble_output;
+  uint8_t halfnibble_output = 0;
   rgb_colour_t colour_curr;
   rgb_colour_t colour_prev;
   for (int j = 0 ; j < 8 ; j++) {
@@ -486,7 +9223,7 @@ int main( void )
     if (returncode >=0) {
       printf("%c", output_byte);
       // Received Parity
-      uint8_t parity_bit;
+      uint8_t parity_bit = 0;
       switch (returncode) {
       case (1): // White parity=0
         parity_bit = 0x00;
@@ -509,6 +9246,34 @@ int main( void )
     //  printf("X:%d",i);
   }
 
-  printf("\n\n# Completed\n");
+  printf("\n\n");
+
+  testBlendFilter();
+  testColourMap();
+  testChannelSimulator();
+  testSyntheticVideo();
+  testVideoPipeline();
+  testLedTracking();
+  testMultiReceiver();
+  testRollingShutter();
+  testAdcReceiver();
+  testEdgeReceiver();
+  testTimedMode();
+  testPalette();
+  testMultiLane();
+  testLaneStriping();
+  testScreenGrid();
+  testGridReceiver();
+  testFountain();
+  testCarousel();
+  testResync();
+  testInterleaver();
+  testArq();
+  testAdaptiveCoding();
+  testChannelMux();
+  testDeferredLog();
+  testTelemetry();
+
+  printf("# Completed\n");
   return 0;
 }